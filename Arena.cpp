@@ -0,0 +1,79 @@
+#include "Arena.h"
+
+#include <algorithm>
+#include <atomic>
+#include <new>
+
+#include <hnswlib/hugepage_alloc.h>
+
+namespace ivfhnsw {
+
+    namespace {
+        const size_t arena_alignment = 64;
+        const size_t arena_block_size = 8 << 20;
+
+        std::atomic<size_t> arena_allocations(0);  // Allocations served by the arenas
+        std::atomic<size_t> arena_blocks(0);       // Heap blocks taken by the arenas
+        std::atomic<size_t> arena_block_bytes(0);
+    }
+
+    Arena::Arena(): current_(0), offset_(0) {}
+
+    Arena::~Arena()
+    {
+        for (const Block &block : blocks_)
+            hnswlib::hugePageFree(block.data);
+    }
+
+    Arena &Arena::local()
+    {
+        thread_local Arena arena;
+        return arena;
+    }
+
+    void *Arena::allocate(size_t size)
+    {
+        size = (size + arena_alignment - 1) & ~(arena_alignment - 1);
+        arena_allocations.fetch_add(1, std::memory_order_relaxed);
+
+        if (current_ < blocks_.size() && offset_ + size <= blocks_[current_].size) {
+            void *ptr = blocks_[current_].data + offset_;
+            offset_ += size;
+            return ptr;
+        }
+
+        // Move to the next free block, which is large enough, or take a new one from the heap
+        const size_t next = blocks_.empty() ? 0 : current_ + 1;
+        size_t found = next;
+        while (found < blocks_.size() && blocks_[found].size < size)
+            found++;
+
+        if (found < blocks_.size())
+            std::swap(blocks_[next], blocks_[found]);
+        else {
+            const size_t block_size = std::max(size, arena_block_size);
+            Block block{(char *) hnswlib::hugePageAlloc(block_size, "build arenas"), block_size};
+            if (!block.data)
+                throw std::bad_alloc();
+            blocks_.insert(blocks_.begin() + next, block);
+            arena_blocks.fetch_add(1, std::memory_order_relaxed);
+            arena_block_bytes.fetch_add(block_size, std::memory_order_relaxed);
+        }
+        current_ = next;
+        offset_ = size;
+        return blocks_[current_].data;
+    }
+
+    void Arena::rewind(const Mark &mark)
+    {
+        current_ = mark.block;
+        offset_ = mark.offset;
+    }
+
+    void report_arena_stats(std::ostream &out)
+    {
+        out << "Build temporaries: " << arena_blocks.load() << " heap blocks (" << (arena_block_bytes.load() >> 20)
+            << " MB) allocated by thread-local arenas for " << arena_allocations.load() << " requests "
+            << "(estimate of the heap allocations without arenas, not measured)\n";
+    }
+}
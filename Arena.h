@@ -0,0 +1,75 @@
+#ifndef IVF_HNSW_LIB_ARENA_H
+#define IVF_HNSW_LIB_ARENA_H
+
+#include <cstddef>
+#include <ostream>
+#include <vector>
+
+namespace ivfhnsw {
+    /** Per-thread bump allocator for build-time temporaries.
+      *
+      * Memory is handed out from large huge page backed blocks, 64-byte aligned and uninitialized.
+      * Nothing is freed individually: an ArenaScope rewinds the arena to the position
+      * it had at the beginning of the scope, e.g. at the beginning of a group.
+      * Blocks are kept for the later allocations of the thread, so after the first
+      * few groups the build paths do not touch malloc at all.
+    */
+    class Arena {
+    public:
+        /// Position of the arena, see ArenaScope
+        struct Mark {
+            size_t block;
+            size_t offset;
+        };
+
+        Arena();
+        ~Arena();
+
+        /// Arena of the calling thread
+        static Arena &local();
+
+        void *allocate(size_t size);
+
+        template<typename T>
+        T *alloc(size_t n) { return (T *) allocate(n * sizeof(T)); }
+
+        Mark mark() const { return Mark{current_, offset_}; }
+
+        /// Release everything allocated after the mark
+        void rewind(const Mark &mark);
+
+    private:
+        struct Block {
+            char *data;
+            size_t size;
+        };
+        std::vector<Block> blocks_;  ///< Blocks after current_ are free
+        size_t current_;             ///< Block the allocations are served from
+        size_t offset_;              ///< Used bytes of the current block
+
+        Arena(const Arena &);
+        Arena &operator=(const Arena &);
+    };
+
+    /// Rewind the arena at the end of the scope
+    class ArenaScope {
+    public:
+        explicit ArenaScope(Arena &arena = Arena::local()): arena_(arena), mark_(arena.mark()) {}
+        ~ArenaScope() { arena_.rewind(mark_); }
+
+    private:
+        Arena &arena_;
+        Arena::Mark mark_;
+
+        ArenaScope(const ArenaScope &);
+        ArenaScope &operator=(const ArenaScope &);
+    };
+
+    /** Print the number of heap blocks taken by the arenas of all threads and the number of requests they served
+      *
+      * The requests are only an estimate of the heap allocations the build would make without the arenas:
+      * some of the replaced buffers were reused thread-local vectors, which did not allocate on every call.
+    */
+    void report_arena_stats(std::ostream &out);
+}
+#endif //IVF_HNSW_LIB_ARENA_H
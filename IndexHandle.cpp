@@ -0,0 +1,34 @@
+#include "IndexHandle.h"
+
+#include <chrono>
+#include <thread>
+
+namespace ivfhnsw {
+
+    IndexHandle::IndexHandle(IndexIVF_HNSW *index)
+    {
+        IndexSnapshot *snapshot = new IndexSnapshot;
+        snapshot->index.reset(index);
+        snapshot->version = 0;
+        current.reset(snapshot);
+    }
+
+    uint64_t IndexHandle::publish(IndexIVF_HNSW *index, size_t poll_us)
+    {
+        std::lock_guard<std::mutex> lock(publish_guard);
+
+        std::shared_ptr<IndexSnapshot> snapshot = std::make_shared<IndexSnapshot>();
+        snapshot->index.reset(index);
+        snapshot->version = current->version + 1;
+        const uint64_t version = snapshot->version;
+
+        SnapshotPtr previous = std::atomic_exchange(&current, SnapshotPtr(std::move(snapshot)));
+
+        // No reader can acquire the previous snapshot any more,
+        // so it is drained once this thread holds the only reference
+        while (previous.use_count() > 1)
+            std::this_thread::sleep_for(std::chrono::microseconds(poll_us));
+        previous.reset();
+        return version;
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef IVF_HNSW_LIB_INDEXHANDLE_H
+#define IVF_HNSW_LIB_INDEXHANDLE_H
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+#include "IndexIVF_HNSW.h"
+
+namespace ivfhnsw {
+    /// Immutable version of a loaded index: quantizer, codebooks and inverted lists
+    struct IndexSnapshot {
+        std::unique_ptr<IndexIVF_HNSW> index;
+        uint64_t version;   ///< Number of publications before this one, 0 for the first index
+    };
+
+    /** Versioned handle to the index being served, for hot-swapping daily rebuilds
+      *
+      * Readers acquire the current snapshot, i.e. a reference-counted pointer, and search it
+      * for as long as they hold it. A freshly loaded index is published with one atomic
+      * pointer swap, so queries never block on a reload: new searches start on the new snapshot
+      * while the in-flight ones finish on the old one. publish waits for the old snapshot
+      * to drain and deletes it in the calling thread, so freeing the old lists
+      * does not land on a search thread.
+      *
+      * Readers must release their snapshots in bounded time, e.g. after each micro-batch.
+    */
+    class IndexHandle {
+    public:
+        typedef std::shared_ptr<const IndexSnapshot> SnapshotPtr;
+
+        /// Take the ownership of the first index
+        explicit IndexHandle(IndexIVF_HNSW *index);
+
+        /// Current snapshot, lock-free with respect to publish
+        SnapshotPtr acquire() const { return std::atomic_load(&current); }
+
+        /** Replace the current snapshot with the index and release the previous one
+          *
+          * @param index        index to serve, the handle takes its ownership
+          * @param poll_us      interval of checking that the previous snapshot is drained
+          * @return version of the published snapshot
+        */
+        uint64_t publish(IndexIVF_HNSW *index, size_t poll_us = 1000);
+
+    private:
+        SnapshotPtr current;
+        std::mutex publish_guard;   ///< Serializes publishers, readers never take it
+
+        IndexHandle(const IndexHandle &);
+        IndexHandle &operator=(const IndexHandle &);
+    };
+}
+#endif //IVF_HNSW_LIB_INDEXHANDLE_H
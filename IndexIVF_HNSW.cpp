@@ -1,24 +1,35 @@
 #include "IndexIVF_HNSW.h"
 
+#include <chrono>
+#include <random>
+
 namespace ivfhnsw {
 
+    namespace {
+        /// Number of vectors encoded at once by add_batch
+        const size_t add_tile_size = 4096;
+
+        /// Last bytes of the index files written with the trailers, a file cut short misses them
+        const char index_end_marker[4] = {'I', 'V', 'F', 'E'};
+    }
+
     //=========================
     // IVF_HNSW implementation 
     //=========================
-    IndexIVF_HNSW::IndexIVF_HNSW(size_t dim, size_t ncentroids, size_t bytes_per_code,
-                                 size_t nbits_per_idx, size_t max_group_size):
-            d(dim), nc(ncentroids), quantizer(nullptr), pq(nullptr), norm_pq(nullptr),
-            opq_matrix(nullptr)
+    IndexIVF_HNSW::IndexIVF_HNSW(size_t dim, size_t ncentroids, size_t bytes_per_code, size_t nbits_per_idx):
+            d(dim), nc(ncentroids), quantizer(nullptr), pq(nullptr), sq(nullptr), encoding(ENCODING_PQ),
+            metric(METRIC_L2), norm_pq(nullptr), opq_matrix(nullptr), refine_pq(nullptr), quantizer_rotated(false),
+            refine_k(256), ninterleaved(8), mmap_quantizer(false), ids_packed(false), list_store(nullptr),
+            skip_lists(false), list_generation(new_list_generation()), keep_walk_dists(false)
     {
         pq = new faiss::ProductQuantizer(d, bytes_per_code, nbits_per_idx);
         norm_pq = new faiss::ProductQuantizer(1, 1, nbits_per_idx);
 
         code_size = pq->code_size;
-        norms.resize(max_group_size); // buffer for reconstructed base point norms. It is used at search time.
-        precomputed_table.resize(pq->ksub * pq->M);
 
         codes.resize(nc);
         norm_codes.resize(nc);
+        refine_codes.resize(nc);
         ids.resize(nc);
         centroid_norms.resize(nc);
     }
@@ -27,8 +38,535 @@ namespace ivfhnsw {
     {
         if (quantizer) delete quantizer;
         if (pq) delete pq;
+        if (sq) delete sq;
         if (norm_pq) delete norm_pq;
         if (opq_matrix) delete opq_matrix;
+        if (refine_pq) delete refine_pq;
+        if (list_store) delete list_store;
+    }
+
+    ResidualEncoding parse_residual_encoding(const char *name)
+    {
+        if (!strcmp(name, "pq")) return ENCODING_PQ;
+        if (!strcmp(name, "sq8")) return ENCODING_SQ8;
+        throw std::runtime_error(std::string("Wrong residual encoding: ") + name + ", expected pq or sq8");
+    }
+
+    Metric parse_metric(const char *name)
+    {
+        if (!strcmp(name, "l2")) return METRIC_L2;
+        if (!strcmp(name, "ip")) return METRIC_INNER_PRODUCT;
+        if (!strcmp(name, "cosine")) return METRIC_COSINE;
+        throw std::runtime_error(std::string("Wrong metric: ") + name + ", expected l2, ip or cosine");
+    }
+
+    void IndexIVF_HNSW::set_metric(Metric index_metric)
+    {
+        metric = index_metric;
+        if (quantizer)
+            quantizer->inner_product_ = (metric != METRIC_L2);
+    }
+
+    void IndexIVF_HNSW::set_encoding(ResidualEncoding residual_encoding)
+    {
+        encoding = residual_encoding;
+        if (encoding == ENCODING_SQ8) {
+            if (!sq)
+                sq = new SQ8Quantizer(d);
+            code_size = sq->code_size;
+        } else
+            code_size = pq->code_size;
+    }
+
+    void IndexIVF_HNSW::enable_refinement(size_t bytes_per_code)
+    {
+        if (refine_pq) delete refine_pq;
+        refine_pq = new faiss::ProductQuantizer(d, bytes_per_code, 8);
+    }
+
+    void IndexIVF_HNSW::pack_ids()
+    {
+        if (ids_packed)
+            return;
+        if (list_store) {
+            std::cout << "Ids of the tiered lists can not be packed" << std::endl;
+            return;
+        }
+        packed_ids.resize(nc);
+        size_t raw_bytes = 0;
+        size_t packed_bytes = 0;
+#pragma omp parallel for schedule(dynamic) reduction(+:raw_bytes, packed_bytes)
+        for (size_t i = 0; i < nc; i++) {
+            packed_ids[i].encode(ids[i].data(), ids[i].size());
+            raw_bytes += ids[i].size() * sizeof(label_t);
+            packed_bytes += packed_ids[i].memory_usage();
+            std::vector<label_t>().swap(ids[i]);
+        }
+        ids_packed = true;
+        std::cout << "Packed ids: " << (raw_bytes >> 20) << " MB -> " << (packed_bytes >> 20) << " MB\n";
+    }
+
+    ListLayout IndexIVF_HNSW::list_layout() const
+    {
+        ListLayout layout;
+        layout.id_size = ids_packed ? 0 : sizeof(label_t);
+        layout.code_size = code_size;
+        layout.norm_code_size = (metric == METRIC_L2) ? 1 : 0;
+        layout.refine_code_size = refine_pq ? refine_pq->code_size : 0;
+        return layout;
+    }
+
+    ListData IndexIVF_HNSW::resident_list(idx_t list_no) const
+    {
+        ListData list;
+        list.size = codes[list_no].size() / code_size;
+        list.ids = ids_packed ? nullptr : ids[list_no].data();
+        list.codes = codes[list_no].data();
+        list.norm_codes = norm_codes[list_no].empty() ? nullptr : norm_codes[list_no].data();
+        list.refine_codes = refine_codes[list_no].empty() ? nullptr : refine_codes[list_no].data();
+        return list;
+    }
+
+    uint64_t IndexIVF_HNSW::new_list_generation()
+    {
+        static const uint64_t seed = ((uint64_t) std::random_device()() << 32) ^
+                                     std::chrono::system_clock::now().time_since_epoch().count();
+        static std::atomic<uint64_t> counter(0);
+        return seed + 0x9e3779b97f4a7c15ULL * ++counter;
+    }
+
+    void IndexIVF_HNSW::write_lists(const char *path)
+    {
+        if (list_store) {
+            std::cout << "The lists are tiered already" << std::endl;
+            abort();
+        }
+        std::cout << "Saving lists to " << path << std::endl;
+        TieredListStore::write(path, list_generation, list_layout(), nc,
+                               [this](size_t list_no) { return resident_list(list_no); });
+    }
+
+    bool IndexIVF_HNSW::list_file_matches(const char *path) const
+    {
+        std::vector<size_t> sizes(nc);
+        for (size_t i = 0; i < nc; i++)
+            sizes[i] = list_size(i);
+        return TieredListStore::matches(path, list_generation, list_layout(), sizes);
+    }
+
+    void IndexIVF_HNSW::tier_lists(const char *path, size_t cache_bytes, size_t nthreads)
+    {
+        if (list_store)
+            return;
+        std::lock_guard<RWLock> lock(lists_lock);
+        if (!list_file_matches(path))
+            throw std::runtime_error(std::string("Lists of the list file do not match the index: ") + path);
+        TieredListStore *store = new TieredListStore(path, list_layout(), cache_bytes, nthreads);
+
+        size_t resident_bytes = 0;
+        for (size_t i = 0; i < nc; i++) {
+            resident_bytes += ids[i].capacity() * sizeof(label_t) + codes[i].capacity() +
+                              norm_codes[i].capacity() + refine_codes[i].capacity();
+            std::vector<label_t>().swap(ids[i]);
+            code_list().swap(codes[i]);
+            code_list().swap(norm_codes[i]);
+            code_list().swap(refine_codes[i]);
+        }
+        list_store = store;
+        std::cout << "Tiered lists: " << (resident_bytes >> 20) << " MB resident -> "
+                  << (cache_bytes >> 20) << " MB cache, " << nthreads << " I/O threads\n";
+    }
+
+    void IndexIVF_HNSW::read_tiered(const char *path_index, const char *path_lists, size_t cache_bytes, size_t nthreads)
+    {
+        if (list_store) {
+            std::cout << "The lists are tiered already" << std::endl;
+            abort();
+        }
+        // Read everything but the lists, and tier them if the list file has the same lists
+        if (exists(path_lists)) {
+            skip_lists = true;
+            try {
+                read(path_index);
+            } catch (...) {
+                skip_lists = false;
+                throw;
+            }
+            skip_lists = false;
+            if (TieredListStore::matches(path_lists, list_generation, list_layout(), skipped_sizes)) {
+                list_store = new TieredListStore(path_lists, list_layout(), cache_bytes, nthreads);
+                std::vector<size_t>().swap(skipped_sizes);
+                std::cout << "Tiered lists: " << (cache_bytes >> 20) << " MB cache, " << nthreads << " I/O threads\n";
+                return;
+            }
+            std::cout << "The list file does not match the index, rewriting " << path_lists << std::endl;
+        }
+        read(path_index);
+        write_lists(path_lists);
+        tier_lists(path_lists, cache_bytes, nthreads);
+    }
+
+    void IndexIVF_HNSW::prefetch_lists(const idx_t *list_nos, size_t n, size_t max_codes) const
+    {
+        if (!list_store)
+            return;
+        // Reads are queued in the probing order, so the first lists to be scanned arrive first
+        size_t ncode = 0;
+        for (size_t i = 0; i < n && ncode < max_codes; i++) {
+            list_store->prefetch(list_nos[i]);
+            ncode += list_nvectors(list_nos[i]);
+        }
+    }
+
+    /** Split of the oversized lists
+      *
+      * The list centroid is one of the two centroids of the split, so its node in the graph,
+      * its edges and the codes of the vectors that stay in the list are kept. The second centroid
+      * starts as the mean of the vectors on the far side of the list and moves with the 2-means.
+      * Only the moved vectors are encoded again, from their reconstructions.
+      * The reconstructions, the 2-means and the encoding run without the lock, as the lists change only here.
+    */
+    size_t IndexIVF_HNSW::split_lists(size_t max_list_size, size_t niter)
+    {
+        if (do_opq || ids_packed || list_store || quantizer->compact_links_) {
+            std::cout << "Lists can not be split with OPQ, packed ids, tiered lists or compact quantizer links" << std::endl;
+            return 0;
+        }
+        if (quantizer->cur_element_count != nc) {
+            std::cout << "The quantizer has " << quantizer->cur_element_count << " centroids instead of " << nc
+                      << ", lists can not be split" << std::endl;
+            return 0;
+        }
+        std::vector<idx_t> oversized;
+        for (size_t i = 0; i < nc; i++)
+            if (list_nvectors(i) > max_list_size)
+                oversized.push_back(i);
+        if (oversized.empty())
+            return 0;
+        lists_changed();
+
+        // Each growth of the node array copies the whole graph under the lock, so the room for
+        // the new centroids is reserved once. A list of n vectors takes about n / max_list_size - 1
+        // splits if they are balanced; twice the sum leaves room for the unbalanced ones
+        auto reserve_centroids = [&](size_t first) {
+            size_t nsplits = 0;
+            for (size_t l = first; l < oversized.size(); l++)
+                nsplits += list_nvectors(oversized[l]) / max_list_size;
+            std::lock_guard<RWLock> lock(lists_lock);
+            quantizer->resizeIndex(quantizer->cur_element_count + 2 * nsplits + 16);
+        };
+        reserve_centroids(0);
+
+        size_t nsplit = 0;
+        std::vector<size_t> offsets;
+        std::vector<float> x;
+        std::vector<uint8_t> moved;
+        std::vector<float> new_centroid(d);
+        for (size_t l = 0; l < oversized.size(); l++) {
+            const idx_t list_no = oversized[l];
+            list_entries(list_no, offsets);
+            const size_t n = offsets.size();
+            if (n <= max_list_size)
+                continue;
+
+            // Reconstruct the vectors of the list
+            x.resize(n * d);
+#pragma omp parallel for
+            for (size_t i = 0; i < n; i++)
+                reconstruct_entry(list_no, resident_list(list_no), offsets[i], x.data() + i * d);
+
+            moved.resize(n);
+            const size_t nmoved = split_centroid(list_no, n, x.data(), niter, new_centroid.data(), moved.data());
+            if (nmoved == 0 || nmoved == n)
+                continue;
+
+            // Vectors of the new list and the slots they leave
+            std::vector<float> moved_x(nmoved * d);
+            std::vector<label_t> moved_ids(nmoved);
+            std::vector<uint8_t> removed(list_size(list_no), 0);
+            for (size_t i = 0, j = 0; i < n; i++) {
+                if (!moved[i])
+                    continue;
+                memcpy(moved_x.data() + j * d, x.data() + i * d, d * sizeof(float));
+                moved_ids[j++] = list_id(list_no, offsets[i]);
+                removed[offsets[i]] = 1;
+            }
+
+            // The reserve ran out, the node array is grown for the splits left
+            if (quantizer->cur_element_count == quantizer->maxelements_)
+                reserve_centroids(l);
+
+            // The new centroid gets an empty list first, the moved vectors are encoded without the lock
+            // and spliced in together with their removal from the split list
+            const idx_t new_list_no = nc;
+            {
+                std::lock_guard<RWLock> lock(lists_lock);
+                quantizer->addPoint(new_centroid.data());
+                resize_lists(nc + 1);
+                centroid_norms[new_list_no] = (metric == METRIC_L2) ? faiss::fvec_norm_L2sqr(new_centroid.data(), d) : 0;
+            }
+            std::unique_ptr<EncodedList> encoded = encode_list(new_list_no, nmoved, moved_x.data(), moved_ids.data());
+            {
+                std::lock_guard<RWLock> lock(lists_lock);
+                remove_entries(list_no, removed);
+                commit_list(new_list_no, *encoded);
+            }
+            nsplit++;
+
+            // Both halves may be still too large
+            if (n - nmoved > max_list_size)
+                oversized.push_back(list_no);
+            if (nmoved > max_list_size)
+                oversized.push_back(new_list_no);
+        }
+        std::cout << "Split " << nsplit << " lists, " << nc << " lists in total" << std::endl;
+        return nsplit;
+    }
+
+    size_t IndexIVF_HNSW::split_centroid(idx_t list_no, size_t n, const float *x, size_t niter,
+                                         float *new_centroid, uint8_t *moved) const
+    {
+        const float *centroid = quantizer->getDataByLabel(list_no);
+
+        // The far side of the list: the half space beyond the centroid in the direction
+        // of the farthest vector of a sample
+        const size_t sample_step = std::max<size_t>(n / 256, 1);
+        size_t farthest = 0;
+        float max_dist = -1;
+        for (size_t i = 0; i < n; i += sample_step) {
+            const float dist = fvec_L2sqr(x + i * d, centroid, d);
+            if (dist > max_dist) {
+                max_dist = dist;
+                farthest = i;
+            }
+        }
+        std::vector<float> direction(d);
+        faiss::fvec_madd(d, x + farthest * d, -1., centroid, direction.data());
+        const float centroid_ip = faiss::fvec_inner_product(centroid, direction.data(), d);
+#pragma omp parallel for
+        for (size_t i = 0; i < n; i++)
+            moved[i] = faiss::fvec_inner_product(x + i * d, direction.data(), d) > centroid_ip;
+
+        for (size_t iter = 0; ; iter++) {
+            // The second centroid is the mean of its vectors
+            size_t nmoved = 0;
+            std::fill(new_centroid, new_centroid + d, 0);
+            for (size_t i = 0; i < n; i++) {
+                if (!moved[i])
+                    continue;
+                faiss::fvec_madd(d, new_centroid, 1., x + i * d, new_centroid);
+                nmoved++;
+            }
+            if (nmoved == 0)
+                return 0;
+            for (size_t j = 0; j < d; j++)
+                new_centroid[j] /= nmoved;
+            if (metric == METRIC_COSINE)
+                faiss::fvec_renorm_L2(d, 1, new_centroid);
+
+            // Vectors go to the closer centroid by the distance of the quantizer
+            size_t nchanged = 0;
+            nmoved = 0;
+#pragma omp parallel for reduction(+:nchanged, nmoved)
+            for (size_t i = 0; i < n; i++) {
+                const uint8_t closer = quantizer->fstdistfunc(x + i * d, new_centroid)
+                                       < quantizer->fstdistfunc(x + i * d, centroid);
+                nchanged += (closer != moved[i]);
+                nmoved += closer;
+                moved[i] = closer;
+            }
+            if (nchanged == 0 || iter + 1 >= niter)
+                return nmoved;
+        }
+    }
+
+    void IndexIVF_HNSW::write_quantizer(const char *path_index)
+    {
+        const std::string path_info = std::string(path_index) + ".info";
+        const std::string path_edges = std::string(path_index) + ".edges";
+        quantizer->SaveData(std::string(path_index) + ".centroids");
+        quantizer->SaveInfo(path_info);
+        quantizer->SaveEdges(path_edges);
+        quantizer->SaveSnapshot(path_info + ".snapshot", {path_info, path_edges});
+    }
+
+    bool IndexIVF_HNSW::has_split_quantizer(const char *path_index)
+    {
+        const std::string path(path_index);
+        return exists(path_index) && exists((path + ".centroids").c_str()) && exists((path + ".info").c_str())
+               && exists((path + ".edges").c_str());
+    }
+
+    void IndexIVF_HNSW::read_split_quantizer(const char *path_index, size_t efConstruction)
+    {
+        const std::string path(path_index);
+        std::cout << "Loading the quantizer of the split lists" << std::endl;
+        build_quantizer((path + ".centroids").c_str(), (path + ".info").c_str(), (path + ".edges").c_str(),
+                        16, efConstruction);
+    }
+
+    void IndexIVF_HNSW::resize_lists(size_t new_nc)
+    {
+        nc = new_nc;
+        ids.resize(nc);
+        codes.resize(nc);
+        norm_codes.resize(nc);
+        refine_codes.resize(nc);
+        centroid_norms.resize(nc);
+    }
+
+    void IndexIVF_HNSW::list_entries(idx_t list_no, std::vector<size_t> &offsets) const
+    {
+        offsets.resize(list_size(list_no));
+        for (size_t i = 0; i < offsets.size(); i++)
+            offsets[i] = i;
+    }
+
+    void IndexIVF_HNSW::remove_entries(idx_t list_no, const std::vector<uint8_t> &removed)
+    {
+        const size_t refine_code_size = refine_pq ? refine_pq->code_size : 0;
+        size_t kept = 0;
+        for (size_t i = 0; i < removed.size(); i++) {
+            if (removed[i])
+                continue;
+            if (kept != i)
+                move_entry(list_no, i, kept);
+            kept++;
+        }
+        ids[list_no].resize(kept);
+        codes[list_no].resize(kept * code_size);
+        if (!norm_codes[list_no].empty())
+            norm_codes[list_no].resize(kept);
+        refine_codes[list_no].resize(kept * refine_code_size);
+    }
+
+    void IndexIVF_HNSW::move_entry(idx_t list_no, size_t from, size_t to)
+    {
+        ids[list_no][to] = ids[list_no][from];
+        memcpy(codes[list_no].data() + to * code_size, codes[list_no].data() + from * code_size, code_size);
+        if (!norm_codes[list_no].empty())
+            norm_codes[list_no][to] = norm_codes[list_no][from];
+        if (refine_pq) {
+            const size_t refine_code_size = refine_pq->code_size;
+            memcpy(refine_codes[list_no].data() + to * refine_code_size,
+                   refine_codes[list_no].data() + from * refine_code_size, refine_code_size);
+        }
+    }
+
+    std::unique_ptr<IndexIVF_HNSW::EncodedList> IndexIVF_HNSW::encode_list(idx_t list_no, size_t n, const float *x,
+                                                                          const label_t *xids)
+    {
+        std::unique_ptr<EncodedList> list(new EncodedList);
+        const size_t refine_code_size = refine_pq ? refine_pq->code_size : 0;
+        list->ids.assign(xids, xids + n);
+        list->codes.resize(n * code_size);
+        list->norm_codes.resize(metric == METRIC_L2 ? n : 0);
+        list->refine_codes.resize(n * refine_code_size);
+
+        std::vector<idx_t> keys(n, list_no);
+        encode_vectors(n, x, keys.data(), list->codes.data(), list->norm_codes.data(), list->refine_codes.data());
+        return list;
+    }
+
+    void IndexIVF_HNSW::commit_list(idx_t list_no, EncodedList &list)
+    {
+        ids[list_no].swap(list.ids);
+        codes[list_no].swap(list.codes);
+        norm_codes[list_no].swap(list.norm_codes);
+        refine_codes[list_no].swap(list.refine_codes);
+    }
+
+    void IndexIVF_HNSW::position_labels_to_ids(size_t k, long *labels) const
+    {
+        for (size_t i = 0; i < k; i++)
+            if (labels[i] >= 0)
+                labels[i] = list_id(labels[i] >> 32, labels[i] & 0xffffffff);
+    }
+
+    size_t IndexIVF_HNSW::table_size() const
+    {
+        return (encoding == ENCODING_SQ8) ? sq->table_size() : pq->ksub * pq->M;
+    }
+
+    void IndexIVF_HNSW::read_residual_quantizer(const char *path)
+    {
+        if (encoding == ENCODING_SQ8) {
+            if (sq) delete sq;
+            sq = read_SQ8Quantizer(path);
+        } else {
+            if (pq) delete pq;
+            pq = faiss::read_ProductQuantizer(path);
+        }
+    }
+
+    void IndexIVF_HNSW::write_residual_quantizer(const char *path)
+    {
+        if (encoding == ENCODING_SQ8)
+            write_SQ8Quantizer(sq, path);
+        else
+            faiss::write_ProductQuantizer(pq, path);
+    }
+
+    void IndexIVF_HNSW::train_residual_quantizer(size_t n, const float *residuals)
+    {
+        if (encoding == ENCODING_SQ8) {
+            printf("Training SQ8 quantizer on %ld vectors in %dD\n", n, d);
+            sq->train(n, residuals);
+        } else {
+            printf("Training %zdx%zd product quantizer on %ld vectors in %dD\n", pq->M, pq->ksub, n, d);
+            pq->verbose = true;
+            pq->train(n, residuals);
+        }
+    }
+
+    void IndexIVF_HNSW::encode_residuals(size_t n, const float *residuals, uint8_t *xcodes) const
+    {
+        if (encoding == ENCODING_SQ8)
+            sq->compute_codes(residuals, xcodes, n);
+        else
+            pq->compute_codes(residuals, xcodes, n);
+    }
+
+    void IndexIVF_HNSW::decode_residuals(size_t n, const uint8_t *xcodes, float *residuals) const
+    {
+        if (encoding == ENCODING_SQ8)
+            sq->decode(xcodes, residuals, n);
+        else
+            pq->decode(xcodes, residuals, n);
+    }
+
+    const float *IndexIVF_HNSW::normalize_vectors(size_t n, const float *x, float *buffer) const
+    {
+        if (metric != METRIC_COSINE)
+            return x;
+        memcpy(buffer, x, n * d * sizeof(float));
+        faiss::fvec_renorm_L2(d, n, buffer);
+        return buffer;
+    }
+
+    void IndexIVF_HNSW::train_refine_pq(size_t n, const float *residuals)
+    {
+        // Errors of the residual quantizer on the training set
+        std::vector<uint8_t> xcodes(n * code_size);
+        std::vector<float> errors(n * d);
+        encode_residuals(n, residuals, xcodes.data());
+        decode_residuals(n, xcodes.data(), errors.data());
+        faiss::fvec_madd(n * d, residuals, -1., errors.data(), errors.data());
+
+        printf("Training %zdx%zd refinement product quantizer on %ld vectors in %dD\n",
+               refine_pq->M, refine_pq->ksub, n, d);
+        refine_pq->verbose = true;
+        refine_pq->train(n, errors.data());
+    }
+
+    void IndexIVF_HNSW::encode_refinement(size_t n, const float *residuals, const float *decoded_residuals,
+                                          uint8_t *refine_xcodes) const
+    {
+        Arena &arena = Arena::local();
+        ArenaScope scope(arena);
+        float *errors = arena.alloc<float>(n * d);
+        faiss::fvec_madd(n * d, residuals, -1., decoded_residuals, errors);
+        refine_pq->compute_codes(errors, refine_xcodes, n);
     }
 
     /**
@@ -36,101 +574,258 @@ namespace ivfhnsw {
      * Construction time is still acceptable: ~5 minutes for 1 million 96-d vectors on Intel Xeon E5-2650 V2 2.60GHz.
      */
     void IndexIVF_HNSW::build_quantizer(const char *path_data, const char *path_info,
-                                        const char *path_edges, size_t M, size_t efConstruction)
+                                        const char *path_edges, size_t M, size_t efConstruction, bool do_reorder)
     {
-        if (exists(path_info) && exists(path_edges)) {
+        // The snapshot of the HNSW node array is loaded with one sequential read (or mmap)
+        // and is created from the info, data and edge files if they exist.
+        // A snapshot older than the info and edge files is stale, e.g. the graph was rebuilt, and is recreated
+        const std::string path_snapshot = std::string(path_info) + ".snapshot";
+        const std::vector<std::string> sources = {path_info, path_edges};
+        const bool snapshot_valid = hnswlib::HierarchicalNSW::IsSnapshotOf(path_snapshot, sources);
+
+        if (snapshot_valid)
+            quantizer = new hnswlib::HierarchicalNSW(path_snapshot, mmap_quantizer);
+        else if (exists(path_info) && exists(path_edges))
             quantizer = new hnswlib::HierarchicalNSW(path_info, path_data, path_edges);
+
+        if (quantizer) {
+            quantizer->inner_product_ = (metric != METRIC_L2);
             quantizer->efSearch = efConstruction;
+            bool save_snapshot = !snapshot_valid;
+
+            // Offline reordering of the existing graph
+            if (do_reorder && quantizer->external_ids_.empty() && !quantizer->compact_links_) {
+                quantizer->reorderNodes();
+                quantizer->SaveInfo(path_info);
+                quantizer->SaveEdges(path_edges);
+                save_snapshot = true;
+            }
+            if (save_snapshot)
+                quantizer->SaveSnapshot(path_snapshot, sources);
             return;
         }
         quantizer = new hnswlib::HierarchicalNSW(d, nc, M, 2 * M, efConstruction);
+        quantizer->inner_product_ = (metric != METRIC_L2);
 
         std::cout << "Constructing quantizer\n";
-        std::ifstream input(path_data, std::ios::binary);
+        XvecFile input(path_data, sizeof(float));
+        input.check(d, nc);
+        const XvecView<float> centroids = input.view<float>(0, nc);
+        std::vector<float> normalized(d);
 
         size_t report_every = 100000;
         for (size_t i = 0; i < nc; i++) {
-            float mass[d];
-            readXvec<float>(input, mass, d);
+            const float *centroid = centroids[i];
+            // Spherical centroids for the cosine metric
+            if (metric == METRIC_COSINE) {
+                memcpy(normalized.data(), centroid, d * sizeof(float));
+                faiss::fvec_renorm_L2(d, 1, normalized.data());
+                centroid = normalized.data();
+            }
             if (i % report_every == 0)
                 std::cout << i / (0.01 * nc) << " %\n";
-            quantizer->addPoint(mass);
+            quantizer->addPoint(centroid);
         }
+        if (do_reorder)
+            quantizer->reorderNodes();
+
         quantizer->SaveInfo(path_info);
         quantizer->SaveEdges(path_edges);
+        quantizer->SaveSnapshot(path_snapshot, sources);
     }
 
 
     void IndexIVF_HNSW::assign(size_t n, const float *x, idx_t *labels, size_t k) {
+        // split_lists grows the node array of the quantizer under the exclusive lock
+        SharedLockGuard lock(lists_lock);
+        const size_t interleave = std::max<size_t>(ninterleaved, 1);
 #pragma omp parallel for
-        for (size_t i = 0; i < n; i++)
-            labels[i] = quantizer->searchKnn(const_cast<float *>(x + i * d), k).top().second;
+        for (size_t i = 0; i < n; i += interleave) {
+            const size_t nx = std::min(interleave, n - i);
+            std::vector<std::priority_queue<std::pair<float, idx_t>>> results(nx);
+            quantizer->searchKnnInterleaved(x + i * d, nx, k, results.data(), interleave);
+            for (size_t q = 0; q < nx; q++)
+                labels[i + q] = results[q].top().second;
+        }
     }
 
 
-    void IndexIVF_HNSW::add_batch(size_t n, const float *x, const idx_t *xids, const idx_t *precomputed_idx)
+    /**
+     * Only the codes of the batch are kept until they are added to the lists in the input order.
+     */
+    void IndexIVF_HNSW::add_batch(size_t n, const float *x, const label_t *xids, const idx_t *precomputed_idx)
     {
+        if (ids_packed || list_store) {
+            std::cout << "Vectors can not be added after the ids are packed or the lists are tiered" << std::endl;
+            abort();
+        }
+        lists_changed();
         const idx_t *idx;
-        // Check whether idxs are precomputed. If not, assign x
+        std::vector<idx_t> assigned;
+        const bool has_norms = (metric == METRIC_L2);
+        // Check whether idxs are precomputed. If not, assign x.
+        // The max inner product centroid does not depend on the norm of the vector, so cosine vectors are assigned as is
         if (precomputed_idx)
             idx = precomputed_idx;
         else {
-            idx = new idx_t[n];
-            assign(n, x, const_cast<idx_t *>(idx));
+            assigned.resize(n);
+            assign(n, x, assigned.data());
+            idx = assigned.data();
         }
-        // Compute residuals for original vectors
-        std::vector<float> residuals(n * d);
-        compute_residuals(n, x, residuals.data(), idx);
 
-        // If do_opq, rotate residuals
-        if (do_opq){
-            std::vector<float> copy_residuals(n * d);
-            memcpy(copy_residuals.data(), residuals.data(), n * d * sizeof(float));
-            opq_matrix->apply_noalloc(n, copy_residuals.data(), residuals.data());
+        std::vector<uint8_t> xcodes(n * code_size);
+        std::vector<uint8_t> xnorm_codes(has_norms ? n : 0);
+        const size_t refine_code_size = refine_pq ? refine_pq->code_size : 0;
+        std::vector<uint8_t> refine_xcodes(n * refine_code_size);
+        encode_vectors(n, x, idx, xcodes.data(), xnorm_codes.data(), refine_xcodes.data());
+
+        // Add vector indices and PQ codes for residuals and norms to Index
+        for (size_t i = 0; i < n; i++) {
+            const idx_t key = idx[i];
+            const label_t id = xids[i];
+            ids[key].push_back(id);
+            const uint8_t *code = xcodes.data() + i * code_size;
+            codes[key].insert(codes[key].end(), code, code + code_size);
+            if (has_norms)
+                norm_codes[key].push_back(xnorm_codes[i]);
+            if (refine_pq) {
+                const uint8_t *refine_code = refine_xcodes.data() + i * refine_code_size;
+                refine_codes[key].insert(refine_codes[key].end(), refine_code, refine_code + refine_code_size);
+            }
         }
+    }
 
-        // Encode residuals
-        std::vector <uint8_t> xcodes(n * code_size);
-        pq->compute_codes(residuals.data(), xcodes.data(), n);
+    /**
+     * Vectors are encoded in tiles of <add_tile_size>: rotate -> encode -> decode -> reconstruct -> norm,
+     * the inner product metrics stop after decoding.
+     * Tile buffers are taken from the arena of the thread, so the temporary memory does not depend on the batch size.
+     */
+    void IndexIVF_HNSW::encode_vectors(size_t n, const float *x, const idx_t *idx, uint8_t *xcodes,
+                                       uint8_t *xnorm_codes, uint8_t *refine_xcodes)
+    {
+        const bool has_norms = (metric == METRIC_L2);
+        const size_t refine_code_size = refine_pq ? refine_pq->code_size : 0;
 
-        // Decode residuals
-        std::vector<float> decoded_residuals(n * d);
-        pq->decode(xcodes.data(), decoded_residuals.data(), n);
+#pragma omp parallel for schedule(dynamic)
+        for (size_t tile_begin = 0; tile_begin < n; tile_begin += add_tile_size) {
+            const size_t tile_n = std::min(add_tile_size, n - tile_begin);
+            const idx_t *tile_idx = idx + tile_begin;
+            uint8_t *tile_codes = xcodes + tile_begin * code_size;
 
-        // Reverse rotation
-        if (do_opq){
-            std::vector<float> copy_decoded_residuals(n * d);
-            memcpy(copy_decoded_residuals.data(), decoded_residuals.data(), n * d * sizeof(float));
-            opq_matrix->transform_transpose(n, copy_decoded_residuals.data(), decoded_residuals.data());
+            Arena &arena = Arena::local();
+            ArenaScope scope(arena);
+            float *residuals = arena.alloc<float>(tile_n * d);
+            float *scratch = arena.alloc<float>(tile_n * d);    // Rotation output, then the reconstructed vectors
+            const float *tile_x = normalize_vectors(tile_n, x + tile_begin * d, scratch);
+
+            // Compute residuals for original vectors
+            compute_residuals(tile_n, tile_x, residuals, tile_idx);
+
+            // If do_opq, rotate residuals
+            const float *rotated_residuals = residuals;
+            if (do_opq) {
+                opq_matrix->apply_noalloc(tile_n, residuals, scratch);
+                rotated_residuals = scratch;
+            }
+
+            // Encode residuals
+            encode_residuals(tile_n, rotated_residuals, tile_codes);
+
+            // Decode residuals, encode the errors with the refinement PQ in the rotated space,
+            // reverse rotation and reconstruct original vectors
+            float *decoded_residuals = do_opq ? arena.alloc<float>(tile_n * d) : scratch;
+            decode_residuals(tile_n, tile_codes, decoded_residuals);
+            if (refine_pq)
+                encode_refinement(tile_n, rotated_residuals, decoded_residuals,
+                                  refine_xcodes + tile_begin * refine_code_size);
+            if (!has_norms)
+                continue;
+            if (do_opq)
+                opq_matrix->transform_transpose(tile_n, decoded_residuals, residuals);
+            else
+                std::swap(residuals, scratch);
+
+            reconstruct(tile_n, scratch, residuals, tile_idx);
+
+            // Compute l2 square norms of reconstructed vectors and encode them
+            float *norms = arena.alloc<float>(tile_n);
+            faiss::fvec_norms_L2sqr(norms, scratch, d, tile_n);
+            norm_pq->compute_codes(norms, xnorm_codes + tile_begin, tile_n);
         }
+    }
 
-        // Reconstruct original vectors 
-        std::vector<float> reconstructed_x(n * d);
-        reconstruct(n, reconstructed_x.data(), decoded_residuals.data(), idx);
+    size_t IndexIVF_HNSW::search(size_t k, const float *x, float *distances, long *labels,
+                                 const SearchBudget *budget)
+    {
+        thread_local std::vector<float> query;
+        thread_local std::vector<float> precomputed_table;
+        query.resize(d);
+        precomputed_table.resize(table_size());
 
-        // Compute l2 square norms of reconstructed vectors
-        std::vector<float> norms(n);
-        faiss::fvec_norms_L2sqr(norms.data(), reconstructed_x.data(), d, n);
+        preprocess_queries(1, x, query.data(), precomputed_table.data());
+        return search_preprocessed(k, query.data(), precomputed_table.data(), distances, labels, budget);
+    }
 
-        // Encode norms
-        std::vector <uint8_t> xnorm_codes(n);
-        norm_pq->compute_codes(norms.data(), xnorm_codes.data(), n);
+    size_t IndexIVF_HNSW::search_batch(size_t n, size_t k, const float *x, float *distances, long *labels)
+    {
+        // Block of queries preprocessed together, bounds the memory for the tables
+        const size_t block_size = 1024;
+        const size_t table_size = this->table_size();
 
-        // Add vector indices and PQ codes for residuals and norms to Index
-        for (size_t i = 0; i < n; i++) {
-            const idx_t key = idx[i];
-            const idx_t id = xids[i];
-            ids[key].push_back(id);
-            const uint8_t *code = xcodes.data() + i * code_size;
-            for (size_t j = 0; j < code_size; j++)
-                codes[key].push_back(code[j]);
+        // Reused by later batches of the calling thread
+        thread_local std::vector<float> queries;
+        thread_local std::vector<float> tables;
+        queries.resize(std::min(n, block_size) * d);
+        tables.resize(std::min(n, block_size) * table_size);
+
+        size_t ncode = 0;
+        for (size_t block_begin = 0; block_begin < n; block_begin += block_size) {
+            const size_t nb = std::min(block_size, n - block_begin);
+            preprocess_queries(nb, x + block_begin * d, queries.data(), tables.data());
 
-            norm_codes[key].push_back(xnorm_codes[i]);
+            // Each group of queries traverses the quantizer in lockstep,
+            // a list that can not be read fails the batch after the block
+            const size_t interleave = std::max<size_t>(ninterleaved, 1);
+            ParallelException errors;
+#pragma omp parallel for schedule(dynamic) reduction(+:ncode)
+            for (size_t group_begin = 0; group_begin < nb; group_begin += interleave) {
+                errors.run([&] {
+                    const size_t ng = std::min(interleave, nb - group_begin);
+                    const SearchBudget budget{nprobe, max_codes};
+                    thread_local CoarseProbes probes;
+
+                    SharedLockGuard lock(lists_lock);
+                    find_probes(ng, queries.data() + group_begin * d, nprobe, probes);
+                    for (size_t i = group_begin; i < group_begin + ng; i++) {
+                        const size_t q = block_begin + i;
+                        ncode += search_query(k, queries.data() + i * d, tables.data() + i * table_size, probes,
+                                              i - group_begin, distances + q * k, labels + q * k, budget);
+                    }
+                });
+            }
+            errors.rethrow();
         }
-        
-        // Free memory, if it is allocated 
-        if (idx != precomputed_idx)
-            delete idx;
+        return ncode;
+    }
+
+    void IndexIVF_HNSW::preprocess_queries(size_t n, const float *x, float *queries, float *tables) const
+    {
+        // For correct search using OPQ rotate queries, one GEMM for the whole block
+        if (do_opq)
+            opq_matrix->apply_noalloc(n, x, queries);
+        else
+            memcpy(queries, x, n * d * sizeof(float));
+
+        // The rotation keeps the norms, so cosine queries are normalized after it
+        if (metric == METRIC_COSINE)
+            faiss::fvec_renorm_L2(d, n, queries);
+
+        // Inner product tables with the PQ codebooks, computed with GEMMs for large blocks,
+        // or the per-dimension weights of the SQ8 codes
+        if (encoding == ENCODING_SQ8)
+            sq->compute_inner_prod_tables(n, queries, tables);
+        else
+            pq->compute_inner_prod_tables(n, queries, tables);
     }
 
     /** Search procedure
@@ -160,62 +855,405 @@ namespace ivfhnsw {
       * Since y_R defined by a product quantizer, it is split across
       * sub-vectors and stored separately for each subvector.
       *
+      * With the inner product metrics the quantizer distance is -(x|y_C), so
+      *
+      *    d = -(x|y_C) - (x|y_R)
+      *
+      * term 1 keeps the quantizer distance as is (the centroid norms are zeros) and there is no term 2.
+      *
     */
-    size_t IndexIVF_HNSW::search(size_t k, const float *x, float *distances, long *labels)
+    size_t IndexIVF_HNSW::search_preprocessed(size_t k, const float *query, const float *table,
+                                              float *distances, long *labels, const SearchBudget *budget)
     {
-        float query_centroid_dists[nprobe]; // Distances to the coarse centroids.
-        idx_t centroid_idxs[nprobe];        // Indices of the nearest coarse centroids
+        const SearchBudget query_budget = budget ? *budget : SearchBudget{nprobe, max_codes};
+        thread_local CoarseProbes probes;
 
-        // For correct search using OPQ rotate a query
-        const float *query = (do_opq) ? opq_matrix->apply(1, x) : x;
+        SharedLockGuard lock(lists_lock);
+        find_probes(1, query, query_budget.nprobe, probes);
+        return search_query(k, query, table, probes, 0, distances, labels, query_budget);
+    }
+
+    void IndexIVF_HNSW::coarse_search(size_t n, const float *queries, size_t nprobe, CoarseProbes &probes)
+    {
+        SharedLockGuard lock(lists_lock);
+        find_probes(n, queries, nprobe, probes);
+    }
+
+    size_t IndexIVF_HNSW::search_probed(size_t k, const float *query, const float *table, CoarseProbes &probes,
+                                        size_t query_no, float *distances, long *labels, const SearchBudget *budget)
+    {
+        SearchBudget query_budget = budget ? *budget : SearchBudget{nprobe, max_codes};
+        query_budget.nprobe = std::min(query_budget.nprobe, probes.nprobe);
 
-        // Find the nearest coarse centroids to the query
-        auto coarse = quantizer->searchKnn(query, nprobe);
-        for (int_fast32_t i = nprobe - 1; i >= 0; i--) {
-            query_centroid_dists[i] = coarse.top().first;
-            centroid_idxs[i] = coarse.top().second;
-            coarse.pop();
+        SharedLockGuard lock(lists_lock);
+        return search_query(k, query, table, probes, query_no, distances, labels, query_budget);
+    }
+
+    void IndexIVF_HNSW::find_probes(size_t n, const float *queries, size_t nprobe, CoarseProbes &probes)
+    {
+        probes.nprobe = nprobe;
+        probes.centroid_idxs.resize(n * nprobe);
+        probes.centroid_dists.resize(n * nprobe);
+        if (probes.walk_dists.size() < n)
+            probes.walk_dists.resize(n);
+
+        // The caches start at the size of a walk and grow once per thread if plan_scans adds more distances
+        if (keep_walk_dists)
+            for (size_t q = 0; q < n; q++)
+                probes.walk_dists[q].reset(std::max(quantizer->efSearch, nprobe) * quantizer->maxM_);
+
+        thread_local std::vector<std::priority_queue<std::pair<float, idx_t>>> results;
+        results.resize(n);
+        quantizer->searchKnnInterleaved(queries, n, nprobe, results.data(), std::max<size_t>(ninterleaved, 1),
+                                        keep_walk_dists ? probes.walk_dists.data() : nullptr);
+
+        for (size_t q = 0; q < n; q++) {
+            std::priority_queue<std::pair<float, idx_t>> &coarse = results[q];
+            idx_t *centroid_idxs = probes.centroid_idxs.data() + q * nprobe;
+            float *centroid_dists = probes.centroid_dists.data() + q * nprobe;
+            for (int_fast32_t i = nprobe - 1; i >= 0; i--) {
+                centroid_dists[i] = coarse.top().first;
+                centroid_idxs[i] = coarse.top().second;
+                coarse.pop();
+            }
+        }
+    }
+
+    size_t IndexIVF_HNSW::search_query(size_t k, const float *query, const float *table, CoarseProbes &probes,
+                                       size_t query_no, float *distances, long *labels, const SearchBudget &budget)
+    {
+        thread_local std::vector<ListScan> scans;
+        size_t ncode = plan_scans(query, budget, probes.centroid_idxs.data() + query_no * probes.nprobe,
+                                  probes.centroid_dists.data() + query_no * probes.nprobe,
+                                  probes.walk_dists[query_no], scans);
+
+        // With refinement the scan collects the best <refine_k> candidates by their positions in the lists,
+        // with packed ids the results are labelled by their positions until the end of the scan
+        const bool refine = refine_pq != nullptr;
+        const bool label_positions = refine || ids_packed;
+        const size_t kscan = refine ? std::max(k, refine_k) : k;
+        thread_local std::vector<float> cand_distances;
+        thread_local std::vector<long> cand_labels;
+        float *scan_distances = distances;
+        long *scan_labels = labels;
+        if (refine) {
+            cand_distances.resize(kscan);
+            cand_labels.resize(kscan);
+            scan_distances = cand_distances.data();
+            scan_labels = cand_labels.data();
         }
-        // Precompute table
-        pq->compute_inner_prod_table(query, precomputed_table.data());
 
         // Prepare max heap with k answers
-        faiss::maxheap_heapify(k, distances, labels);
+        faiss::maxheap_heapify(kscan, scan_distances, scan_labels);
+
+        // Buffer for the decoded norms of reconstructed base points
+        thread_local std::vector<float> norms;
+        const bool has_norms = (metric == METRIC_L2);
+
+        // Tiered lists were prefetched by plan_scans, the scans of a list share its pin with the refinement
+        QueryPins pins;
+
+        for (const ListScan &scan : scans) {
+            const size_t scan_size = scan.end - scan.begin;
+            if (scan.bound >= scan_distances[0]) {
+                ncode -= scan_size;
+                continue;
+            }
+            const ListData list = scan_list(pins, scan);
+
+            // Decode the norms of each vector in the range
+            if (has_norms) {
+                norms.resize(scan_size);
+                norm_pq->decode(list.norm_codes + scan.begin, norms.data(), scan_size);
+            }
+
+            scan_codes(scan, list, scan.begin, scan.end, norms.data(), table, kscan, scan_distances, scan_labels,
+                       label_positions);
+        }
+        if (refine) {
+            faiss::maxheap_heapify(k, distances, labels);
+            refine_candidates(kscan, cand_labels.data(), query, k, distances, labels, pins);
+        } else if (ids_packed)
+            position_labels_to_ids(k, labels);
+        faiss::maxheap_reorder(k,distances, labels);
+        return ncode;
+    }
+
+    size_t IndexIVF_HNSW::plan_scans(const float *query, const SearchBudget &budget, const idx_t *centroid_idxs,
+                                     const float *centroid_dists, hnswlib::DistanceCache &walk_dists,
+                                     std::vector<ListScan> &scans)
+    {
+        scans.clear();
+        const size_t nprobe = budget.nprobe;
+        prefetch_lists(centroid_idxs, nprobe, budget.max_codes);
 
         size_t ncode = 0;
         for (size_t i = 0; i < nprobe; i++) {
             const idx_t centroid_idx = centroid_idxs[i];
-            const size_t group_size = norm_codes[centroid_idx].size();
+            const size_t group_size = list_size(centroid_idx);
             if (group_size == 0)
                 continue;
 
-            const uint8_t *code = codes[centroid_idx].data();
-            const uint8_t *norm_code = norm_codes[centroid_idx].data();
-            const idx_t *id = ids[centroid_idx].data();
-            const float term1 = query_centroid_dists[i] - centroid_norms[centroid_idx];
+            // term2 and term3 are added by the scan
+            const float term1 = centroid_dists[i] - centroid_norms[centroid_idx];
+            scans.push_back(ListScan{centroid_idx, 0, (idx_t) group_size, term1,
+                                     -std::numeric_limits<float>::infinity(), (idx_t) i});
 
-            // Decode the norms of each vector in the list
-            norm_pq->decode(norm_code, norms.data(), group_size);
+            ncode += group_size;
+            if (ncode >= budget.max_codes)
+                break;
+        }
+        return ncode;
+    }
 
-            for (size_t j = 0; j < group_size; j++) {
-                const float term3 = 2 * pq_L2sqr(code + j * code_size);
-                const float dist = term1 + norms[j] - term3; //term2 = norms[j]
+    void IndexIVF_HNSW::scan_codes(const ListScan &scan, const ListData &list, size_t begin, size_t end,
+                                   const float *norms, const float *table, size_t k, float *distances, long *labels,
+                                   bool label_positions)
+    {
+        const uint8_t *code = list.codes + begin * code_size;
+        const label_t *id = label_positions ? nullptr : list.ids + begin;
+        // Inner product metrics have no norm term, the loop-invariant branch is hoisted by the compiler
+        const bool has_norms = (metric == METRIC_L2);
+
+        if (encoding == ENCODING_SQ8) {
+            for (size_t j = 0; j < end - begin; j++) {
+                const float ip = sq->inner_product(code + j * code_size, table);
+                const float dist = has_norms ? scan.term + norms[j] - 2 * ip : scan.term - ip;
                 if (dist < distances[0]) {
                     faiss::maxheap_pop(k, distances, labels);
-                    faiss::maxheap_push(k, distances, labels, dist, id[j]);
+                    faiss::maxheap_push(k, distances, labels, dist,
+                                        label_positions ? position_label(scan.list_no, begin + j) : id[j]);
                 }
             }
-            ncode += group_size;
-            if (ncode >= max_codes)
-                break;
+            return;
         }
-        if (do_opq)
-            delete const_cast<float *>(query);
+        for (size_t j = 0; j < end - begin; j++) {
+            const float ip = pq_L2sqr(code + j * code_size, table);
+            const float dist = has_norms ? scan.term + norms[j] - 2 * ip : scan.term - ip;
+            if (dist < distances[0]) {
+                faiss::maxheap_pop(k, distances, labels);
+                faiss::maxheap_push(k, distances, labels, dist,
+                                    label_positions ? position_label(scan.list_no, begin + j) : id[j]);
+            }
+        }
+    }
 
-        faiss::maxheap_reorder(k,distances, labels);
-        return ncode;
+    void IndexIVF_HNSW::list_base(idx_t list_no, size_t offset, float *base) const
+    {
+        memcpy(base, quantizer->getDataByLabel(list_no), d * sizeof(float));
+    }
+
+    ListData IndexIVF_HNSW::scan_list(QueryPins &pins, const ListScan &scan) const
+    {
+        while (pins.pins.size() <= scan.probe) {
+            pins.pins.emplace_back(ListData{0, nullptr, nullptr, nullptr, nullptr});
+            pins.list_nos.push_back(0);
+        }
+        ListPin &pin = pins.pins[scan.probe];
+        if (pin->size == 0) {
+            pin = pin_list(scan.list_no);
+            pins.list_nos[scan.probe] = scan.list_no;
+        }
+        return *pin;
     }
 
+    ListData IndexIVF_HNSW::scanned_list(QueryPins &pins, idx_t list_no) const
+    {
+        for (size_t i = 0; i < pins.pins.size(); i++)
+            if (pins.pins[i]->size > 0 && pins.list_nos[i] == list_no)
+                return *pins.pins[i];
+        pins.pins.push_back(pin_list(list_no));
+        pins.list_nos.push_back(list_no);
+        return *pins.pins.back();
+    }
+
+    void IndexIVF_HNSW::reconstruct_entry(idx_t list_no, const ListData &list, size_t offset, float *x) const
+    {
+        thread_local std::vector<float> decoded;
+        decoded.resize(d);
+
+        list_base(list_no, offset, x);
+        decode_residuals(1, list.codes + offset * code_size, decoded.data());
+        faiss::fvec_madd(d, x, 1., decoded.data(), x);
+        if (refine_pq) {
+            const size_t refine_code_size = refine_pq->code_size;
+            refine_pq->decode(list.refine_codes + offset * refine_code_size, decoded.data());
+            faiss::fvec_madd(d, x, 1., decoded.data(), x);
+        }
+    }
+
+    /** Refinement
+      *
+      * A candidate is reconstructed as y = y_B + y_R + y_E, where y_B is the vector the code is the residual of,
+      * y_R the decoded residual and y_E the decoded refinement code of the residual error,
+      * all in the rotated space if OPQ is on. Candidates are few, so ||x - y||^2 or -(x|y) is computed directly.
+    */
+    void IndexIVF_HNSW::refine_candidates(size_t ncand, const long *cand_labels, const float *query,
+                                          size_t k, float *distances, long *labels, QueryPins &pins) const
+    {
+        thread_local std::vector<float> reconstructed;
+        reconstructed.resize(d);
+
+        for (size_t i = 0; i < ncand; i++) {
+            if (cand_labels[i] < 0)
+                continue;
+            const idx_t list_no = cand_labels[i] >> 32;
+            const size_t offset = cand_labels[i] & 0xffffffff;
+
+            const ListData list = scanned_list(pins, list_no);
+            reconstruct_entry(list_no, list, offset, reconstructed.data());
+
+            const float dist = (metric == METRIC_L2) ? fvec_L2sqr(query, reconstructed.data(), d)
+                                                     : -faiss::fvec_inner_product(query, reconstructed.data(), d);
+            if (dist < distances[0]) {
+                faiss::maxheap_pop(k, distances, labels);
+                faiss::maxheap_push(k, distances, labels, dist,
+                                    ids_packed ? packed_ids[list_no].get(offset) : list.ids[offset]);
+            }
+        }
+    }
+
+    size_t IndexIVF_HNSW::search_list_major(size_t n, size_t k, const float *x, float *distances, long *labels)
+    {
+        // Queries per block, a larger block shares each list scan between more queries
+        const size_t block_size = 4096;
+        // Codes scored against all interested queries at once, fits in L1 with their norms
+        const size_t chunk_size = 256;
+        const size_t table_size = this->table_size();
+
+        std::vector<float> queries(std::min(n, block_size) * d);
+        std::vector<float> tables(std::min(n, block_size) * table_size);
+
+        // With refinement the heaps of the scan collect the best <refine_k> candidates by their positions,
+        // with packed ids the results are labelled by their positions until the end of the scan
+        const bool refine = refine_pq != nullptr;
+        const bool label_positions = refine || ids_packed;
+        const size_t kscan = refine ? std::max(k, refine_k) : k;
+        std::vector<float> cand_distances(refine ? std::min(n, block_size) * kscan : 0);
+        std::vector<long> cand_labels(refine ? std::min(n, block_size) * kscan : 0);
+        std::vector<std::vector<ListScan> > query_scans(std::min(n, block_size));
+        std::vector<std::mutex> heap_guards(std::min(n, block_size));
+
+        // Scans grouped by inverted list
+        struct ScanRef {
+            idx_t query_no;
+            const ListScan *scan;
+        };
+        std::vector<size_t> list_offsets;
+        std::vector<ScanRef> list_scans;
+        std::vector<idx_t> active_lists;
+
+        size_t ncode = 0;
+        size_t nskipped = 0;
+        for (size_t block_begin = 0; block_begin < n; block_begin += block_size) {
+            const size_t nb = std::min(block_size, n - block_begin);
+            float *block_distances = distances + block_begin * k;
+            long *block_labels = labels + block_begin * k;
+            float *heap_distances = refine ? cand_distances.data() : block_distances;
+            long *heap_labels = refine ? cand_labels.data() : block_labels;
+
+            preprocess_queries(nb, x + block_begin * d, queries.data(), tables.data());
+            SharedLockGuard lock(lists_lock);
+
+            // Coarse search and pruning for the whole block, each group of queries traverses the quantizer in lockstep
+            const size_t interleave = std::max<size_t>(ninterleaved, 1);
+#pragma omp parallel for schedule(dynamic) reduction(+:ncode)
+            for (size_t group_begin = 0; group_begin < nb; group_begin += interleave) {
+                const size_t ng = std::min(interleave, nb - group_begin);
+                thread_local CoarseProbes probes;
+                find_probes(ng, queries.data() + group_begin * d, nprobe, probes);
+                for (size_t q = group_begin; q < group_begin + ng; q++) {
+                    const size_t probe_no = (q - group_begin) * nprobe;
+                    ncode += plan_scans(queries.data() + q * d, SearchBudget{nprobe, max_codes},
+                                        probes.centroid_idxs.data() + probe_no, probes.centroid_dists.data() + probe_no,
+                                        probes.walk_dists[q - group_begin], query_scans[q]);
+                    faiss::maxheap_heapify(kscan, heap_distances + q * kscan, heap_labels + q * kscan);
+                }
+            }
+
+            // Invert the probes: list -> scans of the queries probing it, lists may be split between blocks
+            list_offsets.assign(nc + 1, 0);
+            for (size_t q = 0; q < nb; q++)
+                for (const ListScan &scan : query_scans[q])
+                    list_offsets[scan.list_no + 1]++;
+
+            active_lists.clear();
+            for (size_t i = 0; i < nc; i++) {
+                if (list_offsets[i + 1] > 0)
+                    active_lists.push_back(i);
+                list_offsets[i + 1] += list_offsets[i];
+            }
+            list_scans.resize(list_offsets[nc]);
+            for (size_t q = 0; q < nb; q++)
+                for (const ListScan &scan : query_scans[q])
+                    list_scans[list_offsets[scan.list_no]++] = ScanRef{(idx_t) q, &scan};
+            // Restore the list offsets shifted by the fill
+            for (size_t i = nc; i > 0; i--)
+                list_offsets[i] = list_offsets[i - 1];
+            list_offsets[0] = 0;
+
+            // Stream each list once, a list that can not be read fails the search after the loop
+            ParallelException errors;
+#pragma omp parallel for schedule(dynamic) reduction(+:nskipped)
+            for (size_t l = 0; l < active_lists.size(); l++) {
+                errors.run([&] {
+                    const idx_t list_no = active_lists[l];
+                    const ListPin list = pin_list(list_no);
+                    const size_t list_size = list->size;
+                    const ScanRef *refs_begin = list_scans.data() + list_offsets[list_no];
+                    const ScanRef *refs_end = list_scans.data() + list_offsets[list_no + 1];
+
+                    float norms[chunk_size];
+                    for (size_t chunk_begin = 0; chunk_begin < list_size; chunk_begin += chunk_size) {
+                        const size_t chunk_end = std::min(list_size, chunk_begin + chunk_size);
+                        // Inner product metrics have no norms to decode
+                        bool decoded = (metric != METRIC_L2);
+
+                        for (const ScanRef *ref = refs_begin; ref != refs_end; ref++) {
+                            const ListScan &scan = *ref->scan;
+                            const size_t begin = std::max<size_t>(chunk_begin, scan.begin);
+                            const size_t end = std::min<size_t>(chunk_end, scan.end);
+                            if (begin >= end)
+                                continue;
+
+                            const size_t q = ref->query_no;
+                            std::lock_guard<std::mutex> lock(heap_guards[q]);
+                            if (scan.bound >= heap_distances[q * kscan]) {
+                                nskipped += end - begin;
+                                continue;
+                            }
+                            // Pruned sub-groups and skipped ranges of the chunk are not decoded
+                            if (!decoded) {
+                                norm_pq->decode(list->norm_codes + chunk_begin, norms, chunk_end - chunk_begin);
+                                decoded = true;
+                            }
+                            scan_codes(scan, *list, begin, end, norms + (begin - chunk_begin),
+                                       tables.data() + q * table_size, kscan, heap_distances + q * kscan,
+                                       heap_labels + q * kscan, label_positions);
+                        }
+                    }
+                });
+            }
+            errors.rethrow();
+
+            // The refinement of a query pins each of its candidate lists once
+#pragma omp parallel for
+            for (size_t q = 0; q < nb; q++) {
+                errors.run([&] {
+                    if (refine) {
+                        QueryPins pins;
+                        faiss::maxheap_heapify(k, block_distances + q * k, block_labels + q * k);
+                        refine_candidates(kscan, heap_labels + q * kscan, queries.data() + q * d,
+                                          k, block_distances + q * k, block_labels + q * k, pins);
+                    } else if (ids_packed)
+                        position_labels_to_ids(k, block_labels + q * k);
+                    faiss::maxheap_reorder(k, block_distances + q * k, block_labels + q * k);
+                });
+            }
+            errors.rethrow();
+        }
+        return ncode - nskipped;
+    }
 
     void IndexIVF_HNSW::train_pq(size_t n, const float *x)
     {
@@ -223,6 +1261,10 @@ namespace ivfhnsw {
         std::vector <idx_t> assigned(n);
         assign(n, x, assigned.data());
 
+        // Cosine vectors are encoded normalized
+        std::vector<float> normalized_x(metric == METRIC_COSINE ? n * d : 0);
+        x = normalize_vectors(n, x, normalized_x.data());
+
         // Compute residuals for original vectors
         std::vector<float> residuals(n * d);
         compute_residuals(n, x, residuals.data(), assigned.data());
@@ -242,18 +1284,24 @@ namespace ivfhnsw {
             memcpy(copy_residuals.data(), residuals.data(), n * d * sizeof(float));
             opq_matrix->apply_noalloc(n, copy_residuals.data(), residuals.data());
         }
-        // Train residual PQ
-        printf("Training %zdx%zd product quantizer on %ld vectors in %dD\n", pq->M, pq->ksub, n, d);
-        pq->verbose = true;
-        pq->train(n, residuals.data());
+        // Train residual quantizer
+        train_residual_quantizer(n, residuals.data());
 
         // Encode residuals
         std::vector <uint8_t> xcodes(n * code_size);
-        pq->compute_codes(residuals.data(), xcodes.data(), n);
+        encode_residuals(n, residuals.data(), xcodes.data());
 
         // Decode residuals
         std::vector<float> decoded_residuals(n * d);
-        pq->decode(xcodes.data(), decoded_residuals.data(), n);
+        decode_residuals(n, xcodes.data(), decoded_residuals.data());
+
+        // Train refinement PQ on the errors of the residual quantizer
+        if (refine_pq)
+            train_refine_pq(n, residuals.data());
+
+        // Inner product metrics store no norm codes
+        if (metric != METRIC_L2)
+            return;
 
         // Reverse rotation
         if (do_opq){
@@ -279,6 +1327,10 @@ namespace ivfhnsw {
     // Write index 
     void IndexIVF_HNSW::write(const char *path_index)
     {
+        if (list_store) {
+            std::cout << "An index with tiered lists can not be written" << std::endl;
+            abort();
+        }
         std::ofstream output(path_index, std::ios::binary);
 
         write_variable(output, d);
@@ -298,37 +1350,218 @@ namespace ivfhnsw {
 
         // Save centroid norms
         write_vector(output, centroid_norms);
+
+        // Save the residual encoding of the codes
+        write_variable(output, (uint32_t) encoding);
+
+        // Save refinement codes
+        write_refinement(output);
+
+        // Save the metric
+        write_metric(output);
+
+        // Save packed ids
+        write_packed_ids(output);
+
+        // Save the id size
+        write_label_size(output);
+
+        // Save the generation of the lists
+        const uint64_t generation = list_generation;
+        write_variable(output, generation);
+
+        write_end_marker(output);
+        if (!output)
+            throw std::runtime_error(std::string("Failed to write the index: ") + path_index);
     }
 
     // Read index 
     void IndexIVF_HNSW::read(const char *path_index)
     {
         std::ifstream input(path_index, std::ios::binary);
+        if (!input)
+            throw std::runtime_error(std::string("Can not open the index: ") + path_index);
 
-        read_variable(input, d);
+        size_t index_d = 0;
+        read_variable(input, index_d);
         read_variable(input, nc);
+        if (!input || index_d != d)
+            throw std::runtime_error(std::string("Dimension of the index does not match: ") + path_index);
+        if (quantizer && quantizer->cur_element_count != nc)
+            throw std::runtime_error(std::string("Number of lists of the index does not match the quantizer: ")
+                                     + path_index);
+        resize_lists(nc);
 
         // Read vector indices
+        std::vector<size_t> nids(nc), ncodes(nc), nnorm_codes(nc), nrefine_codes(nc, 0);
         for (size_t i = 0; i < nc; i++)
-            read_vector(input, ids[i]);
+            nids[i] = read_list(input, ids[i]);
 
         // Read PQ codes
         for (size_t i = 0; i < nc; i++)
-            read_vector(input, codes[i]);
+            ncodes[i] = read_list(input, codes[i]);
 
         // Read norm PQ codes
         for (size_t i = 0; i < nc; i++)
-            read_vector(input, norm_codes[i]);
+            nnorm_codes[i] = read_list(input, norm_codes[i]);
 
         // Read centroid norms
         read_vector(input, centroid_norms);
+        if (!input || centroid_norms.size() != nc)
+            throw std::runtime_error(std::string("Truncated index: ") + path_index);
+
+        // Indices written before the trailers end right after the centroid norms
+        const bool has_trailers = (input.peek() != EOF);
+
+        // Indices written before the encoding was recorded are PQ encoded
+        uint32_t index_encoding = ENCODING_PQ;
+        if (input.peek() != EOF)
+            read_variable(input, index_encoding);
+        if (index_encoding != encoding)
+            throw std::runtime_error(std::string("Residual encoding of the index does not match: ") + path_index);
+
+        // Read refinement codes
+        read_refinement(input, path_index, nrefine_codes);
+
+        // Read the metric
+        read_metric(input, path_index);
+
+        // Read packed ids
+        read_packed_ids(input);
+
+        // Read the id size
+        read_label_size(input, path_index);
+
+        // Read the generation of the lists, indices without the trailers get a new one
+        uint64_t generation = new_list_generation();
+        if (has_trailers)
+            read_variable(input, generation);
+        list_generation = generation;
+
+        if (has_trailers)
+            read_end_marker(input, path_index);
+        check_lists(path_index, nids, ncodes, nnorm_codes, nrefine_codes);
+    }
+
+    void IndexIVF_HNSW::write_refinement(std::ostream &output)
+    {
+        const uint32_t refine_code_size = refine_pq ? refine_pq->code_size : 0;
+        write_variable(output, refine_code_size);
+        if (refine_pq) {
+            for (size_t i = 0; i < nc; i++)
+                write_vector(output, refine_codes[i]);
+        }
+    }
+
+    void IndexIVF_HNSW::read_refinement(std::istream &input, const char *path_index,
+                                        std::vector<size_t> &nrefine_codes)
+    {
+        // Indices written before refinement have no refinement codes
+        uint32_t refine_code_size = 0;
+        if (input.peek() != EOF)
+            read_variable(input, refine_code_size);
+        if (refine_code_size != (refine_pq ? refine_pq->code_size : 0))
+            throw std::runtime_error(std::string("Refinement code size of the index does not match: ") + path_index);
+        for (size_t i = 0; i < nc; i++) {
+            if (refine_pq)
+                nrefine_codes[i] = read_list(input, refine_codes[i]);
+            else
+                refine_codes[i].clear();
+        }
+    }
+
+    void IndexIVF_HNSW::check_lists(const char *path_index, const std::vector<size_t> &nids,
+                                    const std::vector<size_t> &ncodes, const std::vector<size_t> &nnorm_codes,
+                                    const std::vector<size_t> &nrefine_codes)
+    {
+        const ListLayout layout = list_layout();
+        skipped_sizes.assign(skip_lists ? nc : 0, 0);
+        for (size_t i = 0; i < nc; i++) {
+            const size_t n = ncodes[i] / code_size;
+            const bool consistent = (ncodes[i] == n * code_size) &&
+                                    (nids[i] == (layout.id_size ? n : 0)) &&
+                                    (!ids_packed || packed_ids[i].size() == n) &&
+                                    (nnorm_codes[i] == n * layout.norm_code_size) &&
+                                    (nrefine_codes[i] == n * layout.refine_code_size);
+            if (!consistent)
+                throw std::runtime_error("List " + std::to_string(i) + " of the index is corrupted: " + path_index);
+            if (skip_lists)
+                skipped_sizes[i] = n;
+        }
+    }
+
+    void IndexIVF_HNSW::write_end_marker(std::ostream &output)
+    {
+        output.write(index_end_marker, sizeof(index_end_marker));
+    }
+
+    void IndexIVF_HNSW::read_end_marker(std::istream &input, const char *path_index)
+    {
+        char marker[sizeof(index_end_marker)] = {};
+        input.read(marker, sizeof(marker));
+        if (!input || memcmp(marker, index_end_marker, sizeof(marker)) != 0 || input.peek() != EOF)
+            throw std::runtime_error(std::string("Truncated or corrupted index, written without the end marker: ")
+                                     + path_index);
+    }
+
+    void IndexIVF_HNSW::write_metric(std::ostream &output)
+    {
+        write_variable(output, (uint32_t) metric);
+    }
+
+    void IndexIVF_HNSW::read_metric(std::istream &input, const char *path_index)
+    {
+        // Indices written before the metric was recorded are L2
+        uint32_t index_metric = METRIC_L2;
+        if (input.peek() != EOF)
+            read_variable(input, index_metric);
+        if (index_metric != metric)
+            throw std::runtime_error(std::string("Metric of the index does not match: ") + path_index);
+    }
+
+    void IndexIVF_HNSW::write_packed_ids(std::ostream &output)
+    {
+        // The ids lists are empty if the ids are packed
+        write_variable(output, (uint32_t) ids_packed);
+        if (ids_packed) {
+            for (size_t i = 0; i < nc; i++)
+                packed_ids[i].write(output);
+        }
+    }
+
+    void IndexIVF_HNSW::read_packed_ids(std::istream &input)
+    {
+        // Indices written before the ids could be packed have plain ids
+        uint32_t index_ids_packed = 0;
+        if (input.peek() != EOF)
+            read_variable(input, index_ids_packed);
+        ids_packed = index_ids_packed;
+        packed_ids.resize(ids_packed ? nc : 0);
+        for (size_t i = 0; i < packed_ids.size(); i++)
+            packed_ids[i].read(input);
+    }
+
+    void IndexIVF_HNSW::write_label_size(std::ostream &output)
+    {
+        write_variable(output, (uint32_t) sizeof(label_t));
+    }
+
+    void IndexIVF_HNSW::read_label_size(std::istream &input, const char *path_index)
+    {
+        // Indices written before the id size was recorded have 32-bit ids
+        uint32_t label_size = sizeof(uint32_t);
+        if (input.peek() != EOF)
+            read_variable(input, label_size);
+        if (label_size != sizeof(label_t))
+            throw std::runtime_error(std::string("Id size of the index does not match, check IVFHNSW_64BIT_IDS: ")
+                                     + path_index);
     }
 
     void IndexIVF_HNSW::compute_centroid_norms()
     {
         for (size_t i = 0; i < nc; i++) {
-            const float *centroid = quantizer->getDataByInternalId(i);
-            centroid_norms[i] = faiss::fvec_norm_L2sqr(centroid, d);
+            const float *centroid = quantizer->getDataByLabel(i);
+            centroid_norms[i] = (metric == METRIC_L2) ? faiss::fvec_norm_L2sqr(centroid, d) : 0;
         }
     }
 
@@ -339,13 +1572,14 @@ namespace ivfhnsw {
         }
         std::vector<float> copy_centroid(d);
         for (size_t i = 0; i < nc; i++){
-            float *centroid = quantizer->getDataByInternalId(i);
+            float *centroid = quantizer->getDataByLabel(i);
             memcpy(copy_centroid.data(), centroid, d * sizeof(float));
             opq_matrix->apply_noalloc(1, copy_centroid.data(), centroid);
         }
+        quantizer_rotated = true;
     }
 
-    float IndexIVF_HNSW::pq_L2sqr(const uint8_t *code)
+    float IndexIVF_HNSW::pq_L2sqr(const uint8_t *code, const float *precomputed_table)
     {
         float result = 0.;
         const size_t dim = code_size >> 2;
@@ -363,7 +1597,7 @@ namespace ivfhnsw {
     void IndexIVF_HNSW::reconstruct(size_t n, float *x, const float *decoded_residuals, const idx_t *keys)
     {
         for (size_t i = 0; i < n; i++) {
-            const float *centroid = quantizer->getDataByInternalId(keys[i]);
+            const float *centroid = quantizer->getDataByLabel(keys[i]);
             faiss::fvec_madd(d, decoded_residuals + i*d, 1., centroid, x + i*d);
         }
     }
@@ -371,7 +1605,7 @@ namespace ivfhnsw {
     void IndexIVF_HNSW::compute_residuals(size_t n, const float *x, float *residuals, const idx_t *keys)
     {
         for (size_t i = 0; i < n; i++) {
-            const float *centroid = quantizer->getDataByInternalId(keys[i]);
+            const float *centroid = quantizer->getDataByLabel(keys[i]);
             faiss::fvec_madd(d, x + i*d, -1., centroid, residuals + i*d);
         }
     }
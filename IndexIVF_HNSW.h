@@ -5,6 +5,10 @@
 #include <fstream>
 #include <cstdio>
 #include <unordered_map>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
 
 #include <faiss/index_io.h>
 //#include <faiss/Heap.h>
@@ -17,8 +21,40 @@
 
 #include <hnswlib/hnswalg.h>
 #include "utils.h"
+#include "Arena.h"
+#include "SQ8Quantizer.h"
+#include "XvecFile.h"
+#include "Label.h"
+#include "PackedIds.h"
+#include "RWLock.h"
+#include "TieredListStore.h"
 
 namespace ivfhnsw {
+    /// Encoding of the residuals in the inverted lists
+    enum ResidualEncoding {
+        ENCODING_PQ = 0,   ///< Product quantizer codes of code_size bytes, scored with table lookups
+        ENCODING_SQ8 = 1,  ///< 8-bit scalar quantizer codes of d bytes, scored with a SIMD dot product
+    };
+
+    /// Parse "pq" or "sq8", throw std::runtime_error on the wrong value
+    ResidualEncoding parse_residual_encoding(const char *name);
+
+    /// Similarity the index is searched with
+    enum Metric {
+        METRIC_L2 = 0,             ///< Squared L2 distance
+        METRIC_INNER_PRODUCT = 1,  ///< Max inner product, distances are negated inner products
+        METRIC_COSINE = 2,         ///< METRIC_INNER_PRODUCT with base vectors and queries normalized at ingest
+    };
+
+    /// Parse "l2", "ip" or "cosine", throw std::runtime_error on the wrong value
+    Metric parse_metric(const char *name);
+
+    /// Number of probes and max number of codes to visit for one query
+    struct SearchBudget {
+        size_t nprobe;
+        size_t max_codes;
+    };
+
     /** Index based on a inverted file (IVF) with Product Quantizer encoding.
       *
       * In the inverted file, the quantizer (an HNSW instance) provides a
@@ -36,14 +72,20 @@ namespace ivfhnsw {
       * Supports HNSW quantizer construction, PQ training, adding vertices,
       * serialization and searching.
       *
-      * Each residual vector is encoded as a product quantizer code.
+      * Each residual vector is encoded as a product quantizer code,
+      * or as a scalar quantizer code with ENCODING_SQ8.
+      *
+      * With the inner product metrics the quantizer is searched for the max inner product
+      * and no norm codes are stored: the score of a code is the inner product with the
+      * coarse centroid plus the table lookups of the residual.
       *
       * Currently only asymmetric queries are supported:
       * database-to-database queries are not implemented.
     */
     struct IndexIVF_HNSW
     {
-        typedef uint32_t idx_t;     ///< all indices are this type
+        typedef uint32_t idx_t;     ///< all centroid and list indices are this type, vector ids are label_t
+        typedef std::vector<uint8_t, hnswlib::HugePageAllocator<uint8_t> > code_list;  ///< Codes of one list, on huge page backed slabs
 
         size_t d;               ///< Vector dimension
         size_t nc;              ///< Number of centroids
@@ -51,40 +93,178 @@ namespace ivfhnsw {
 
         hnswlib::HierarchicalNSW *quantizer; ///< Quantizer that maps vectors to inverted lists (HNSW [Y.Malkov])
 
-        faiss::ProductQuantizer *pq;         ///< Produces the residual codes
+        faiss::ProductQuantizer *pq;         ///< Produces the residual codes with ENCODING_PQ
+        SQ8Quantizer *sq;                    ///< Produces the residual codes with ENCODING_SQ8
+        ResidualEncoding encoding;           ///< Encoding of the residuals, see set_encoding
+        Metric metric;                       ///< Similarity of the index, see set_metric
         faiss::ProductQuantizer *norm_pq;    ///< Produces the norm codes of reconstructed base vectors
         faiss::LinearTransform *opq_matrix;  ///< Rotation matrix for OPQ encoding
+        faiss::ProductQuantizer *refine_pq;  ///< Produces the refinement codes of the residual errors, nullptr - no refinement
         bool do_opq;                         ///< Turn on/off OPQ encoding
+        bool quantizer_rotated;              ///< Centroids of the quantizer are rotated by rotate_quantizer
 
         size_t nprobe;        ///< Number of probes at search time
         size_t max_codes;     ///< Max number of codes to visit to do a query
+        size_t refine_k;      ///< Number of the best scan candidates re-ranked with the refinement codes
 
-        std::vector<std::vector<idx_t> > ids;           ///< Inverted lists for indexes
-        std::vector<std::vector<uint8_t> > codes;       ///< PQ codes of residuals
-        std::vector<std::vector<uint8_t> > norm_codes;  ///< PQ codes of norms of reconstructed base vectors
+        size_t ninterleaved;  ///< Number of queries traversed in lockstep in the quantizer by assign and batches, 1 - off
+        bool mmap_quantizer;  ///< Map the quantizer snapshot in build_quantizer instead of reading it
+
+        std::vector<std::vector<label_t> > ids;         ///< Inverted lists for indexes
+        std::vector<code_list> codes;                   ///< PQ or SQ8 codes of residuals
+        std::vector<code_list> norm_codes;              ///< PQ codes of norms of reconstructed base vectors, empty for inner product metrics
+        std::vector<code_list> refine_codes;            ///< Refinement codes parallel to codes, read only for re-ranking
+        std::vector<PackedIds> packed_ids;              ///< Compressed ids of the lists, replace ids after pack_ids
+        bool ids_packed;                                ///< Ids are kept in packed_ids, vectors can not be added
+        TieredListStore *list_store;                    ///< Lists on disk with a cache of the hot ones after tier_lists, nullptr - resident lists
 
     protected:
-        std::vector<float> norms;           ///< L2 square norms of reconstructed base vectors
-        std::vector<float> centroid_norms;  ///< L2 square norms of coarse centroids
+        std::vector<float> centroid_norms;      ///< L2 square norms of coarse centroids, zeros for inner product metrics
+        RWLock lists_lock;                      ///< Held shared by the searches and exclusively by the changes of the lists
+        bool skip_lists;                        ///< read skips the arrays of the lists, set by read_tiered
+        std::vector<size_t> skipped_sizes;      ///< Number of entries of the lists skipped by read
+        std::atomic<uint64_t> list_generation;  ///< Random id of the current lists, saved in the index and the list file
+        bool keep_walk_dists;                   ///< coarse_search keeps the distances of the walks for plan_scans
 
     public:
-        explicit IndexIVF_HNSW(size_t dim, size_t ncentroids, size_t bytes_per_code,
-                               size_t nbits_per_idx, size_t max_group_size = 65536);
+        explicit IndexIVF_HNSW(size_t dim, size_t ncentroids, size_t bytes_per_code, size_t nbits_per_idx);
         virtual ~IndexIVF_HNSW();
 
+        /// Switch the residual encoding before training, ENCODING_SQ8 sets code_size to d
+        void set_encoding(ResidualEncoding encoding);
+
+        /// Switch the metric before building the quantizer and training
+        void set_metric(Metric metric);
+
+        /** Store a second-level PQ code of the residual error for each vector
+          *
+          * The scan scores the primary codes only. The best <refine_k> candidates of the query
+          * are re-ranked with the distances to the vectors reconstructed with both codes.
+          * Call before training.
+          *
+          * @param bytes_per_code   refinement code size in bytes
+        */
+        void enable_refinement(size_t bytes_per_code);
+
+        /// Size of the inner product table of one query for the residual encoding
+        size_t table_size() const;
+
+        /// Number of vectors in the inverted list, with the gaps kept for insertions, see list_nvectors
+        size_t list_size(idx_t list_no) const
+        {
+            return list_store ? list_store->list_size(list_no) : codes[list_no].size() / code_size;
+        }
+
+        /// Number of vectors in the inverted list, without the gaps
+        virtual size_t list_nvectors(idx_t list_no) const { return list_size(list_no); }
+
+        /// Id of the vector at <offset> of the inverted list
+        label_t list_id(idx_t list_no, size_t offset) const
+        {
+            if (ids_packed)
+                return packed_ids[list_no].get(offset);
+            return list_store ? list_store->pin(list_no)->ids[offset] : ids[list_no][offset];
+        }
+
+        /** Compress the ids of all lists with PackedIds and release ids
+          *
+          * The scan then labels candidates by their list positions, and only
+          * the ids of the final results are decoded. Call after adding all vectors.
+        */
+        void pack_ids();
+
+        /** Split the inverted lists with more than <max_list_size> vectors
+          *
+          * The vectors of an oversized list are reconstructed from their codes and split with a local
+          * 2-means in which the list centroid stays fixed. The second centroid is added to the quantizer
+          * with addPoint, and the vectors closer to it are re-encoded into its new list. The other vectors
+          * keep their codes. A list is split again until it fits or a split moves nothing.
+          *
+          * The index stays searchable: the new centroid and its empty list are added under the exclusive lock,
+          * the moved vectors are encoded without it, and they are moved to the new list under the lock again.
+          * The node array of the quantizer is grown once for the estimated number of splits and keeps
+          * the unused room. The quantizer must have regular links and must not be shared with other indices.
+          * Indices with OPQ or packed ids are not split.
+          * Save the grown quantizer with write_quantizer.
+          *
+          * @param max_list_size   max number of vectors in a list
+          * @param niter           max number of 2-means iterations
+          * @return                number of new lists
+        */
+        size_t split_lists(size_t max_list_size, size_t niter = 10);
+
+        /// Write the inverted lists to a list file for tier_lists, packed ids stay in the index
+        void write_lists(const char *path);
+
+        /** Whether the list file was written by write_lists from the current lists of the index
+          *
+          * The file records the generation of the lists, which changes whenever vectors are added
+          * or the lists are split, so the list file of an older build of the index never matches.
+        */
+        bool list_file_matches(const char *path) const;
+
+        /** Move the inverted lists to the list file written by write_lists and keep only the hot ones in RAM
+          *
+          * The resident lists are released, the searches read the lists through a TieredListStore.
+          * The store prefetches the probed lists right after the coarse search. Call after reading the index;
+          * the index becomes read-only and can not be written.
+          *
+          * @param cache_bytes   max size of the cached lists
+          * @param nthreads      number of I/O threads
+        */
+        void tier_lists(const char *path, size_t cache_bytes, size_t nthreads);
+
+        /** Read the index with the inverted lists tiered to the list file, instead of read and tier_lists
+          *
+          * If the list file matches the index, the arrays of the lists are skipped in the index file,
+          * so an index reloaded next to a served one duplicates only the quantizer and the per-list metadata.
+          * Otherwise the lists are read, the list file is rewritten and the lists are tiered.
+          * The ids stay in the list file unless the index was written with packed ids.
+          *
+          * @param cache_bytes   max size of the cached lists
+          * @param nthreads      number of I/O threads
+        */
+        void read_tiered(const char *path_index, const char *path_lists, size_t cache_bytes, size_t nthreads);
+
+        /** Save the quantizer with the centroids added by split_lists next to the index
+          *
+          * The centroids, info and edges go to <path_index>.centroids, <path_index>.info and <path_index>.edges,
+          * the quantizer files the index was built with may be shared and are not overwritten.
+        */
+        void write_quantizer(const char *path_index);
+
+        /// Whether the index has a quantizer saved by write_quantizer
+        static bool has_split_quantizer(const char *path_index);
+
+        /// Load the quantizer saved by write_quantizer instead of build_quantizer
+        void read_split_quantizer(const char *path_index, size_t efConstruction);
+
+        /// Read the residual quantizer of the current encoding, written by write_residual_quantizer
+        void read_residual_quantizer(const char *path);
+
+        /// Write the residual quantizer of the current encoding
+        void write_residual_quantizer(const char *path);
+
         /** Construct from stretch or load the existing quantizer (HNSW) instance
           *
-          * if all files exist, quantizer will be loaded, else HNSW will be constructed
+          * if all files exist, quantizer will be loaded, else HNSW will be constructed.
+          * The quantizer is saved as a snapshot to <path_info>.snapshot, which is loaded
+          * in preference to the other files unless path_info or path_edges changed since it was saved.
           * @param path_data           path to input vectors
           * @param path_info           path to parameters for HNSW
           * @param path_edges          path to edges for HNSW
           * @param M                   min number of edges per point, default: 16
           * @param efConstruction      max number of candidate vertices in queue to observe, default: 500
+          * @param do_reorder          renumber HNSW vertices for memory locality and save the reordered graph,
+          *                            centroids keep being addressed by their indices in path_data
         */
         void build_quantizer(const char *path_data, const char *path_info, const char *path_edges,
-                             size_t M=16, size_t efConstruction = 500);
+                             size_t M=16, size_t efConstruction = 500, bool do_reorder = false);
 
         /** Return the indices of the k HNSW vertices closest to the query x.
+          *
+          * Groups of <ninterleaved> queries are traversed in lockstep to hide memory latency.
+          * Holds the lists lock shared, so it must not be called with the lock held exclusively.
           *
           * @param n           number of input vectors
           * @param x           query vectors, size n * d
@@ -97,13 +277,102 @@ namespace ivfhnsw {
          *
          * Return at most k vectors. If there are not enough results for a
          * query, the result array is padded with -1s.
+         * With the inner product metrics the distances are negated inner products.
+         *
+         * Search keeps its temporary buffers thread local,
+         * so several threads may search the same index concurrently.
          *
          * @param k           number of the closest vertices to search
          * @param x           query vector, size d
          * @param distances   output pairwise distances, size k
          * @param labels      output labels of the nearest neighbours, size k
+         * @param budget      nprobe and max_codes of the query, nullptr - the ones of the index
          */
-        virtual size_t search(size_t k, const float *x, float *distances, long *labels);
+        virtual size_t search(size_t k, const float *x, float *distances, long *labels,
+                              const SearchBudget *budget = nullptr);
+
+        /** Query n vectors of dimension d to the index in parallel.
+         *
+         * Queries are preprocessed in blocks: the block is rotated with one GEMM
+         * and the distance tables of all its queries are computed at once.
+         * Each thread takes groups of <ninterleaved> queries and traverses the quantizer for them in lockstep.
+         *
+         * @param n           number of queries
+         * @param k           number of the closest vertices to search
+         * @param x           query vectors, size n * d
+         * @param distances   output pairwise distances, size n * k
+         * @param labels      output labels of the nearest neighbours, size n * k
+         * @return            total number of visited codes
+         */
+        size_t search_batch(size_t n, size_t k, const float *x, float *distances, long *labels);
+
+        /** Query n vectors of dimension d to the index, scanning each inverted list once per block of queries.
+         *
+         * Intended for large offline batches. The coarse search is done for the whole
+         * block first, in groups of <ninterleaved> queries. Then the probes are grouped by inverted list, and each list is
+         * streamed once, scoring every chunk of codes against all queries probing it
+         * while the chunk is in cache. Each query keeps its own heap guarded by its own lock.
+         * The results are the same as those of search up to the order of equal distances.
+         *
+         * @param n           number of queries
+         * @param k           number of the closest vertices to search
+         * @param x           query vectors, size n * d
+         * @param distances   output pairwise distances, size n * k
+         * @param labels      output labels of the nearest neighbours, size n * k
+         * @return            total number of visited codes
+         */
+        size_t search_list_major(size_t n, size_t k, const float *x, float *distances, long *labels);
+
+        /** Prepare n queries for search_preprocessed
+         *
+         * @param n           number of queries
+         * @param x           query vectors, size n * d
+         * @param queries     output queries, rotated if OPQ is on, size n * d
+         * @param tables      output inner product tables, size n * table_size()
+         */
+        void preprocess_queries(size_t n, const float *x, float *queries, float *tables) const;
+
+        /** Query a vector prepared by preprocess_queries
+         *
+         * @param k           number of the closest vertices to search
+         * @param query       query vector rotated if OPQ is on, size d
+         * @param table       inner product table of the query, size table_size()
+         * @param distances   output pairwise distances, size k
+         * @param labels      output labels of the nearest neighbours, size k
+         * @param budget      nprobe and max_codes of the query, nullptr - the ones of the index
+         */
+        size_t search_preprocessed(size_t k, const float *query, const float *table,
+                                   float *distances, long *labels, const SearchBudget *budget = nullptr);
+
+        /// Nearest coarse centroids of a group of queries, found by coarse_search
+        struct CoarseProbes {
+            size_t nprobe;                                 ///< Number of probes of each query
+            std::vector<idx_t> centroid_idxs;              ///< Probed centroids of each query by increasing distance
+            std::vector<float> centroid_dists;             ///< Quantizer distances to the probed centroids
+            std::vector<hnswlib::DistanceCache> walk_dists;  ///< Distances computed by each walk, see keep_walk_dists
+        };
+
+        /** Find the nearest coarse centroids of a group of queries prepared by preprocess_queries
+          *
+          * The queries are traversed in the quantizer <ninterleaved> at once, so the group should be about that size.
+          * The probes stay usable after split_lists, but miss the vectors it moved to the new lists.
+          *
+          * @param n           number of queries
+          * @param queries     query vectors rotated if OPQ is on, size n * d
+          * @param nprobe      number of centroids to find for each query
+          * @param probes      output probes of the queries
+        */
+        void coarse_search(size_t n, const float *queries, size_t nprobe, CoarseProbes &probes);
+
+        /** Query a vector prepared by preprocess_queries with its probes found by coarse_search
+          *
+          * @param probes      probes of the group of the query
+          * @param query_no    number of the query in the group
+          * @param budget      nprobe and max_codes of the query, nullptr - the ones of the index,
+          *                    nprobe is bounded by the probes
+        */
+        size_t search_probed(size_t k, const float *query, const float *table, CoarseProbes &probes, size_t query_no,
+                             float *distances, long *labels, const SearchBudget *budget = nullptr);
 
         /** Add n vectors of dimension d to the index.
           *
@@ -112,7 +381,7 @@ namespace ivfhnsw {
           * @param xids              ids to store for the vectors (size n)
           * @param precomputed_idx   if non-null, assigned idxs to store for the vectors (size n)
         */
-        virtual void add_batch(size_t n, const float *x, const idx_t *xids, const idx_t *precomputed_idx = nullptr);
+        virtual void add_batch(size_t n, const float *x, const label_t *xids, const idx_t *precomputed_idx = nullptr);
 
         /** Train product quantizers
           *
@@ -124,21 +393,230 @@ namespace ivfhnsw {
         /// Write index to the path
         virtual void write(const char *path);
 
-        /// Read index from the path
+        /// Read index from the path, throw std::runtime_error if the file is missing, truncated or does not match the index
         virtual void read(const char *path);
 
-        /// Compute norms of the HNSW vertices
+        /// Compute norms of the HNSW vertices, the coarse distances of inner product metrics need no correction
         void compute_centroid_norms();
 
         /// For correct search using OPQ encoding rotate points in the coarse quantizer
         void rotate_quantizer();
 
     protected:
-        /// Size pq.M * pq.ksub
-        std::vector<float> precomputed_table;
+        /// Range of codes of an inverted list to be scanned for a query
+        struct ListScan {
+            idx_t list_no;    ///< Inverted list
+            idx_t begin;      ///< First code of the range in the list
+            idx_t end;        ///< End of the range in the list
+            float term;       ///< Distance term shared by all codes of the range, without the norms and the table lookups
+            float bound;      ///< Lower bound of the distances in the range, skipped if not below the k-th best distance
+            idx_t probe;      ///< Position of the list in the probes of the query
+        };
+
+        /// Lists pinned by one query, each probed list is pinned once and kept until the end of the query
+        struct QueryPins {
+            std::vector<ListPin> pins;    ///< Pin of each probe, empty until the probe is scanned
+            std::vector<idx_t> list_nos;  ///< List of each probe
+        };
+
+        /// Data of the list of the scan, pinned by the first scan of the probe
+        ListData scan_list(QueryPins &pins, const ListScan &scan) const;
+
+        /// Data of a list pinned by the scans of the query, pinned now if the query did not scan it
+        ListData scanned_list(QueryPins &pins, idx_t list_no) const;
+
+        /** Find the ranges of inverted lists to scan for the query
+          *
+          * @param query           query vector rotated if OPQ is on, size d
+          * @param budget          nprobe and max_codes of the query
+          * @param centroid_idxs   nearest coarse centroids of the query by increasing distance, size budget.nprobe
+          * @param centroid_dists  quantizer distances to them
+          * @param walk_dists      distances computed by the coarse search, if kept, see keep_walk_dists
+          * @param scans           output ranges in the probing order
+          * @return                number of codes in the ranges
+        */
+        virtual size_t plan_scans(const float *query, const SearchBudget &budget, const idx_t *centroid_idxs,
+                                  const float *centroid_dists, hnswlib::DistanceCache &walk_dists,
+                                  std::vector<ListScan> &scans);
+
+        /// coarse_search with lists_lock held by the caller
+        void find_probes(size_t n, const float *queries, size_t nprobe, CoarseProbes &probes);
+
+        /// search_probed with lists_lock held by the caller
+        size_t search_query(size_t k, const float *query, const float *table, CoarseProbes &probes, size_t query_no,
+                            float *distances, long *labels, const SearchBudget &budget);
+
+        /** Score the codes [begin, end) of the scanned range and push them to the heap of the query
+          *
+          * @param list     data of the scanned list
+          * @param norms    decoded norms of the codes, starting from <begin>
+          * @param table    inner product table of the query, size table_size()
+          * @param label_positions  push position_label of the codes instead of their ids
+        */
+        void scan_codes(const ListScan &scan, const ListData &list, size_t begin, size_t end, const float *norms,
+                        const float *table, size_t k, float *distances, long *labels, bool label_positions = false);
+
+        /// L2 sqr distance function for PQ codes, precomputed_table size pq.M * pq.ksub
+        float pq_L2sqr(const uint8_t *code, const float *precomputed_table);
+
+        /// Train the refinement PQ on the errors of the residual quantizer, residuals rotated if OPQ is on
+        void train_refine_pq(size_t n, const float *residuals);
+
+        /// Encode the errors <residuals> - <decoded_residuals> with the refinement PQ
+        void encode_refinement(size_t n, const float *residuals, const float *decoded_residuals,
+                               uint8_t *refine_xcodes) const;
+
+        /// Write the refinement code size and the refinement codes, if any
+        void write_refinement(std::ostream &output);
+
+        /// Read the refinement trailer written by write_refinement, the code size must match refine_pq
+        void read_refinement(std::istream &input, const char *path_index, std::vector<size_t> &nrefine_codes);
+
+        /// Read the array of an inverted list written by write_vector, or skip it if <skip_lists> is set
+        template<typename T, typename A>
+        size_t read_list(std::istream &input, std::vector<T, A> &list)
+        {
+            uint32_t size = 0;
+            read_variable(input, size);
+            if (skip_lists) {
+                list.clear();
+                input.seekg(size * sizeof(T), std::ios::cur);
+            } else {
+                list.resize(size);
+                input.read((char *) list.data(), size * sizeof(T));
+            }
+            return size;
+        }
+
+        /** Check that the arrays of each list read from <path_index> have the same number of entries
+          *
+          * The sizes of the skipped lists are kept in skipped_sizes. Throws std::runtime_error otherwise.
+          *
+          * @param nids            number of ids of each list
+          * @param ncodes          number of code bytes of each list, the same for the other codes
+        */
+        void check_lists(const char *path_index, const std::vector<size_t> &nids, const std::vector<size_t> &ncodes,
+                         const std::vector<size_t> &nnorm_codes, const std::vector<size_t> &nrefine_codes);
+
+        /// Write the end marker after the last section of the index
+        void write_end_marker(std::ostream &output);
+
+        /// Check the end marker written by write_end_marker, throw std::runtime_error if the index is truncated
+        void read_end_marker(std::istream &input, const char *path_index);
+
+        /// Vector the code at <offset> of the list is the residual of: the coarse centroid
+        virtual void list_base(idx_t list_no, size_t offset, float *base) const;
 
-        /// L2 sqr distance function for PQ codes
-        float pq_L2sqr(const uint8_t *code);
+        /** Re-rank the scan candidates with the refinement codes and push them to the heap of the query
+          *
+          * @param ncand          number of the candidates
+          * @param cand_labels    candidate positions made by position_label, -1 for missing candidates
+          * @param pins           lists pinned by the scans of the query
+        */
+        void refine_candidates(size_t ncand, const long *cand_labels, const float *query,
+                               size_t k, float *distances, long *labels, QueryPins &pins) const;
+
+        /// Entry layout of the lists in the list file
+        ListLayout list_layout() const;
+
+        /// Data of the list in RAM
+        ListData resident_list(idx_t list_no) const;
+
+        /// Data of the list, resident or pinned in the list store
+        ListPin pin_list(idx_t list_no) const
+        {
+            return list_store ? list_store->pin(list_no) : ListPin(resident_list(list_no));
+        }
+
+        /// Start reading the first lists of the probes up to <max_codes> codes from the list store, if any
+        void prefetch_lists(const idx_t *list_nos, size_t n, size_t max_codes) const;
+
+        /// Label of the code at <offset> of the list in the candidate heaps of the refinement
+        static long position_label(idx_t list_no, size_t offset) { return ((long) list_no << 32) | offset; }
+
+        /// Replace position labels of the k results with the ids of the vectors, -1 labels are kept
+        void position_labels_to_ids(size_t k, long *labels) const;
+
+        /// Write the packed ids flag and the packed ids, if any
+        void write_packed_ids(std::ostream &output);
+
+        /// Read the packed ids written by write_packed_ids
+        void read_packed_ids(std::istream &input);
+
+        /// Write the size of label_t
+        void write_label_size(std::ostream &output);
+
+        /// Read the size of label_t and check that the index was written by a build with the same ids
+        void read_label_size(std::istream &input, const char *path_index);
+
+        /// Train the residual quantizer of the current encoding on the residuals, rotated if OPQ is on
+        void train_residual_quantizer(size_t n, const float *residuals);
+
+        /// Encode n residuals, rotated if OPQ is on, with the residual quantizer
+        void encode_residuals(size_t n, const float *residuals, uint8_t *xcodes) const;
+
+        /// Decode n residual codes
+        void decode_residuals(size_t n, const uint8_t *xcodes, float *residuals) const;
+
+        /// Normalize n vectors to <buffer> and return it with METRIC_COSINE, otherwise return x
+        const float *normalize_vectors(size_t n, const float *x, float *buffer) const;
+
+        /// Write the metric tag after the other index data
+        void write_metric(std::ostream &output);
+
+        /// Read the metric tag written by write_metric, the metric must match
+        void read_metric(std::istream &input, const char *path_index);
+
+        /// Resize the per-list data to <new_nc> lists
+        virtual void resize_lists(size_t new_nc);
+
+        /// Offsets of the vectors in the list, gaps are skipped
+        virtual void list_entries(idx_t list_no, std::vector<size_t> &offsets) const;
+
+        /// Remove the vectors of the list flagged in <removed>, size list_size(list_no)
+        virtual void remove_entries(idx_t list_no, const std::vector<uint8_t> &removed);
+
+        /// Entries of a new list, encoded by encode_list without the lock and moved to the list by commit_list
+        struct EncodedList {
+            std::vector<label_t> ids;
+            code_list codes;
+            code_list norm_codes;
+            code_list refine_codes;
+
+            virtual ~EncodedList() {}
+        };
+
+        /// Encode n vectors for the new empty list, the lists are only read
+        virtual std::unique_ptr<EncodedList> encode_list(idx_t list_no, size_t n, const float *x, const label_t *xids);
+
+        /// Move the entries encoded by encode_list to the new empty list, under the exclusive lock
+        virtual void commit_list(idx_t list_no, EncodedList &list);
+
+        /// Encode n vectors as residuals from their centroids <idx> with the norm and the refinement codes
+        void encode_vectors(size_t n, const float *x, const idx_t *idx, uint8_t *xcodes, uint8_t *xnorm_codes,
+                            uint8_t *refine_xcodes);
+
+        /// Copy the codes and the id of the vector at <from> of the list to <to>
+        void move_entry(idx_t list_no, size_t from, size_t to);
+
+        /// Reconstruct the vector at <offset> of the list from its codes, with the refinement code if any
+        void reconstruct_entry(idx_t list_no, const ListData &list, size_t offset, float *x) const;
+
+        /// Give the lists a new generation, so the list files written before the change do not match
+        void lists_changed() { list_generation = new_list_generation(); }
+
+        /// Random generation of the lists, unique within the process
+        static uint64_t new_list_generation();
+
+        /** Local 2-means of the vectors of the list, the list centroid stays fixed
+          *
+          * @param x              reconstructed vectors of the list, size n * d
+          * @param new_centroid   output second centroid, size d
+          * @param moved          output flags of the vectors closer to the second centroid, size n
+          * @return               number of the moved vectors
+        */
+        size_t split_centroid(idx_t list_no, size_t n, const float *x, size_t niter,
+                              float *new_centroid, uint8_t *moved) const;
 
     private:
         void reconstruct(size_t n, float *x, const float *decoded_residuals, const idx_t *keys);
@@ -1,130 +1,557 @@
 #include "IndexIVF_HNSW_Grouping.h"
 
+#ifndef FINTEGER
+#define FINTEGER long
+#endif
+
+extern "C" {
+/* declare BLAS functions, see http://www.netlib.org/clapack/cblas/ */
+int sgemm_(const char *transa, const char *transb, FINTEGER *m, FINTEGER *n, FINTEGER *k,
+           const float *alpha, const float *a, FINTEGER *lda, const float *b, FINTEGER *ldb,
+           float *beta, float *c, FINTEGER *ldc);
+}
+
 namespace ivfhnsw
 {
+    namespace {
+        /// Rows of points multiplied by the sub-centroids with one GEMM
+        const size_t gemm_block_size = 1024;
+
+        /// Min capacity of a sub-group that is laid out again to take more vectors
+        const size_t min_subgroup_capacity = 8;
+
+        /// ip[i * ny + j] = <x_i, y_j>
+        void inner_products(const float *x, const float *y, size_t d, size_t nx, size_t ny, float *ip)
+        {
+            float one = 1, zero = 0;
+            FINTEGER nyi = ny, nxi = nx, di = d;
+            sgemm_("Transpose", "Not transpose", &nyi, &nxi, &di, &one,
+                   y, &di, x, &di, &zero, ip, &nyi);
+        }
+
+        /// Index of the minimum, the first one among equal values
+        size_t argmin(const float *v, size_t n)
+        {
+            size_t j = 0;
+            size_t min_idx = 0;
+            float min_val = v[0];
+#ifdef __AVX2__
+            if (n >= 16) {
+                __m256 min_vals = _mm256_loadu_ps(v);
+                __m256i min_idxs = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+                __m256i idxs = min_idxs;
+                const __m256i step = _mm256_set1_epi32(8);
+
+                for (j = 8; j + 8 <= n; j += 8) {
+                    idxs = _mm256_add_epi32(idxs, step);
+                    const __m256 vals = _mm256_loadu_ps(v + j);
+                    const __m256 less = _mm256_cmp_ps(vals, min_vals, _CMP_LT_OQ);
+                    min_vals = _mm256_blendv_ps(min_vals, vals, less);
+                    min_idxs = _mm256_blendv_epi8(min_idxs, idxs, _mm256_castps_si256(less));
+                }
+                // Each lane keeps its first minimum, pick the first one among the lanes
+                float lane_vals[8];
+                int32_t lane_idxs[8];
+                _mm256_storeu_ps(lane_vals, min_vals);
+                _mm256_storeu_si256((__m256i *) lane_idxs, min_idxs);
+                min_val = lane_vals[0];
+                min_idx = lane_idxs[0];
+                for (size_t lane = 1; lane < 8; lane++) {
+                    if (lane_vals[lane] < min_val || (lane_vals[lane] == min_val && lane_idxs[lane] < min_idx)) {
+                        min_val = lane_vals[lane];
+                        min_idx = lane_idxs[lane];
+                    }
+                }
+            }
+#endif
+            for (; j < n; j++) {
+                if (v[j] < min_val) {
+                    min_val = v[j];
+                    min_idx = j;
+                }
+            }
+            return min_idx;
+        }
+    }
+
     //================================================
     // IVF_HNSW + grouping( + pruning) implementation
     //================================================
     IndexIVF_HNSW_Grouping::IndexIVF_HNSW_Grouping(size_t dim, size_t ncentroids, size_t bytes_per_code,
                                                    size_t nbits_per_idx, size_t nsubcentroids):
-           IndexIVF_HNSW(dim, ncentroids, bytes_per_code, nbits_per_idx), nsubc(nsubcentroids)
+           IndexIVF_HNSW(dim, ncentroids, bytes_per_code, nbits_per_idx), nsubc(nsubcentroids),
+           pruning_mode(PRUNING_THRESHOLD), bound_scale(0.5)
     {
+        keep_walk_dists = true;
         alphas.resize(nc);
+        subgroup_radii.resize(nc);
+        norm_errors.resize(nc, 0);
         nn_centroid_idxs.resize(nc);
         subgroup_sizes.resize(nc);
-
-        query_centroid_dists.resize(nc);
-        std::fill(query_centroid_dists.begin(), query_centroid_dists.end(), 0);
+        subgroup_capacities.resize(nc);
         inter_centroid_dists.resize(nc);
     }
 
     void IndexIVF_HNSW_Grouping::add_group(size_t centroid_idx, size_t group_size,
-                                           const float *data, const idx_t *idxs)
+                                           const float *data, const label_t *idxs)
     {
-        // Find NN centroids to source centroid 
-        const float *centroid = quantizer->getDataByInternalId(centroid_idx);
-        std::priority_queue<std::pair<float, idx_t>> nn_centroids_raw = quantizer->searchKnn(centroid, nsubc + 1);
-
-        std::vector<float> centroid_vector_norms_L2sqr(nsubc);
-        nn_centroid_idxs[centroid_idx].resize(nsubc);
-        while (nn_centroids_raw.size() > 1) {
-            centroid_vector_norms_L2sqr[nn_centroids_raw.size() - 2] = nn_centroids_raw.top().first;
-            nn_centroid_idxs[centroid_idx][nn_centroids_raw.size() - 2] = nn_centroids_raw.top().second;
-            nn_centroids_raw.pop();
+        if (ids_packed || list_store) {
+            std::cout << "Vectors can not be added after the ids are packed or the lists are tiered" << std::endl;
+            abort();
+        }
+        lists_changed();
+        // Groups with sub-centroids take the vectors into their sub-groups
+        if (!subgroup_sizes[centroid_idx].empty()) {
+            insert_group(centroid_idx, group_size, data, idxs);
+            return;
         }
+        EncodedGroup group;
+        encode_new_group(centroid_idx, group_size, data, idxs, group);
+        commit_group(centroid_idx, group);
+    }
+
+    void IndexIVF_HNSW_Grouping::encode_new_group(idx_t centroid_idx, size_t group_size, const float *data,
+                                                  const label_t *idxs, EncodedGroup &group)
+    {
+        // Workspaces are taken from the arena of the thread and released at the end of the group
+        Arena &arena = Arena::local();
+        ArenaScope scope(arena);
+        const bool has_norms = (metric == METRIC_L2);
+
+        // Find NN centroids to source centroid 
+        const float *centroid = quantizer->getDataByLabel(centroid_idx);
+        float *centroid_vector_norms = arena.alloc<float>(nsubc);
+        group.nn_centroid_idxs.resize(nsubc);
+        find_nn_centroids(centroid_idx, group.nn_centroid_idxs.data(), centroid_vector_norms);
         if (group_size == 0)
             return;
 
-        const float *centroid_vector_norms = centroid_vector_norms_L2sqr.data();
-        const idx_t *nn_centroids = nn_centroid_idxs[centroid_idx].data();
+        // Cosine vectors are encoded normalized
+        float *normalized = (metric == METRIC_COSINE) ? arena.alloc<float>(group_size * d) : nullptr;
+        data = normalize_vectors(group_size, data, normalized);
+
+        const idx_t *nn_centroids = group.nn_centroid_idxs.data();
 
         // Compute centroid-neighbor_centroid and centroid-group_point vectors
-        std::vector<float> centroid_vectors(nsubc * d);
+        float *centroid_vectors = arena.alloc<float>(nsubc * d);
         for (size_t subc = 0; subc < nsubc; subc++) {
-            const float *neighbor_centroid = quantizer->getDataByInternalId(nn_centroids[subc]);
-            faiss::fvec_madd(d, neighbor_centroid, -1., centroid, centroid_vectors.data() + subc * d);
+            const float *neighbor_centroid = quantizer->getDataByLabel(nn_centroids[subc]);
+            faiss::fvec_madd(d, neighbor_centroid, -1., centroid, centroid_vectors + subc * d);
         }
 
         // Compute alpha for group vectors
-        alphas[centroid_idx] = compute_alpha(centroid_vectors.data(), data, centroid,
-                                             centroid_vector_norms, group_size);
+        group.alpha = compute_alpha(centroid_vectors, data, centroid, centroid_vector_norms, group_size);
 
         // Compute final subcentroids
-        std::vector<float> subcentroids(nsubc * d);
+        float *subcentroids = arena.alloc<float>(nsubc * d);
+        compute_subcentroids(centroid, group.alpha, nn_centroids, subcentroids);
+
+        // Find subcentroid idx
+        idx_t *subcentroid_idxs = arena.alloc<idx_t>(group_size);
+        compute_subcentroid_idxs(subcentroid_idxs, subcentroids, data, group_size);
+
+        // Compute codes
+        const size_t refine_code_size = refine_pq ? refine_pq->code_size : 0;
+        uint8_t *xcodes = arena.alloc<uint8_t>(group_size * code_size);
+        uint8_t *xnorm_codes = arena.alloc<uint8_t>(has_norms ? group_size : 0);
+        uint8_t *refine_xcodes = arena.alloc<uint8_t>(group_size * refine_code_size);
+        float *residual_norms = arena.alloc<float>(group_size);
+        group.norm_error = encode_group(group_size, data, subcentroids, subcentroid_idxs,
+                                        xcodes, xnorm_codes, refine_xcodes, residual_norms);
+
+        // Sub-group radii
+        group.subgroup_radii.assign(nsubc, 0);
+        for (size_t i = 0; i < group_size; i++) {
+            float &radius = group.subgroup_radii[subcentroid_idxs[i]];
+            radius = std::max(radius, residual_norms[i]);
+        }
+
+        // Distribute codes by sub-groups with a counting sort, keeping the order within each sub-group
+        size_t *subgroup_offsets = arena.alloc<size_t>(nsubc + 1);
+        std::fill(subgroup_offsets, subgroup_offsets + nsubc + 1, 0);
+        for (size_t i = 0; i < group_size; i++)
+            subgroup_offsets[subcentroid_idxs[i] + 1]++;
+        group.subgroup_sizes.clear();
         for (size_t subc = 0; subc < nsubc; subc++) {
-            const float *centroid_vector = centroid_vectors.data() + subc * d;
-            float *subcentroid = subcentroids.data() + subc * d;
-            faiss::fvec_madd(d, centroid, alphas[centroid_idx], centroid_vector, subcentroid);
+            group.subgroup_sizes.push_back(subgroup_offsets[subc + 1]);
+            subgroup_offsets[subc + 1] += subgroup_offsets[subc];
         }
 
-        // Find subcentroid idx
-        std::vector<idx_t> subcentroid_idxs(group_size);
-        compute_subcentroid_idxs(subcentroid_idxs.data(), subcentroids.data(), data, group_size);
+        group.ids.resize(group_size);
+        group.codes.resize(group_size * code_size);
+        group.norm_codes.resize(has_norms ? group_size : 0);
+        group.refine_codes.resize(group_size * refine_code_size);
+
+        for (size_t i = 0; i < group_size; i++) {
+            const size_t pos = subgroup_offsets[subcentroid_idxs[i]]++;
+            group.ids[pos] = idxs[i];
+            if (has_norms)
+                group.norm_codes[pos] = xnorm_codes[i];
+            memcpy(group.codes.data() + pos * code_size, xcodes + i * code_size, code_size);
+            if (refine_pq)
+                memcpy(group.refine_codes.data() + pos * refine_code_size,
+                       refine_xcodes + i * refine_code_size, refine_code_size);
+        }
+    }
+
+    void IndexIVF_HNSW_Grouping::commit_group(idx_t centroid_idx, EncodedGroup &group)
+    {
+        nn_centroid_idxs[centroid_idx].swap(group.nn_centroid_idxs);
+        if (group.ids.empty())
+            return;
+
+        // Add codes to the index
+        alphas[centroid_idx] = group.alpha;
+        norm_errors[centroid_idx] = group.norm_error;
+        subgroup_radii[centroid_idx].swap(group.subgroup_radii);
+        subgroup_sizes[centroid_idx].swap(group.subgroup_sizes);
+        IndexIVF_HNSW::commit_list(centroid_idx, group);
+    }
+
+    void IndexIVF_HNSW_Grouping::insert_group(idx_t centroid_idx, size_t n, const float *data, const label_t *xids)
+    {
+        if (subgroup_sizes[centroid_idx].size() != nsubc) {
+            std::cout << "Group " << centroid_idx << " has several runs of sub-groups, "
+                      << "rebuild the index to add vectors to it" << std::endl;
+            abort();
+        }
+        Arena &arena = Arena::local();
+        ArenaScope scope(arena);
+        const bool has_norms = (metric == METRIC_L2);
+
+        // Cosine vectors are encoded normalized
+        float *normalized = (metric == METRIC_COSINE) ? arena.alloc<float>(n * d) : nullptr;
+        data = normalize_vectors(n, data, normalized);
+
+        // Sub-centroids are kept, the vectors go to the nearest ones
+        float *subcentroids = arena.alloc<float>(nsubc * d);
+        compute_subcentroids(centroid_idx, subcentroids);
+        idx_t *subcentroid_idxs = arena.alloc<idx_t>(n);
+        compute_subcentroid_idxs(subcentroid_idxs, subcentroids, data, n);
+
+        const size_t refine_code_size = refine_pq ? refine_pq->code_size : 0;
+        uint8_t *xcodes = arena.alloc<uint8_t>(n * code_size);
+        uint8_t *xnorm_codes = arena.alloc<uint8_t>(has_norms ? n : 0);
+        uint8_t *refine_xcodes = arena.alloc<uint8_t>(n * refine_code_size);
+        float *residual_norms = arena.alloc<float>(n);
+        const float norm_error = encode_group(n, data, subcentroids, subcentroid_idxs,
+                                              xcodes, xnorm_codes, refine_xcodes, residual_norms);
+
+        // The vectors are encoded without the lock, the group is changed under it
+        std::lock_guard<RWLock> lock(lists_lock);
+
+        // Grow the radii, groups without radii get them from compute_subgroup_radii
+        if (subgroup_radii[centroid_idx].size() == nsubc) {
+            norm_errors[centroid_idx] = std::max(norm_errors[centroid_idx], norm_error);
+            for (size_t i = 0; i < n; i++) {
+                float &radius = subgroup_radii[centroid_idx][subcentroid_idxs[i]];
+                radius = std::max(radius, residual_norms[i]);
+            }
+        }
+
+        // A full sub-group doubles its capacity, the other sub-groups keep their gaps
+        std::vector<idx_t> &sizes = subgroup_sizes[centroid_idx];
+        size_t *counts = arena.alloc<size_t>(nsubc);
+        std::fill(counts, counts + nsubc, 0);
+        for (size_t i = 0; i < n; i++)
+            counts[subcentroid_idxs[i]]++;
+
+        bool fits = true;
+        std::vector<idx_t> capacities(nsubc);
+        for (size_t subc = 0; subc < nsubc; subc++) {
+            const size_t capacity = subgroup_capacity(centroid_idx, subc);
+            const size_t needed = sizes[subc] + counts[subc];
+            capacities[subc] = capacity;
+            if (needed > capacity) {
+                capacities[subc] = std::max(needed, std::max(2 * capacity, min_subgroup_capacity));
+                fits = false;
+            }
+        }
+        if (!fits)
+            relayout_group(centroid_idx, capacities);
+
+        // Ends of the sub-groups in the list
+        size_t *subgroup_ends = arena.alloc<size_t>(nsubc);
+        for (size_t subc = 0, offset = 0; subc < nsubc; subc++) {
+            subgroup_ends[subc] = offset + sizes[subc];
+            offset += subgroup_capacity(centroid_idx, subc);
+        }
+        for (size_t i = 0; i < n; i++) {
+            const idx_t subc = subcentroid_idxs[i];
+            const size_t pos = subgroup_ends[subc]++;
+            ids[centroid_idx][pos] = xids[i];
+            if (has_norms)
+                norm_codes[centroid_idx][pos] = xnorm_codes[i];
+            memcpy(codes[centroid_idx].data() + pos * code_size, xcodes + i * code_size, code_size);
+            if (refine_pq)
+                memcpy(refine_codes[centroid_idx].data() + pos * refine_code_size,
+                       refine_xcodes + i * refine_code_size, refine_code_size);
+        }
+        for (size_t subc = 0; subc < nsubc; subc++)
+            sizes[subc] += counts[subc];
+    }
+
+    void IndexIVF_HNSW_Grouping::relayout_group(idx_t centroid_idx, const std::vector<idx_t> &capacities)
+    {
+        const bool has_norms = (metric == METRIC_L2);
+        const size_t refine_code_size = refine_pq ? refine_pq->code_size : 0;
+        size_t nslots = 0;
+        for (size_t subc = 0; subc < capacities.size(); subc++)
+            nslots += capacities[subc];
+
+        std::vector<label_t> new_ids(nslots, 0);
+        code_list new_codes(nslots * code_size, 0);
+        code_list new_norm_codes(has_norms ? nslots : 0, 0);
+        code_list new_refine_codes(nslots * refine_code_size, 0);
+
+        size_t offset = 0;
+        size_t new_offset = 0;
+        for (size_t subc = 0; subc < capacities.size(); subc++) {
+            const size_t size = subgroup_sizes[centroid_idx][subc];
+            std::copy(ids[centroid_idx].begin() + offset, ids[centroid_idx].begin() + offset + size,
+                      new_ids.begin() + new_offset);
+            memcpy(new_codes.data() + new_offset * code_size, codes[centroid_idx].data() + offset * code_size,
+                   size * code_size);
+            if (has_norms)
+                memcpy(new_norm_codes.data() + new_offset, norm_codes[centroid_idx].data() + offset, size);
+            if (refine_pq)
+                memcpy(new_refine_codes.data() + new_offset * refine_code_size,
+                       refine_codes[centroid_idx].data() + offset * refine_code_size, size * refine_code_size);
+            offset += subgroup_capacity(centroid_idx, subc);
+            new_offset += capacities[subc];
+        }
+        ids[centroid_idx].swap(new_ids);
+        codes[centroid_idx].swap(new_codes);
+        norm_codes[centroid_idx].swap(new_norm_codes);
+        refine_codes[centroid_idx].swap(new_refine_codes);
+        subgroup_capacities[centroid_idx] = capacities;
+    }
+
+    void IndexIVF_HNSW_Grouping::add(size_t n, const float *x, const label_t *xids)
+    {
+        if (ids_packed || list_store) {
+            std::cout << "Vectors can not be added after the ids are packed or the lists are tiered" << std::endl;
+            abort();
+        }
+        lists_changed();
+        std::vector<idx_t> assigned(n);
+        assign(n, x, assigned.data());
+
+        // Order the vectors by group with a counting sort
+        std::vector<size_t> group_offsets(nc + 1, 0);
+        for (size_t i = 0; i < n; i++)
+            group_offsets[assigned[i] + 1]++;
+        for (size_t i = 0; i < nc; i++)
+            group_offsets[i + 1] += group_offsets[i];
+
+        std::vector<idx_t> order(n);
+        {
+            std::vector<size_t> positions(group_offsets.begin(), group_offsets.end() - 1);
+            for (size_t i = 0; i < n; i++)
+                order[positions[assigned[i]]++] = i;
+        }
+        std::vector<idx_t> groups;
+        for (size_t i = 0; i < nc; i++)
+            if (group_offsets[i + 1] > group_offsets[i])
+                groups.push_back(i);
+
+#pragma omp parallel for schedule(dynamic)
+        for (size_t g = 0; g < groups.size(); g++) {
+            const idx_t centroid_idx = groups[g];
+            const size_t group_begin = group_offsets[centroid_idx];
+            const size_t group_size = group_offsets[centroid_idx + 1] - group_begin;
+
+            Arena &arena = Arena::local();
+            ArenaScope scope(arena);
+            float *group_x = arena.alloc<float>(group_size * d);
+            label_t *group_ids = arena.alloc<label_t>(group_size);
+            for (size_t i = 0; i < group_size; i++) {
+                const idx_t j = order[group_begin + i];
+                memcpy(group_x + i * d, x + j * d, d * sizeof(float));
+                group_ids[i] = xids[j];
+            }
+
+            // Groups that were empty get their sub-centroids from these vectors, entirely under the lock.
+            // The other groups take the lock only to commit the encoded vectors
+            if (subgroup_sizes[centroid_idx].empty()) {
+                std::lock_guard<RWLock> lock(lists_lock);
+                add_group(centroid_idx, group_size, group_x, group_ids);
+                if (inter_centroid_dists[centroid_idx].size() != nsubc)
+                    compute_inter_centroid_dists(centroid_idx);
+            } else
+                insert_group(centroid_idx, group_size, group_x, group_ids);
+        }
+    }
+
+    void IndexIVF_HNSW_Grouping::compact_subgroups()
+    {
+        lists_changed();
+#pragma omp parallel for schedule(dynamic)
+        for (size_t i = 0; i < nc; i++) {
+            if (subgroup_capacities[i].empty())
+                continue;
+            std::lock_guard<RWLock> lock(lists_lock);
+            relayout_group(i, subgroup_sizes[i]);
+            subgroup_capacities[i].clear();
+        }
+    }
+
+    size_t IndexIVF_HNSW_Grouping::list_nvectors(idx_t list_no) const
+    {
+        size_t n = 0;
+        for (idx_t size : subgroup_sizes[list_no])
+            n += size;
+        return n;
+    }
+
+    void IndexIVF_HNSW_Grouping::resize_lists(size_t new_nc)
+    {
+        IndexIVF_HNSW::resize_lists(new_nc);
+        alphas.resize(nc);
+        subgroup_radii.resize(nc);
+        norm_errors.resize(nc, 0);
+        nn_centroid_idxs.resize(nc);
+        subgroup_sizes.resize(nc);
+        subgroup_capacities.resize(nc);
+        inter_centroid_dists.resize(nc);
+    }
+
+    void IndexIVF_HNSW_Grouping::list_entries(idx_t list_no, std::vector<size_t> &offsets) const
+    {
+        offsets.clear();
+        size_t offset = 0;
+        for (size_t subc = 0; subc < subgroup_sizes[list_no].size(); subc++) {
+            for (size_t j = 0; j < subgroup_sizes[list_no][subc]; j++)
+                offsets.push_back(offset + j);
+            offset += subgroup_capacity(list_no, subc);
+        }
+    }
+
+    void IndexIVF_HNSW_Grouping::remove_entries(idx_t list_no, const std::vector<uint8_t> &removed)
+    {
+        // The removed vectors leave gaps at the ends of their sub-groups, the radii stay upper bounds
+        std::vector<idx_t> &sizes = subgroup_sizes[list_no];
+        if (subgroup_capacities[list_no].empty())
+            subgroup_capacities[list_no] = sizes;
+
+        size_t offset = 0;
+        for (size_t subc = 0; subc < sizes.size(); subc++) {
+            size_t kept = 0;
+            for (size_t j = 0; j < sizes[subc]; j++) {
+                if (removed[offset + j])
+                    continue;
+                if (kept != j)
+                    move_entry(list_no, offset + j, offset + kept);
+                kept++;
+            }
+            sizes[subc] = kept;
+            offset += subgroup_capacities[list_no][subc];
+        }
+    }
+
+    std::unique_ptr<IndexIVF_HNSW::EncodedList> IndexIVF_HNSW_Grouping::encode_list(idx_t list_no, size_t n,
+                                                                                   const float *x, const label_t *xids)
+    {
+        std::unique_ptr<EncodedGroup> group(new EncodedGroup);
+        encode_new_group(list_no, n, x, xids, *group);
+        return std::unique_ptr<EncodedList>(group.release());
+    }
+
+    void IndexIVF_HNSW_Grouping::commit_list(idx_t list_no, EncodedList &list)
+    {
+        commit_group(list_no, static_cast<EncodedGroup &>(list));
+        compute_inter_centroid_dists(list_no);
+    }
+
+    void IndexIVF_HNSW_Grouping::compute_subcentroids(idx_t centroid_idx, float *subcentroids) const
+    {
+        compute_subcentroids(quantizer->getDataByLabel(centroid_idx), alphas[centroid_idx],
+                             nn_centroid_idxs[centroid_idx].data(), subcentroids);
+    }
+
+    void IndexIVF_HNSW_Grouping::compute_subcentroids(const float *centroid, float alpha, const idx_t *nn_idxs,
+                                                      float *subcentroids) const
+    {
+        // y_S = (1 - α) * y_C + α * y_N
+        for (size_t subc = 0; subc < nsubc; subc++) {
+            const float *nn_centroid = quantizer->getDataByLabel(nn_idxs[subc]);
+            float *subcentroid = subcentroids + subc * d;
+            faiss::fvec_madd(d, nn_centroid, -1., centroid, subcentroid);
+            faiss::fvec_madd(d, centroid, alpha, subcentroid, subcentroid);
+        }
+    }
+
+    float IndexIVF_HNSW_Grouping::encode_group(size_t n, const float *data, const float *subcentroids,
+                                               const idx_t *subcentroid_idxs, uint8_t *xcodes, uint8_t *xnorm_codes,
+                                               uint8_t *refine_xcodes, float *residual_norms)
+    {
+        Arena &arena = Arena::local();
+        ArenaScope scope(arena);
 
         // Compute residuals
-        std::vector<float> residuals(group_size * d);
-        compute_residuals(group_size, data, residuals.data(), subcentroids.data(), subcentroid_idxs.data());
+        float *residuals = arena.alloc<float>(n * d);
+        float *scratch = arena.alloc<float>(n * d);    // Rotation output, then the reconstructed points
+        compute_residuals(n, data, residuals, subcentroids, subcentroid_idxs);
 
         // Rotate residuals
         if (do_opq){
-            std::vector<float> copy_residuals(group_size * d);
-            memcpy(copy_residuals.data(), residuals.data(), group_size * d * sizeof(float));
-            opq_matrix->apply_noalloc(group_size, copy_residuals.data(), residuals.data());
+            opq_matrix->apply_noalloc(n, residuals, scratch);
+            std::swap(residuals, scratch);
         }
 
         // Compute codes
-        std::vector<uint8_t> xcodes(group_size * code_size);
-        pq->compute_codes(residuals.data(), xcodes.data(), group_size);
+        encode_residuals(n, residuals, xcodes);
+
+        // Decode codes, the errors of the residual quantizer are encoded with the refinement PQ
+        if (refine_pq) {
+            decode_residuals(n, xcodes, scratch);
+            encode_refinement(n, residuals, scratch, refine_xcodes);
+            std::swap(residuals, scratch);
+        } else
+            decode_residuals(n, xcodes, residuals);
 
-        // Decode codes
-        std::vector<float> decoded_residuals(group_size * d);
-        pq->decode(xcodes.data(), decoded_residuals.data(), group_size);
+        // Sub-group radii, the norms do not depend on the rotation
+        faiss::fvec_norms_L2(residual_norms, residuals, d, n);
+
+        // Inner product metrics store no norm codes
+        if (metric != METRIC_L2)
+            return 0;
 
         // Reverse rotation
         if (do_opq){
-            std::vector<float> copy_decoded_residuals(group_size * d);
-            memcpy(copy_decoded_residuals.data(), decoded_residuals.data(), group_size * d * sizeof(float));
-            opq_matrix->transform_transpose(group_size, copy_decoded_residuals.data(), decoded_residuals.data());
+            opq_matrix->transform_transpose(n, residuals, scratch);
+            std::swap(residuals, scratch);
         }
 
         // Reconstruct data
-        std::vector<float> reconstructed_x(group_size * d);
-        reconstruct(group_size, reconstructed_x.data(), decoded_residuals.data(),
-                    subcentroids.data(), subcentroid_idxs.data());
+        reconstruct(n, scratch, residuals, subcentroids, subcentroid_idxs);
 
-        // Compute norms 
-        std::vector<float> norms(group_size);
-        faiss::fvec_norms_L2sqr(norms.data(), reconstructed_x.data(), d, group_size);
+        // Compute norms
+        float *norms = arena.alloc<float>(n);
+        faiss::fvec_norms_L2sqr(norms, scratch, d, n);
 
         // Compute norm codes
-        std::vector<uint8_t> xnorm_codes(group_size);
-        norm_pq->compute_codes(norms.data(), xnorm_codes.data(), group_size);
-
-        // Distribute codes
-        std::vector<std::vector<idx_t> > construction_ids(nsubc);
-        std::vector<std::vector<uint8_t> > construction_codes(nsubc);
-        std::vector<std::vector<uint8_t> > construction_norm_codes(nsubc);
-        for (size_t i = 0; i < group_size; i++) {
-            idx_t idx = idxs[i];
-            idx_t subcentroid_idx = subcentroid_idxs[i];
+        norm_pq->compute_codes(norms, xnorm_codes, n);
+
+        // The scan distances differ from the ones to the reconstructed points by the norm error
+        float *decoded_norms = arena.alloc<float>(n);
+        norm_pq->decode(xnorm_codes, decoded_norms, n);
+        float norm_error = 0;
+        for (size_t i = 0; i < n; i++)
+            norm_error = std::max(norm_error, std::abs(decoded_norms[i] - norms[i]));
+        return norm_error;
+    }
 
-            construction_ids[subcentroid_idx].push_back(idx);
-            construction_norm_codes[subcentroid_idx].push_back(xnorm_codes[i]);
-            for (size_t j = 0; j < code_size; j++)
-                construction_codes[subcentroid_idx].push_back(xcodes[i * code_size + j]);
-        }
-        // Add codes to the index
-        for (size_t subc = 0; subc < nsubc; subc++) {
-            idx_t subgroup_size = construction_norm_codes[subc].size();
-            subgroup_sizes[centroid_idx].push_back(subgroup_size);
-
-            for (size_t i = 0; i < subgroup_size; i++) {
-                ids[centroid_idx].push_back(construction_ids[subc][i]);
-                for (size_t j = 0; j < code_size; j++)
-                    codes[centroid_idx].push_back(construction_codes[subc][i * code_size + j]);
-                norm_codes[centroid_idx].push_back(construction_norm_codes[subc][i]);
-            }
+    float IndexIVF_HNSW_Grouping::query_centroid_dist(const float *query, idx_t centroid_idx,
+                                                      hnswlib::DistanceCache &cache) const
+    {
+        const idx_t internal_id = quantizer->getInternalId(centroid_idx);
+        float dist;
+        if (!cache.find(internal_id, dist)) {
+            dist = quantizer->fstdistfunc(query, quantizer->getDataByInternalId(internal_id));
+            cache.insert(internal_id, dist);
         }
+        return dist;
     }
 
     /** Search procedure
@@ -155,31 +582,33 @@ namespace ivfhnsw
       *
       * Since y_R defined by a product quantizer, it is split across
       * sub-vectors and stored separately for each sub-vector.
+      *
+      * With the inner product metrics the quantizer distances are negated inner products, so
+      *
+      *  d = (1 - α) * -(x|y_C) + α * -(x|y_N) - (x|y_R)
+      *
+      * terms 1 and 2 keep the quantizer distances as is (the centroid norms are zeros) and there is no term 3.
     */
-    size_t IndexIVF_HNSW_Grouping::search(size_t k, const float *x, float *distances, long *labels)
+    size_t IndexIVF_HNSW_Grouping::plan_scans(const float *query, const SearchBudget &budget,
+                                              const idx_t *centroid_idxs, const float *centroid_dists,
+                                              hnswlib::DistanceCache &query_centroid_dists,
+                                              std::vector<ListScan> &scans)
     {
-        // Distances to subcentroids. Used for pruning.
-        std::vector<float> query_subcentroid_dists;
+        scans.clear();
+        const size_t nprobe = budget.nprobe;
 
-        // Indices of coarse centroids, which distances to the query are computed during the search time
-        std::vector<idx_t> used_centroid_idxs;
-        used_centroid_idxs.reserve(nsubc * nprobe);
-        idx_t centroid_idxs[nprobe]; // Indices of the nearest coarse centroids
+        // Distances to subcentroids. Used for pruning.
+        thread_local std::vector<float> query_subcentroid_dists;
 
-        // For correct search using OPQ rotate a query
-        const float *query = (do_opq) ? opq_matrix->apply(1, x) : x;
+        // query_centroid_dists holds the distances to the coarse centroids computed during the HNSW search.
+        // Used for distance computation between a query and base points. Missing distances are computed
+        // and added on demand.
 
-        // Find the nearest coarse centroids to the query
-        auto coarse = quantizer->searchKnn(query, nprobe);
-        assert(coarse.size() >= nprobe);
+        // Tiered lists are read while the sub-centroid distances are computed, pruning scans up to 2 * max_codes
+        prefetch_lists(centroid_idxs, nprobe, do_pruning ? 2 * budget.max_codes : budget.max_codes);
+        if (do_pruning && pruning_mode != PRUNING_THRESHOLD)
+            return plan_bounded_scans(query, budget, centroid_idxs, centroid_dists, query_centroid_dists, scans);
 
-        for (int_fast32_t i = nprobe - 1; i >= 0; i--) {
-            idx_t centroid_idx = coarse.top().second;
-            centroid_idxs[i] = centroid_idx;
-            query_centroid_dists[centroid_idx] = coarse.top().first;
-            used_centroid_idxs.push_back(centroid_idx);
-            coarse.pop();
-        }
         // Computing threshold for pruning
         float threshold = 0.0;
         if (do_pruning) {
@@ -188,116 +617,178 @@ namespace ivfhnsw
 
             query_subcentroid_dists.resize(nsubc * nprobe);
             float *qsd = query_subcentroid_dists.data();
+            // The sub-centroid distance is linear in the centroid distances for the inner product metrics
+            const float inter_scale = (metric == METRIC_L2) ? 1 : 0;
 
             for (size_t i = 0; i < nprobe; i++) {
                 const idx_t centroid_idx = centroid_idxs[i];
-                const size_t group_size = norm_codes[centroid_idx].size();
+                const size_t group_size = list_size(centroid_idx);
                 if (group_size == 0)
                     continue;
 
                 const float alpha = alphas[centroid_idx];
-                const float term1 = (1 - alpha) * query_centroid_dists[centroid_idx];
+                const float term1 = (1 - alpha) * centroid_dists[i];
 
                 for (size_t subc = 0; subc < nsubc; subc++) {
                     if (subgroup_sizes[centroid_idx][subc] == 0)
                         continue;
 
                     const idx_t nn_centroid_idx = nn_centroid_idxs[centroid_idx][subc];
-                    // Compute the distance to the coarse centroid if it is not computed
-                    if (query_centroid_dists[nn_centroid_idx] < EPS) {
-                        const float *nn_centroid = quantizer->getDataByInternalId(nn_centroid_idx);
-                        query_centroid_dists[nn_centroid_idx] = fvec_L2sqr(query, nn_centroid, d);
-                        used_centroid_idxs.push_back(nn_centroid_idx);
-                    }
-                    qsd[subc] = term1 - alpha * ((1 - alpha) * inter_centroid_dists[centroid_idx][subc]
-                                                 - query_centroid_dists[nn_centroid_idx]);
+                    const float nn_centroid_dist = query_centroid_dist(query, nn_centroid_idx, query_centroid_dists);
+                    qsd[subc] = term1 - alpha * ((1 - alpha) * inter_scale * inter_centroid_dists[centroid_idx][subc]
+                                                 - nn_centroid_dist);
                     threshold += qsd[subc];
                     nsubgroups++;
                 }
-                ncode += group_size;
+                ncode += list_nvectors(centroid_idx);
                 qsd += nsubc;
-                if (ncode >= 2 * max_codes)
+                if (ncode >= 2 * budget.max_codes)
                     break;
             }
             threshold /= nsubgroups;
         }
 
-        // Precompute table
-        pq->compute_inner_prod_table(query, precomputed_table.data());
-
-        // Prepare max heap with k answers
-        faiss::maxheap_heapify(k, distances, labels);
-
         size_t ncode = 0;
         const float *qsd = query_subcentroid_dists.data();
 
         for (size_t i = 0; i < nprobe; i++) {
             const idx_t centroid_idx = centroid_idxs[i];
-            const size_t group_size = norm_codes[centroid_idx].size();
+            const size_t group_size = list_size(centroid_idx);
             if (group_size == 0)
                 continue;
 
             const float alpha = alphas[centroid_idx];
-            const float term1 = (1 - alpha) * (query_centroid_dists[centroid_idx] - centroid_norms[centroid_idx]);
-
-            const uint8_t *code = codes[centroid_idx].data();
-            const uint8_t *norm_code = norm_codes[centroid_idx].data();
-            const idx_t *id = ids[centroid_idx].data();
+            const float term1 = (1 - alpha) * (centroid_dists[i] - centroid_norms[centroid_idx]);
 
+            size_t offset = 0;
             for (size_t subc = 0; subc < nsubc; subc++) {
                 const size_t subgroup_size = subgroup_sizes[centroid_idx][subc];
-                if (subgroup_size == 0)
+                if (subgroup_size == 0) {
+                    offset += subgroup_capacity(centroid_idx, subc);
                     continue;
+                }
 
                 // Check pruning condition
                 if (!do_pruning || qsd[subc] < threshold) {
                     const idx_t nn_centroid_idx = nn_centroid_idxs[centroid_idx][subc];
-
-                    // Compute the distance to the coarse centroid if it is not computed
-                    if (query_centroid_dists[nn_centroid_idx] < EPS) {
-                        const float *nn_centroid = quantizer->getDataByInternalId(nn_centroid_idx);
-                        query_centroid_dists[nn_centroid_idx] = fvec_L2sqr(query, nn_centroid, d);
-                        used_centroid_idxs.push_back(nn_centroid_idx);
-                    }
-
-                    const float term2 = alpha * (query_centroid_dists[nn_centroid_idx] - centroid_norms[nn_centroid_idx]);
-                    //std::cout << "centroid_idx:"<< centroid_idx<<"norms.size:"<<norms.size()<<".subgroup_size:"<<subgroup_size<<std::endl;
-                    thread_local std::vector<float> norms ;
-                    norms.resize(subgroup_size);
-                    norm_pq->decode(norm_code, norms.data(), subgroup_size);
-
-                    for (size_t j = 0; j < subgroup_size; j++) {
-                        const float term4 = 2 * pq_L2sqr(code + j * code_size);
-                        const float dist = term1 + term2 + norms[j] - term4; //term3 = norms[j]
-                        if (dist < distances[0]) {
-                            faiss::maxheap_pop(k, distances, labels);
-                            faiss::maxheap_push(k, distances, labels, dist, id[j]);
-                        }
-                    }
+                    const float nn_centroid_dist = query_centroid_dist(query, nn_centroid_idx, query_centroid_dists);
+                    const float term2 = alpha * (nn_centroid_dist - centroid_norms[nn_centroid_idx]);
+                    // term3 and term4 are added by the scan
+                    scans.push_back(ListScan{centroid_idx, (idx_t) offset, (idx_t) (offset + subgroup_size),
+                                             term1 + term2, -std::numeric_limits<float>::infinity(), (idx_t) i});
                     ncode += subgroup_size;
                 }
                 // Shift to the next group
-                code += subgroup_size * code_size;
-                norm_code += subgroup_size;
-                id += subgroup_size;
+                offset += subgroup_capacity(centroid_idx, subc);
             }
-            if (ncode >= max_codes)
+            if (ncode >= budget.max_codes)
                 break;
             if (do_pruning)
                 qsd += nsubc;
         }
-        // Zero computed dists for later queries
-        for (idx_t used_centroid_idx : used_centroid_idxs)
-            query_centroid_dists[used_centroid_idx] = 0;
+        return ncode;
+    }
+
+    /** Plan of the bound pruning
+      *
+      * The reconstructed points of a sub-group lie within its radius r around the sub-centroid y_S,
+      * so their distances to the query x are at least max(0, ||x - y_S|| - r)^2.
+      * The scan adds the quantized norm of the reconstructed point instead of the exact one,
+      * so the bound of the scanned distances is lowered by the max norm error of the group.
+      * The bounds hold for the primary codes; the refinement only re-ranks the scanned candidates.
+      * Sub-groups are planned in the ascending order of ||x - y_S||^2 until <max_codes> codes,
+      * and the scan skips the ones whose bound is not below the current k-th best distance.
+      * With PRUNING_BOUND_SCALED the radii are multiplied by <bound_scale>,
+      * which skips more sub-groups at the risk of missing some neighbours.
+      *
+      *  ||x - y_S||^2 = (1 - α) * || x - y_C ||^2 + α * || x - y_N ||^2 - α * (1 - α) * || y_C - y_N ||^2
+      *
+      * With the inner product metrics the score of a point of the sub-group is -(x|y_S) - (x|y_R),
+      * and by Cauchy-Schwarz it is at least -(x|y_S) - ||x|| * r.
+    */
+    size_t IndexIVF_HNSW_Grouping::plan_bounded_scans(const float *query, const SearchBudget &budget,
+                                                      const idx_t *centroid_idxs, const float *centroid_dists,
+                                                      hnswlib::DistanceCache &query_centroid_dists,
+                                                      std::vector<ListScan> &scans)
+    {
+        const size_t nprobe = budget.nprobe;
+        const float radius_scale = (pruning_mode == PRUNING_BOUND_SCALED) ? bound_scale : 1;
+        const float no_bound = -std::numeric_limits<float>::infinity();
+        const bool is_l2 = (metric == METRIC_L2);
+        const float query_norm = is_l2 ? 0 : std::sqrt(faiss::fvec_norm_L2sqr(query, d));
+
+        // Sub-groups with the distances from the query to their sub-centroids
+        thread_local std::vector<std::pair<float, ListScan> > candidates;
+        candidates.clear();
+
+        for (size_t i = 0; i < nprobe; i++) {
+            const idx_t centroid_idx = centroid_idxs[i];
+            const size_t group_size = list_size(centroid_idx);
+            if (group_size == 0)
+                continue;
+
+            const float alpha = alphas[centroid_idx];
+            const float term1 = (1 - alpha) * (centroid_dists[i] - centroid_norms[centroid_idx]);
+            // Groups without radii are never skipped
+            const bool has_radii = subgroup_radii[centroid_idx].size() == nsubc;
+
+            size_t offset = 0;
+            for (size_t subc = 0; subc < nsubc; subc++) {
+                const size_t subgroup_size = subgroup_sizes[centroid_idx][subc];
+                if (subgroup_size == 0) {
+                    offset += subgroup_capacity(centroid_idx, subc);
+                    continue;
+                }
+
+                const idx_t nn_centroid_idx = nn_centroid_idxs[centroid_idx][subc];
+                const float nn_centroid_dist = query_centroid_dist(query, nn_centroid_idx, query_centroid_dists);
+                const float term2 = alpha * (nn_centroid_dist - centroid_norms[nn_centroid_idx]);
+                float qsd = (1 - alpha) * centroid_dists[i] + alpha * nn_centroid_dist;
+                if (is_l2)
+                    qsd -= alpha * (1 - alpha) * inter_centroid_dists[centroid_idx][subc];
+
+                float bound = no_bound;
+                if (has_radii && is_l2) {
+                    const float gap = std::sqrt(std::max(qsd, 0.0f)) - radius_scale * subgroup_radii[centroid_idx][subc];
+                    if (gap > 0)
+                        bound = gap * gap - norm_errors[centroid_idx];
+                } else if (has_radii)
+                    bound = qsd - query_norm * radius_scale * subgroup_radii[centroid_idx][subc];
+                candidates.emplace_back(qsd, ListScan{centroid_idx, (idx_t) offset, (idx_t) (offset + subgroup_size),
+                                                      term1 + term2, bound, (idx_t) i});
+                offset += subgroup_capacity(centroid_idx, subc);
+            }
+        }
+        std::stable_sort(candidates.begin(), candidates.end(),
+                         [](const std::pair<float, ListScan> &a, const std::pair<float, ListScan> &b) {
+                             return a.first < b.first;
+                         });
 
-        if (do_opq)
-            delete const_cast<float *>(query);
-        faiss::maxheap_reorder(k,distances, labels);
+        size_t ncode = 0;
+        for (const auto &candidate : candidates) {
+            scans.push_back(candidate.second);
+            ncode += candidate.second.end - candidate.second.begin;
+            if (ncode >= budget.max_codes)
+                break;
+        }
         return ncode;
     }
 
     void IndexIVF_HNSW_Grouping::write(const char *path_index)
     {
+        if (list_store) {
+            std::cout << "An index with tiered lists can not be written" << std::endl;
+            abort();
+        }
+        // Indices are written without the gaps of the sub-groups
+        for (size_t i = 0; i < nc; i++) {
+            if (!subgroup_capacities[i].empty()) {
+                std::cout << "Sub-groups have gaps after add or split_lists, "
+                          << "call compact_subgroups before writing the index" << std::endl;
+                abort();
+            }
+        }
+
         std::ofstream output(path_index, std::ios::binary);
 
         write_variable(output, d);
@@ -333,35 +824,77 @@ namespace ivfhnsw
         // Save inter centroid distances
         for (size_t i = 0; i < nc; i++)
             write_vector(output, inter_centroid_dists[i]);
+
+        // Save sub-group radii
+        for (size_t i = 0; i < nc; i++)
+            write_vector(output, subgroup_radii[i]);
+
+        // Save the residual encoding of the codes
+        write_variable(output, (uint32_t) encoding);
+
+        // Save refinement codes
+        write_refinement(output);
+
+        // Save the metric
+        write_metric(output);
+
+        // Save packed ids
+        write_packed_ids(output);
+
+        // Save the id size
+        write_label_size(output);
+
+        // Save the norm errors of the groups
+        write_vector(output, norm_errors);
+
+        // Save the generation of the lists
+        const uint64_t generation = list_generation;
+        write_variable(output, generation);
+
+        write_end_marker(output);
+        if (!output)
+            throw std::runtime_error(std::string("Failed to write the index: ") + path_index);
     }
 
     void IndexIVF_HNSW_Grouping::read(const char *path_index)
     {
         std::ifstream input(path_index, std::ios::binary);
+        if (!input)
+            throw std::runtime_error(std::string("Can not open the index: ") + path_index);
 
-        read_variable(input, d);
+        size_t index_d = 0;
+        read_variable(input, index_d);
         read_variable(input, nc);
         read_variable(input, nsubc);
+        if (!input || index_d != d)
+            throw std::runtime_error(std::string("Dimension of the index does not match: ") + path_index);
+        if (quantizer && quantizer->cur_element_count != nc)
+            throw std::runtime_error(std::string("Number of lists of the index does not match the quantizer: ")
+                                     + path_index);
+        resize_lists(nc);
 
         // Read ids
+        std::vector<size_t> nids(nc), ncodes(nc), nnorm_codes(nc), nrefine_codes(nc, 0);
         for (size_t i = 0; i < nc; i++)
-            read_vector(input, ids[i]);
+            nids[i] = read_list(input, ids[i]);
 
         // Read PQ codes
         for (size_t i = 0; i < nc; i++)
-            read_vector(input, codes[i]);
+            ncodes[i] = read_list(input, codes[i]);
 
         // Read norm PQ codes
         for (size_t i = 0; i < nc; i++)
-            read_vector(input, norm_codes[i]);
+            nnorm_codes[i] = read_list(input, norm_codes[i]);
 
         // Read NN centroid indices
         for (size_t i = 0; i < nc; i++)
             read_vector(input, nn_centroid_idxs[i]);
 
-        // Read group sizes
-        for (size_t i = 0; i < nc; i++)
+        // Read group sizes, the sub-groups have no gaps
+        for (size_t i = 0; i < nc; i++) {
             read_vector(input, subgroup_sizes[i]);
+            subgroup_capacities[i].clear();
+        }
 
         // Read alphas
         read_vector(input, alphas);
@@ -372,77 +905,151 @@ namespace ivfhnsw
         // Read inter centroid distances
         for (size_t i = 0; i < nc; i++)
             read_vector(input, inter_centroid_dists[i]);
+        if (!input || alphas.size() != nc || centroid_norms.size() != nc)
+            throw std::runtime_error(std::string("Truncated index: ") + path_index);
+
+        // Indices written before the trailers end right after the inter centroid distances
+        const bool has_trailers = (input.peek() != EOF);
+
+        // Read sub-group radii, absent in indices written before bound pruning
+        if (has_trailers) {
+            for (size_t i = 0; i < nc; i++)
+                read_vector(input, subgroup_radii[i]);
+        } else {
+            for (size_t i = 0; i < nc; i++)
+                subgroup_radii[i].clear();
+        }
+
+        // Indices written before the encoding was recorded are PQ encoded
+        uint32_t index_encoding = ENCODING_PQ;
+        if (input.peek() != EOF)
+            read_variable(input, index_encoding);
+        if (index_encoding != encoding)
+            throw std::runtime_error(std::string("Residual encoding of the index does not match: ") + path_index);
+
+        // Read refinement codes
+        read_refinement(input, path_index, nrefine_codes);
+
+        // Read the metric
+        read_metric(input, path_index);
+
+        // Read packed ids
+        read_packed_ids(input);
+
+        // Read the id size
+        read_label_size(input, path_index);
+
+        // Read the norm errors, absent in indices written before the bounds had the slack.
+        // Their radii are dropped, so compute_subgroup_radii recomputes them with the errors
+        if (input.peek() != EOF)
+            read_vector(input, norm_errors);
+        else {
+            for (size_t i = 0; i < nc; i++)
+                subgroup_radii[i].clear();
+        }
+        norm_errors.resize(nc, 0);
+
+        // Read the generation of the lists, indices without the trailers get a new one
+        uint64_t generation = new_list_generation();
+        if (has_trailers)
+            read_variable(input, generation);
+        list_generation = generation;
+
+        if (has_trailers)
+            read_end_marker(input, path_index);
+        check_lists(path_index, nids, ncodes, nnorm_codes, nrefine_codes);
+
+        // The groups are written without gaps
+        for (size_t i = 0; i < nc; i++) {
+            size_t group_size = 0;
+            for (idx_t subgroup_size : subgroup_sizes[i])
+                group_size += subgroup_size;
+            if (group_size != ncodes[i] / code_size)
+                throw std::runtime_error("Group " + std::to_string(i) + " of the index is corrupted: " + path_index);
+        }
     }
 
 
     void IndexIVF_HNSW_Grouping::train_pq(size_t n, const float *x)
     {
-        std::vector<float> train_subcentroids;
-        std::vector<float> train_residuals;
-
-        train_subcentroids.reserve(n*d);
-        train_residuals.reserve(n*d);
-
         std::vector<idx_t> assigned(n);
         assign(n, x, assigned.data());
 
-        std::unordered_map<idx_t, std::vector<float>> group_map;
+        // Order training vectors by group with a counting sort,
+        // so the groups are processed in the ascending order of centroid indices
+        std::vector<size_t> group_offsets(nc + 1, 0);
+        for (size_t i = 0; i < n; i++)
+            group_offsets[assigned[i] + 1]++;
+        for (size_t i = 0; i < nc; i++)
+            group_offsets[i + 1] += group_offsets[i];
 
-        for (size_t i = 0; i < n; i++) {
-            const idx_t key = assigned[i];
-            for (size_t j = 0; j < d; j++)
-                group_map[key].push_back(x[i*d + j]);
+        std::vector<idx_t> order(n);
+        {
+            std::vector<size_t> positions(group_offsets.begin(), group_offsets.end() - 1);
+            for (size_t i = 0; i < n; i++)
+                order[positions[assigned[i]]++] = i;
         }
+        std::vector<idx_t> groups;
+        for (size_t i = 0; i < nc; i++)
+            if (group_offsets[i + 1] > group_offsets[i])
+                groups.push_back(i);
+
+        // Training vectors of each group are contiguous
+        std::vector<float> group_x(n * d);
+#pragma omp parallel for
+        for (size_t i = 0; i < n; i++)
+            memcpy(group_x.data() + i * d, x + order[i] * d, d * sizeof(float));
+
+        // Cosine vectors are encoded normalized
+        if (metric == METRIC_COSINE)
+            faiss::fvec_renorm_L2(d, n, group_x.data());
+
+        std::vector<float> train_subcentroids(n * d);
+        std::vector<float> train_residuals(n * d);
 
         // Train Residual PQ
         std::cout << "Training Residual PQ codebook " << std::endl;
-        for (auto group : group_map) {
-            const idx_t centroid_idx = group.first;
-            const float *centroid = quantizer->getDataByInternalId(centroid_idx);
-            const std::vector<float> data = group.second;
-            const int group_size = data.size() / d;
-
-            std::vector<idx_t> nn_centroid_idxs(nsubc);
-            std::vector<float> centroid_vector_norms(nsubc);
-            auto nn_centroids_raw = quantizer->searchKnn(centroid, nsubc + 1);
-
-            while (nn_centroids_raw.size() > 1) {
-                centroid_vector_norms[nn_centroids_raw.size() - 2] = nn_centroids_raw.top().first;
-                nn_centroid_idxs[nn_centroids_raw.size() - 2] = nn_centroids_raw.top().second;
-                nn_centroids_raw.pop();
-            }
+#pragma omp parallel for schedule(dynamic)
+        for (size_t g = 0; g < groups.size(); g++) {
+            const idx_t centroid_idx = groups[g];
+            const float *centroid = quantizer->getDataByLabel(centroid_idx);
+            const size_t group_begin = group_offsets[centroid_idx];
+            const size_t group_size = group_offsets[centroid_idx + 1] - group_begin;
+            const float *data = group_x.data() + group_begin * d;
+
+            Arena &arena = Arena::local();
+            ArenaScope scope(arena);
+            idx_t *nn_centroid_idxs = arena.alloc<idx_t>(nsubc);
+            float *centroid_vector_norms = arena.alloc<float>(nsubc);
+            find_nn_centroids(centroid_idx, nn_centroid_idxs, centroid_vector_norms);
 
             // Compute centroid-neighbor_centroid and centroid-group_point vectors
-            std::vector<float> centroid_vectors(nsubc * d);
+            float *centroid_vectors = arena.alloc<float>(nsubc * d);
             for (size_t subc = 0; subc < nsubc; subc++) {
-                const float *nn_centroid = quantizer->getDataByInternalId(nn_centroid_idxs[subc]);
-                faiss::fvec_madd(d, nn_centroid, -1., centroid, centroid_vectors.data() + subc * d);
+                const float *nn_centroid = quantizer->getDataByLabel(nn_centroid_idxs[subc]);
+                faiss::fvec_madd(d, nn_centroid, -1., centroid, centroid_vectors + subc * d);
             }
 
             // Find alphas for vectors
-            const float alpha = compute_alpha(centroid_vectors.data(), data.data(), centroid,
-                                              centroid_vector_norms.data(), group_size);
+            const float alpha = compute_alpha(centroid_vectors, data, centroid,
+                                              centroid_vector_norms, group_size);
 
             // Compute final subcentroids 
-            std::vector<float> subcentroids(nsubc * d);
+            float *subcentroids = arena.alloc<float>(nsubc * d);
             for (size_t subc = 0; subc < nsubc; subc++)
-                faiss::fvec_madd(d, centroid, alpha, centroid_vectors.data() + subc*d, subcentroids.data() + subc*d);
+                faiss::fvec_madd(d, centroid, alpha, centroid_vectors + subc*d, subcentroids + subc*d);
 
             // Find subcentroid idx
-            std::vector<idx_t> subcentroid_idxs(group_size);
-            compute_subcentroid_idxs(subcentroid_idxs.data(), subcentroids.data(), data.data(), group_size);
+            idx_t *subcentroid_idxs = arena.alloc<idx_t>(group_size);
+            compute_subcentroid_idxs(subcentroid_idxs, subcentroids, data, group_size);
 
-            // Compute Residuals
-            std::vector<float> residuals(group_size * d);
-            compute_residuals(group_size, data.data(), residuals.data(), subcentroids.data(), subcentroid_idxs.data());
+            // Compute residuals in place of the group in the training set
+            compute_residuals(group_size, data, train_residuals.data() + group_begin * d,
+                              subcentroids, subcentroid_idxs);
 
-            for (size_t i = 0; i < group_size; i++) {
-                const idx_t subcentroid_idx = subcentroid_idxs[i];
-                for (size_t j = 0; j < d; j++) {
-                    train_subcentroids.push_back(subcentroids[subcentroid_idx*d + j]);
-                    train_residuals.push_back(residuals[i*d + j]);
-                }
-            }
+            for (size_t i = 0; i < group_size; i++)
+                memcpy(train_subcentroids.data() + (group_begin + i) * d,
+                       subcentroids + subcentroid_idxs[i] * d, d * sizeof(float));
         }
         // Train OPQ rotation matrix and rotate residuals
         if (do_opq){
@@ -455,54 +1062,55 @@ namespace ivfhnsw
             matrix->train(n, train_residuals.data());
             opq_matrix = matrix;
 
-            std::vector<float> copy_train_residuals(n * d);
-            memcpy(copy_train_residuals.data(), train_residuals.data(), n * d * sizeof(float));
-            opq_matrix->apply_noalloc(n, copy_train_residuals.data(), train_residuals.data());
+            // Training vectors are not needed anymore, reuse their memory
+            opq_matrix->apply_noalloc(n, train_residuals.data(), group_x.data());
+            train_residuals.swap(group_x);
         }
 
-        printf("Training %zdx%zd PQ on %ld vectors in %dD\n", pq->M, pq->ksub, train_residuals.size() / d, d);
-        pq->verbose = true;
-        pq->train(n, train_residuals.data());
+        train_residual_quantizer(n, train_residuals.data());
+        if (refine_pq)
+            train_refine_pq(n, train_residuals.data());
+
+        // Inner product metrics store no norm codes
+        if (metric != METRIC_L2)
+            return;
 
         // Norm PQ
         std::cout << "Training Norm PQ codebook " << std::endl;
-        std::vector<float> train_norms;
-        const float *residuals = train_residuals.data();
-        const float *subcentroids = train_subcentroids.data();
+        std::vector<float> train_norms(n);
+
+        // Reconstruct the training vectors in blocks of the ordered training set
+        const size_t block_size = 65536;
+#pragma omp parallel for schedule(dynamic)
+        for (size_t block_begin = 0; block_begin < n; block_begin += block_size) {
+            const size_t nb = std::min(block_size, n - block_begin);
+            const float *residuals = train_residuals.data() + block_begin * d;
+            const float *subcentroids = train_subcentroids.data() + block_begin * d;
 
-        for (auto p : group_map) {
-            const std::vector<float> data = p.second;
-            const size_t group_size = data.size() / d;
+            Arena &arena = Arena::local();
+            ArenaScope scope(arena);
 
             // Compute Codes 
-            std::vector<uint8_t> xcodes(group_size * code_size);
-            pq->compute_codes(residuals, xcodes.data(), group_size);
+            uint8_t *xcodes = arena.alloc<uint8_t>(nb * code_size);
+            encode_residuals(nb, residuals, xcodes);
 
             // Decode Codes 
-            std::vector<float> decoded_residuals(group_size * d);
-            pq->decode(xcodes.data(), decoded_residuals.data(), group_size);
+            float *decoded_residuals = arena.alloc<float>(nb * d);
+            float *reconstructed_x = arena.alloc<float>(nb * d);
+            decode_residuals(nb, xcodes, decoded_residuals);
 
-            // Reverse rotation
+            // Reverse rotation, the reconstruction buffer is free until the next step
             if (do_opq){
-                std::vector<float> copy_decoded_residuals(group_size * d);
-                memcpy(copy_decoded_residuals.data(), decoded_residuals.data(), group_size * d * sizeof(float));
-                opq_matrix->transform_transpose(group_size, copy_decoded_residuals.data(), decoded_residuals.data());
+                opq_matrix->transform_transpose(nb, decoded_residuals, reconstructed_x);
+                std::swap(decoded_residuals, reconstructed_x);
             }
 
             // Reconstruct Data 
-            std::vector<float> reconstructed_x(group_size * d);
-            for (size_t i = 0; i < group_size; i++)
-                faiss::fvec_madd(d, decoded_residuals.data() + i*d, 1., subcentroids+i*d, reconstructed_x.data() + i*d);
+            for (size_t i = 0; i < nb; i++)
+                faiss::fvec_madd(d, decoded_residuals + i*d, 1., subcentroids+i*d, reconstructed_x + i*d);
 
             // Compute norms 
-            std::vector<float> group_norms(group_size);
-            faiss::fvec_norms_L2sqr(group_norms.data(), reconstructed_x.data(), d, group_size);
-
-            for (size_t i = 0; i < group_size; i++)
-                train_norms.push_back(group_norms[i]);
-
-            residuals += group_size * d;
-            subcentroids += group_size * d;
+            faiss::fvec_norms_L2sqr(train_norms.data() + block_begin, reconstructed_x, d, nb);
         }
         printf("Training %zdx%zd PQ on %ld vectors in 1D\n", norm_pq->M, norm_pq->ksub, train_norms.size());
         norm_pq->verbose = true;
@@ -511,15 +1119,129 @@ namespace ivfhnsw
 
     void IndexIVF_HNSW_Grouping::compute_inter_centroid_dists()
     {
+        for (size_t i = 0; i < nc; i++)
+            compute_inter_centroid_dists(i);
+    }
+
+    void IndexIVF_HNSW_Grouping::compute_inter_centroid_dists(idx_t centroid_idx)
+    {
+        const float *centroid = quantizer->getDataByLabel(centroid_idx);
+        inter_centroid_dists[centroid_idx].resize(nsubc);
+        for (size_t subc = 0; subc < nsubc; subc++) {
+            const idx_t nn_centroid_idx = nn_centroid_idxs[centroid_idx][subc];
+            const float *nn_centroid = quantizer->getDataByLabel(nn_centroid_idx);
+            inter_centroid_dists[centroid_idx][subc] = fvec_L2sqr(nn_centroid, centroid, d);
+        }
+    }
+
+    void IndexIVF_HNSW_Grouping::compute_subgroup_radii()
+    {
+        // A list that can not be read fails the computation after the loop
+        ParallelException errors;
+#pragma omp parallel for schedule(dynamic)
         for (size_t i = 0; i < nc; i++) {
-            const float *centroid = quantizer->getDataByInternalId(i);
-            inter_centroid_dists[i].resize(nsubc);
-            for (size_t subc = 0; subc < nsubc; subc++) {
-                const idx_t nn_centroid_idx = nn_centroid_idxs[i][subc];
-                const float *nn_centroid = quantizer->getDataByInternalId(nn_centroid_idx);
-                inter_centroid_dists[i][subc] = fvec_L2sqr(nn_centroid, centroid, d);
+            errors.run([&] {
+                if (subgroup_radii[i].size() == subgroup_sizes[i].size())
+                    return;
+
+                // The norms of the decoded residuals do not depend on the OPQ rotation
+                const size_t group_size = list_size(i);
+                Arena &arena = Arena::local();
+                ArenaScope scope(arena);
+                float *residuals = arena.alloc<float>(group_size * d);
+                float *residual_norms = arena.alloc<float>(group_size);
+                const ListPin list = pin_list(i);
+                decode_residuals(group_size, list->codes, residuals);
+                faiss::fvec_norms_L2(residual_norms, residuals, d, group_size);
+
+                subgroup_radii[i].assign(subgroup_sizes[i].size(), 0);
+                idx_t *subcentroid_idxs = arena.alloc<idx_t>(group_size);
+                size_t offset = 0;
+                for (size_t subc = 0; subc < subgroup_sizes[i].size(); subc++) {
+                    for (size_t j = 0; j < subgroup_sizes[i][subc]; j++)
+                        subgroup_radii[i][subc] = std::max(subgroup_radii[i][subc], residual_norms[offset + j]);
+                    std::fill(subcentroid_idxs + offset, subcentroid_idxs + offset + subgroup_capacity(i, subc), subc);
+                    offset += subgroup_capacity(i, subc);
+                }
+
+                // Norm errors of the reconstructed points, the bounds are used only for groups with <nsubc> sub-groups
+                norm_errors[i] = 0;
+                if (metric != METRIC_L2 || subgroup_sizes[i].size() != nsubc)
+                    return;
+                if (do_opq && !quantizer_rotated) {
+                    float *rotated = arena.alloc<float>(group_size * d);
+                    opq_matrix->transform_transpose(group_size, residuals, rotated);
+                    residuals = rotated;
+                }
+                float *subcentroids = arena.alloc<float>(nsubc * d);
+                compute_subcentroids(i, subcentroids);
+                float *reconstructed = arena.alloc<float>(group_size * d);
+                reconstruct(group_size, reconstructed, residuals, subcentroids, subcentroid_idxs);
+
+                float *norms = arena.alloc<float>(group_size);
+                float *decoded_norms = arena.alloc<float>(group_size);
+                faiss::fvec_norms_L2sqr(norms, reconstructed, d, group_size);
+                norm_pq->decode(list->norm_codes, decoded_norms, group_size);
+                offset = 0;
+                for (size_t subc = 0; subc < nsubc; subc++) {
+                    for (size_t j = offset; j < offset + subgroup_sizes[i][subc]; j++)
+                        norm_errors[i] = std::max(norm_errors[i], std::abs(decoded_norms[j] - norms[j]));
+                    offset += subgroup_capacity(i, subc);
+                }
+            });
+        }
+        errors.rethrow();
+    }
+
+    void IndexIVF_HNSW_Grouping::find_nn_centroids(idx_t centroid_idx, idx_t *nn_idxs, float *nn_dists) const
+    {
+        const float *centroid = quantizer->getDataByLabel(centroid_idx);
+        auto nn_centroids_raw = quantizer->searchKnn(centroid, nsubc + 1);
+
+        Arena &arena = Arena::local();
+        ArenaScope scope(arena);
+        const size_t nfound = nn_centroids_raw.size();
+        idx_t *found = arena.alloc<idx_t>(nfound);
+        for (size_t i = nfound; i-- > 0;) {
+            found[i] = nn_centroids_raw.top().second;
+            nn_centroids_raw.pop();
+        }
+
+        // The closest result is the centroid itself for L2. The max inner product of the centroid
+        // may be with a longer neighbor, and if the centroid is not found the farthest result is dropped.
+        size_t self = nfound - 1;
+        for (size_t i = 0; i < nfound; i++) {
+            if (found[i] == centroid_idx) {
+                self = i;
+                break;
             }
         }
+        size_t subc = 0;
+        for (size_t i = 0; i < nfound && subc < nsubc; i++) {
+            if (i == self)
+                continue;
+            nn_idxs[subc] = found[i];
+            nn_dists[subc] = fvec_L2sqr(quantizer->getDataByLabel(found[i]), centroid, d);
+            subc++;
+        }
+    }
+
+    void IndexIVF_HNSW_Grouping::list_base(idx_t list_no, size_t offset, float *base) const
+    {
+        // Sub-group of the code, groups of old indices added several times have several runs of <nsubc> sub-groups
+        const std::vector<idx_t> &sizes = subgroup_capacities[list_no].empty() ? subgroup_sizes[list_no]
+                                                                               : subgroup_capacities[list_no];
+        size_t subgroup = 0;
+        for (size_t end = 0; subgroup < sizes.size(); subgroup++) {
+            end += sizes[subgroup];
+            if (offset < end)
+                break;
+        }
+        // y_S = (1 - α) * y_C + α * y_N
+        const float *centroid = quantizer->getDataByLabel(list_no);
+        const float *nn_centroid = quantizer->getDataByLabel(nn_centroid_idxs[list_no][subgroup % nsubc]);
+        faiss::fvec_madd(d, nn_centroid, -1., centroid, base);
+        faiss::fvec_madd(d, centroid, alphas[list_no], base, base);
     }
 
     void IndexIVF_HNSW_Grouping::compute_residuals(size_t n, const float *x, float *residuals,
@@ -543,21 +1265,36 @@ namespace ivfhnsw
     void IndexIVF_HNSW_Grouping::compute_subcentroid_idxs(idx_t *subcentroid_idxs, const float *subcentroids,
                                                           const float *x, size_t group_size)
     {
-        for (size_t i = 0; i < group_size; i++) {
-            float min_dist = 0.0;
-            idx_t min_idx = -1;
-            for (size_t subc = 0; subc < nsubc; subc++) {
-                const float *subcentroid = subcentroids + subc * d;
-                float dist = fvec_L2sqr(subcentroid, x + i*d, d);
-                if (min_idx == -1 || dist < min_dist){
-                    min_dist = dist;
-                    min_idx = subc;
-                }
+        // argmin ||x - s||^2 = argmin ||s||^2 - 2 * <x, s>, the inner products are computed with GEMMs
+        Arena &arena = Arena::local();
+        ArenaScope scope(arena);
+        float *subcentroid_norms = arena.alloc<float>(nsubc);
+        float *ips = arena.alloc<float>(std::min(group_size, gemm_block_size) * nsubc);
+        faiss::fvec_norms_L2sqr(subcentroid_norms, subcentroids, d, nsubc);
+
+        for (size_t block_begin = 0; block_begin < group_size; block_begin += gemm_block_size) {
+            const size_t nb = std::min(gemm_block_size, group_size - block_begin);
+            inner_products(x + block_begin * d, subcentroids, d, nb, nsubc, ips);
+
+            for (size_t i = 0; i < nb; i++) {
+                float *dists = ips + i * nsubc;
+                for (size_t subc = 0; subc < nsubc; subc++)
+                    dists[subc] = subcentroid_norms[subc] - 2 * dists[subc];
+                subcentroid_idxs[block_begin + i] = argmin(dists, nsubc);
             }
-            subcentroid_idxs[i] = min_idx;
         }
     }
 
+    /** Alpha minimizing the distances between the group points and their closest sub-centroids
+      *
+      * For the point x, the sub-centroid candidate along the centroid vector v is c + alpha_v * v,
+      * where alpha_v = max(<v, x - c>, 0) / ||v||^2, and
+      *
+      *   ||x - c - alpha_v * v||^2 = ||x - c||^2 - max(<v, x - c>, 0)^2 / ||v||^2
+      *
+      * so the closest candidate is found from the inner products <v, x> - <v, c>,
+      * computed for blocks of points with GEMMs.
+    */
     float IndexIVF_HNSW_Grouping::compute_alpha(const float *centroid_vectors, const float *points,
                                                 const float *centroid, const float *centroid_vector_norms_L2sqr,
                                                 size_t group_size)
@@ -565,34 +1302,38 @@ namespace ivfhnsw
         float group_numerator = 0.0;
         float group_denominator = 0.0;
 
-        std::vector<float> point_vectors(group_size * d);
-        for (size_t i = 0; i < group_size; i++)
-            faiss::fvec_madd(d, points + i*d , -1., centroid, point_vectors.data() + i*d);
-
-        for (size_t i = 0; i < group_size; i++) {
-            const float *point_vector = point_vectors.data() + i * d;
-            const float *point = points + i * d;
-
-            std::priority_queue<std::pair<float, std::pair<float, float>>> maxheap;
-
-            for (size_t subc = 0; subc < nsubc; subc++) {
-                const float *centroid_vector = centroid_vectors + subc * d;
-
-                float numerator = faiss::fvec_inner_product(centroid_vector, point_vector, d);
-                numerator = (numerator > 0) ? numerator : 0.0;
+        Arena &arena = Arena::local();
+        ArenaScope scope(arena);
+        float *centroid_ips = arena.alloc<float>(nsubc);
+        float *scores = arena.alloc<float>(nsubc);
+        float *ips = arena.alloc<float>(std::min(group_size, gemm_block_size) * nsubc);
 
-                const float denominator = centroid_vector_norms_L2sqr[subc];
-                const float alpha = numerator / denominator;
+        float max_norm = 0;
+        for (size_t subc = 0; subc < nsubc; subc++) {
+            centroid_ips[subc] = faiss::fvec_inner_product(centroid_vectors + subc * d, centroid, d);
+            max_norm = std::max(max_norm, centroid_vector_norms_L2sqr[subc]);
+        }
 
-                std::vector<float> subcentroid(d);
-                faiss::fvec_madd(d, centroid, alpha, centroid_vector, subcentroid.data());
+        for (size_t block_begin = 0; block_begin < group_size; block_begin += gemm_block_size) {
+            const size_t nb = std::min(gemm_block_size, group_size - block_begin);
+            inner_products(points + block_begin * d, centroid_vectors, d, nb, nsubc, ips);
 
-                const float dist = fvec_L2sqr(point, subcentroid.data(), d);
-                maxheap.emplace(-dist, std::make_pair(numerator, denominator));
+            for (size_t i = 0; i < nb; i++) {
+                float *numerators = ips + i * nsubc;
+                for (size_t subc = 0; subc < nsubc; subc++) {
+                    const float numerator = std::max(numerators[subc] - centroid_ips[subc], 0.0f);
+                    numerators[subc] = numerator;
+                    scores[subc] = -numerator * numerator / centroid_vector_norms_L2sqr[subc];
+                }
+                const size_t best = argmin(scores, nsubc);
+                if (scores[best] < 0) {
+                    group_numerator += numerators[best];
+                    group_denominator += centroid_vector_norms_L2sqr[best];
+                } else {
+                    // All candidates coincide with the centroid, the largest norm wins the tie
+                    group_denominator += max_norm;
+                }
             }
-
-            group_numerator += maxheap.top().second.first;
-            group_denominator += maxheap.top().second.second;
         }
         return (group_denominator > 0) ? group_numerator / group_denominator : 0.0;
     }
@@ -4,6 +4,13 @@
 #include "IndexIVF_HNSW.h"
 
 namespace ivfhnsw{
+    /// Sub-group pruning strategies of the grouping index
+    enum PruningMode {
+        PRUNING_THRESHOLD = 0,     ///< Skip sub-groups farther than the mean distance to the probed sub-centroids
+        PRUNING_BOUND = 1,         ///< Skip sub-groups whose lower bound of the scanned distances is not below the current k-th best
+        PRUNING_BOUND_SCALED = 2,  ///< PRUNING_BOUND with sub-group radii scaled by <bound_scale>, prunes more, not exact
+    };
+
     //=======================================
     // IVF_HNSW + Grouping( + Pruning) index
     //=======================================
@@ -11,25 +18,53 @@ namespace ivfhnsw{
     {
         size_t nsubc;         ///< Number of sub-centroids per group
         bool do_pruning;      ///< Turn on/off pruning
+        PruningMode pruning_mode;  ///< Pruning strategy if pruning is on
+        float bound_scale;         ///< Scale of sub-group radii in PRUNING_BOUND_SCALED, in (0, 1]
 
         std::vector<std::vector<idx_t> > nn_centroid_idxs;    ///< Indices of the <nsubc> nearest centroids for each centroid
         std::vector<std::vector<idx_t> > subgroup_sizes;      ///< Sizes of sub-groups for each group
+        std::vector<std::vector<idx_t> > subgroup_capacities; ///< Slots of sub-groups with the gaps left by add, empty - no gaps
         std::vector<float> alphas;    ///< Coefficients that determine the location of sub-centroids
+        std::vector<std::vector<float> > subgroup_radii;      ///< Max norm of reconstructed residuals in each sub-group
+        std::vector<float> norm_errors;   ///< Max error of the quantized norms in each group, the slack of the L2 bounds
 
     public:
         IndexIVF_HNSW_Grouping(size_t dim, size_t ncentroids, size_t bytes_per_code,
                                size_t nbits_per_idx, size_t nsubcentroids);
 
         /** Add <group_size> vectors of dimension <d> from the <group_idx>-th group to the index.
+          *
+          * The first vectors of a group determine its sub-centroids. The vectors added to
+          * the group later are inserted into the sub-groups of their nearest sub-centroids.
           *
           * @param group_idx         index of the group
           * @param group_size        number of base vectors in the group
           * @param x                 base vectors to add (size: group_size * d)
           * @param ids               ids to store for the vectors (size: groups_size)
         */
-        void add_group(size_t group_idx, size_t group_size, const float *x, const idx_t *ids);
+        void add_group(size_t group_idx, size_t group_size, const float *x, const label_t *ids);
 
-        size_t search(size_t k, const float *x, float *distances, long *labels);
+        /** Add n vectors to the built index
+          *
+          * Each vector is assigned to its group by the quantizer and inserted into the sub-group
+          * of its nearest sub-centroid, computed from the stored alpha and nearest centroids of the group.
+          * Sub-groups keep gaps for the inserted vectors, so a full sub-group doubles its capacity
+          * and only then the group is laid out again. Groups are filled in parallel; the vectors
+          * are encoded without the lock and each group is changed under the exclusive lists lock,
+          * so the index can be searched meanwhile. Call compact_subgroups before writing the index.
+          *
+          * @param n      number of vectors
+          * @param x      vectors to add, size n * d
+          * @param xids   ids to store for the vectors, size n
+        */
+        void add(size_t n, const float *x, const label_t *xids);
+
+        /// Remove the gaps of the sub-groups left by add and split_lists, required before write.
+        /// Each group is laid out again under the exclusive lists lock
+        void compact_subgroups();
+
+        /// Sum of the sub-group sizes, without the gaps
+        size_t list_nvectors(idx_t list_no) const;
 
         void write(const char *path_index);
         void read(const char *path_index);
@@ -39,14 +74,104 @@ namespace ivfhnsw{
         /// Compute distances between the group centroid and its <subc> nearest neighbors in the HNSW graph
         void compute_inter_centroid_dists();
 
-    protected:
-        /// Distances to the coarse centroids. Used for distance computation between a query and base points
-        std::vector<float> query_centroid_dists;
+        /// Compute sub-group radii and norm errors for bound pruning by decoding the codes, only for groups without radii
+        void compute_subgroup_radii();
 
+    protected:
         /// Distances between coarse centroids and their sub-centroids
         std::vector<std::vector<float>> inter_centroid_dists;
 
+        /// Scan the sub-groups of the probed groups which are not pruned for the query
+        size_t plan_scans(const float *query, const SearchBudget &budget, const idx_t *centroid_idxs,
+                          const float *centroid_dists, hnswlib::DistanceCache &query_centroid_dists,
+                          std::vector<ListScan> &scans);
+
+        /// Vector the code at <offset> of the group is the residual of: the sub-centroid of its sub-group
+        void list_base(idx_t list_no, size_t offset, float *base) const;
+
+        /// Resize the per-group data, including the sub-group layout, to <new_nc> groups
+        void resize_lists(size_t new_nc);
+
+        /// Offsets of the vectors of the sub-groups, the gaps are skipped
+        void list_entries(idx_t list_no, std::vector<size_t> &offsets) const;
+
+        /// Remove the flagged vectors from their sub-groups, the sub-groups keep their slots
+        void remove_entries(idx_t list_no, const std::vector<uint8_t> &removed);
+
+        /// Lay out the new group with its vectors as add_group does
+        std::unique_ptr<EncodedList> encode_list(idx_t list_no, size_t n, const float *x, const label_t *xids);
+
+        /// Move the group encoded by encode_list to the index and compute its inter-centroid distances
+        void commit_list(idx_t list_no, EncodedList &list);
+
+        /// Number of slots of the sub-group in its list, its size if the group has no gaps
+        size_t subgroup_capacity(idx_t centroid_idx, size_t subc) const
+        {
+            return subgroup_capacities[centroid_idx].empty() ? subgroup_sizes[centroid_idx][subc]
+                                                             : subgroup_capacities[centroid_idx][subc];
+        }
+
     private:
+        /// Plan sub-groups of the probed groups for bound pruning, see PruningMode
+        size_t plan_bounded_scans(const float *query, const SearchBudget &budget, const idx_t *centroid_idxs,
+                                  const float *centroid_dists, hnswlib::DistanceCache &query_centroid_dists,
+                                  std::vector<ListScan> &scans);
+
+        /** Find the <nsubc> nearest centroids to the centroid, excluding the centroid itself
+          *
+          * @param nn_idxs    output centroid indices in the ascending order of the quantizer distance, size nsubc
+          * @param nn_dists   output L2 sqr distances from the centroid to them, size nsubc
+        */
+        void find_nn_centroids(idx_t centroid_idx, idx_t *nn_idxs, float *nn_dists) const;
+
+        /// Distances between the group centroid and its <nsubc> nearest centroids
+        void compute_inter_centroid_dists(idx_t centroid_idx);
+
+        /// Sub-centroids of the group from its alpha and nearest centroids, size nsubc * d
+        void compute_subcentroids(idx_t centroid_idx, float *subcentroids) const;
+
+        /// Sub-centroids from the centroid, its alpha and its <nsubc> nearest centroids, size nsubc * d
+        void compute_subcentroids(const float *centroid, float alpha, const idx_t *nn_idxs,
+                                  float *subcentroids) const;
+
+        /// New group encoded without the lock, with the sub-group layout and the pruning data
+        struct EncodedGroup: EncodedList {
+            std::vector<idx_t> nn_centroid_idxs;  ///< <nsubc> nearest centroids of the group
+            float alpha;                          ///< Alpha of the sub-centroids
+            std::vector<idx_t> subgroup_sizes;    ///< Sizes of the sub-groups, the entries are ordered by sub-group
+            std::vector<float> subgroup_radii;    ///< Max norms of the decoded residuals of the sub-groups
+            float norm_error;                     ///< Max error of the quantized norms
+
+            EncodedGroup(): alpha(0), norm_error(0) {}
+        };
+
+        /// Encode the first vectors of an empty group as add_group does, the index is only read
+        void encode_new_group(idx_t centroid_idx, size_t group_size, const float *x, const label_t *xids,
+                              EncodedGroup &group);
+
+        /// Move the group encoded by encode_new_group to the index
+        void commit_group(idx_t centroid_idx, EncodedGroup &group);
+
+        /** Encode n vectors of a group as residuals from their sub-centroids
+          *
+          * @param xcodes           output residual codes, size n * code_size
+          * @param xnorm_codes      output norm codes, size n, not written for the inner product metrics
+          * @param refine_xcodes    output refinement codes, size n * refine_pq->code_size
+          * @param residual_norms   output norms of the decoded residuals, size n
+          * @return max error of the quantized norms of the reconstructed vectors, 0 for the inner product metrics
+        */
+        float encode_group(size_t n, const float *x, const float *subcentroids, const idx_t *subcentroid_idxs,
+                           uint8_t *xcodes, uint8_t *xnorm_codes, uint8_t *refine_xcodes, float *residual_norms);
+
+        /// Insert n vectors into the sub-groups of a group that already has sub-centroids
+        void insert_group(idx_t centroid_idx, size_t n, const float *x, const label_t *xids);
+
+        /// Lay out the group again with the sub-group capacities, keeping the vectors of each sub-group
+        void relayout_group(idx_t centroid_idx, const std::vector<idx_t> &capacities);
+
+        /// Distance from the query to the coarse centroid, taken from the cache of the HNSW search if it is there
+        float query_centroid_dist(const float *query, idx_t centroid_idx, hnswlib::DistanceCache &cache) const;
+
         void compute_residuals(size_t n, const float *x, float *residuals,
                                const float *subcentroids, const idx_t *keys);
 
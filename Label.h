@@ -0,0 +1,27 @@
+#ifndef IVF_HNSW_LIB_LABEL_H
+#define IVF_HNSW_LIB_LABEL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+namespace ivfhnsw {
+    /** Type of the vector ids stored in the inverted lists
+      *
+      * Ids are 32-bit by default, which keeps the lists compact but limits a single
+      * index to 2^32 vectors. Build with -DIVFHNSW_64BIT_IDS=ON for larger collections.
+      * Centroid and list indices (idx_t) stay 32-bit in both modes.
+    */
+#ifdef IVFHNSW_64BIT_IDS
+    typedef uint64_t label_t;
+#else
+    typedef uint32_t label_t;
+#endif
+
+    /// Check that the ids [0, n) fit label_t
+    inline bool labels_fit(size_t n)
+    {
+        return n == 0 || n - 1 <= std::numeric_limits<label_t>::max();
+    }
+}
+#endif //IVF_HNSW_LIB_LABEL_H
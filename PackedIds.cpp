@@ -0,0 +1,185 @@
+#include "PackedIds.h"
+
+#include <algorithm>
+#include <cstring>
+#include <x86intrin.h>
+
+#include "utils.h"
+
+namespace ivfhnsw {
+
+    const size_t PackedIds::block_size;
+
+    namespace {
+        /// Padding words after the packed differences, a lane reads the word after its own
+        const size_t packed_padding = 2;
+
+        /// Width of the blocks with unpacked 64-bit differences
+        const size_t unpacked_width = 64;
+
+        inline uint32_t zigzag_encode(uint32_t delta)
+        {
+            const int32_t v = (int32_t) delta;
+            return ((uint32_t) v << 1) ^ (uint32_t) (v >> 31);
+        }
+
+        inline uint32_t zigzag_decode(uint32_t v)
+        {
+            return (v >> 1) ^ (0u - (v & 1));
+        }
+
+        inline uint32_t width_mask(size_t width)
+        {
+            return (width == 32) ? ~0u : (1u << width) - 1;
+        }
+    }
+
+    void PackedIds::encode(const idx_t *ids, size_t n)
+    {
+        const size_t nblocks = (n + block_size - 1) / block_size;
+        n_ = n;
+        bases_.resize(nblocks);
+        offsets_.resize(nblocks);
+        widths_.resize(nblocks);
+        words_.clear();
+
+        uint32_t deltas[block_size];
+        for (size_t block = 0; block < nblocks; block++) {
+            const idx_t *block_ids = ids + block * block_size;
+            const size_t count = std::min(block_size, n - block * block_size);
+
+            // The first difference is 0, the missing ids of the last block are 0 too.
+            // Differences are sign extended from 32 bits when decoded, which is exact mod 2^32
+            uint32_t max_delta = 0;
+            bool wide = false;
+            deltas[0] = 0;
+            for (size_t j = 1; j < block_size; j++) {
+                const idx_t delta = (j < count) ? block_ids[j] - block_ids[j - 1] : 0;
+                wide |= (idx_t) (int32_t) delta != delta;
+                deltas[j] = zigzag_encode((uint32_t) delta);
+                max_delta = std::max(max_delta, deltas[j]);
+            }
+            const size_t width = wide ? unpacked_width : (max_delta == 0) ? 0 : 32 - __builtin_clz(max_delta);
+
+            bases_[block] = block_ids[0];
+            offsets_[block] = words_.size();
+            widths_[block] = width;
+
+            // Blocks of equal ids take no words
+            if (width == 0)
+                continue;
+            if (width == unpacked_width) {
+                const size_t offset = words_.size();
+                words_.resize(offset + block_size * 2, 0);
+                for (size_t j = 1; j < count; j++) {
+                    const uint64_t delta = block_ids[j] - block_ids[j - 1];
+                    memcpy(words_.data() + offset + j * 2, &delta, sizeof(uint64_t));
+                }
+                continue;
+            }
+            const size_t offset = words_.size();
+            words_.resize(offset + (block_size * width + 31) / 32, 0);
+            for (size_t j = 0; j < block_size; j++) {
+                const size_t bit = j * width;
+                const size_t shift = bit & 31;
+                words_[offset + (bit >> 5)] |= deltas[j] << shift;
+                if (shift + width > 32)
+                    words_[offset + (bit >> 5) + 1] |= deltas[j] >> (32 - shift);
+            }
+        }
+        words_.resize(words_.size() + packed_padding, 0);
+    }
+
+    void PackedIds::decode_block(size_t block, size_t count, idx_t *ids) const
+    {
+        const size_t width = widths_[block];
+        const uint32_t *words = words_.data() + offsets_[block];
+        idx_t id = bases_[block];
+        ids[0] = id;
+        if (width == unpacked_width) {
+            for (size_t j = 1; j < count; j++) {
+                uint64_t delta;
+                memcpy(&delta, words + j * 2, sizeof(uint64_t));
+                id += delta;
+                ids[j] = id;
+            }
+            return;
+        }
+        uint32_t deltas[block_size];
+
+        size_t j = 0;
+#ifdef __AVX2__
+        // Lane l of the step reads the word of its difference and the next one
+        const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+        const __m256i mask = _mm256_set1_epi32(width_mask(width));
+        const __m256i thirty_two = _mm256_set1_epi32(32);
+        for (; j < count; j += 8) {
+            const __m256i bits = _mm256_mullo_epi32(_mm256_add_epi32(lanes, _mm256_set1_epi32(j)),
+                                                    _mm256_set1_epi32(width));
+            const __m256i word_idxs = _mm256_srli_epi32(bits, 5);
+            const __m256i shifts = _mm256_and_si256(bits, _mm256_set1_epi32(31));
+            const __m256i lo = _mm256_i32gather_epi32((const int *) words, word_idxs, 4);
+            const __m256i hi = _mm256_i32gather_epi32((const int *) words + 1, word_idxs, 4);
+            // Shifts by 32 give zeros, so an aligned difference takes nothing from the next word
+            __m256i v = _mm256_or_si256(_mm256_srlv_epi32(lo, shifts),
+                                        _mm256_sllv_epi32(hi, _mm256_sub_epi32(thirty_two, shifts)));
+            v = _mm256_and_si256(v, mask);
+            // Zigzag decoding
+            v = _mm256_xor_si256(_mm256_srli_epi32(v, 1),
+                                 _mm256_sub_epi32(_mm256_setzero_si256(), _mm256_and_si256(v, _mm256_set1_epi32(1))));
+            _mm256_storeu_si256((__m256i *) (deltas + j), v);
+        }
+#else
+        const uint32_t mask = width_mask(width);
+        for (; j < count; j++) {
+            const size_t bit = j * width;
+            const uint64_t pair = words[bit >> 5] | ((uint64_t) words[(bit >> 5) + 1] << 32);
+            deltas[j] = zigzag_decode((pair >> (bit & 31)) & mask);
+        }
+#endif
+        for (j = 1; j < count; j++) {
+            id += (idx_t) (int32_t) deltas[j];
+            ids[j] = id;
+        }
+    }
+
+    PackedIds::idx_t PackedIds::get(size_t i) const
+    {
+        idx_t ids[block_size];
+        const size_t pos = i % block_size;
+        decode_block(i / block_size, pos + 1, ids);
+        return ids[pos];
+    }
+
+    void PackedIds::decode(idx_t *ids) const
+    {
+        for (size_t block = 0; block < bases_.size(); block++)
+            decode_block(block, std::min(block_size, n_ - block * block_size), ids + block * block_size);
+    }
+
+    size_t PackedIds::memory_usage() const
+    {
+        return bases_.size() * (sizeof(idx_t) + sizeof(uint32_t) + sizeof(uint8_t)) + words_.size() * sizeof(uint32_t);
+    }
+
+    void PackedIds::write(std::ostream &output)
+    {
+        const uint32_t n = n_;
+        write_variable(output, n);
+        write_vector(output, bases_);
+        write_vector(output, offsets_);
+        write_vector(output, widths_);
+        write_vector(output, words_);
+    }
+
+    void PackedIds::read(std::istream &input)
+    {
+        uint32_t n = 0;
+        read_variable(input, n);
+        n_ = n;
+        read_vector(input, bases_);
+        read_vector(input, offsets_);
+        read_vector(input, widths_);
+        read_vector(input, words_);
+    }
+}
@@ -0,0 +1,60 @@
+#ifndef IVF_HNSW_LIB_PACKEDIDS_H
+#define IVF_HNSW_LIB_PACKEDIDS_H
+
+#include <cstdint>
+#include <cstddef>
+#include <istream>
+#include <ostream>
+#include <vector>
+
+#include "Label.h"
+
+namespace ivfhnsw {
+    /** Ids of one inverted list compressed with block delta coding and bit-packing
+      *
+      * Ids are split into blocks of <block_size>. A block keeps its first id, and the differences
+      * of consecutive ids (zigzag-encoded, so the order of the ids is arbitrary) are bit-packed
+      * with the width of the largest one. Ids of a list are added mostly in the ascending order,
+      * so a block takes about log2(gap) + 1 bits per id instead of 32 or 64. With 64-bit ids,
+      * a block with a difference beyond 32 bits keeps its differences unpacked.
+      *
+      * Single ids are decoded on demand: the prefix of the block up to the id is unpacked
+      * with AVX2 gathers and variable shifts, then summed up.
+    */
+    class PackedIds {
+    public:
+        typedef label_t idx_t;
+        static const size_t block_size = 64;
+
+        PackedIds(): n_(0) {}
+
+        /// Replace the content with n ids
+        void encode(const idx_t *ids, size_t n);
+
+        /// Number of ids
+        size_t size() const { return n_; }
+
+        /// Id at position i
+        idx_t get(size_t i) const;
+
+        /// Decode all ids, size size()
+        void decode(idx_t *ids) const;
+
+        /// Size of the packed representation in bytes
+        size_t memory_usage() const;
+
+        void write(std::ostream &output);
+        void read(std::istream &input);
+
+    private:
+        size_t n_;
+        std::vector<idx_t> bases_;       ///< First id of each block
+        std::vector<uint32_t> offsets_;  ///< Offset of each block in words_
+        std::vector<uint8_t> widths_;    ///< Bits per packed difference in each block
+        std::vector<uint32_t> words_;    ///< Packed differences of all blocks, padded for the unaligned reads
+
+        /// Decode the first <count> ids of the block
+        void decode_block(size_t block, size_t count, idx_t *ids) const;
+    };
+}
+#endif //IVF_HNSW_LIB_PACKEDIDS_H
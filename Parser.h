@@ -16,6 +16,18 @@ struct Parser
     //=================
     size_t M;               ///< Min number of edges per point
     size_t efConstruction;  ///< Max number of candidate vertices in priority queue to observe during construction
+    bool do_reorder;        ///< Renumber HNSW vertices for memory locality
+    bool do_compact_links;  ///< Store HNSW links in the compact read-only storage
+    bool do_mmap_quantizer; ///< Map the HNSW snapshot instead of reading it
+
+    //===================
+    // Memory parameters
+    //===================
+    const char *hugepages;  ///< Huge page mode for the HNSW graph and the inverted lists: none, thp, 2mb or 1gb
+    bool do_pack_ids;       ///< Compress the ids of the inverted lists, the index becomes read-only
+    size_t max_list_size;   ///< Split the inverted lists larger than this, 0 - no splitting
+    size_t cache_mb;        ///< RAM cache of the tiered lists in MB
+    size_t io_threads;      ///< Number of I/O threads reading the tiered lists
 
     //=================
     // Data parameters
@@ -28,12 +40,17 @@ struct Parser
     size_t nq;             ///< Number of queries
     size_t ngt;            ///< Number of groundtruth neighbours per query
     size_t d;              ///< Vector dimension
+    size_t nshards;        ///< Number of shards the base set is split into by the sharded driver
+    size_t nadd;           ///< Number of base vectors after the first <nb> inserted into the built grouping index
 
     //=================
     // PQ parameters
     //=================
     size_t code_size;      ///< Code size per vector in bytes
     bool do_opq;           ///< Turn on/off OPQ fine encoding
+    const char *encoding;  ///< Residual encoding: pq or sq8
+    const char *metric;    ///< Similarity: l2, ip or cosine
+    size_t refine_code_size; ///< Refinement code size per vector in bytes, 0 - no refinement
 
     //===================
     // Search parameters
@@ -43,6 +60,9 @@ struct Parser
     size_t max_codes;      ///< Max number of codes to visit to do a query
     size_t efSearch;       ///< Max number of candidate vertices in priority queue to observe during searching
     bool do_pruning;       ///< Turn on/off pruning in the grouping scheme
+    size_t pruning_mode;   ///< Pruning mode: 0 - mean threshold, 1 - exact bound, 2 - scaled bound
+    float bound_scale;     ///< Scale of sub-group radii in the scaled bound pruning mode
+    size_t refine_k;       ///< Number of the best scan candidates re-ranked with the refinement codes
 
     //=======
     // Paths
@@ -61,7 +81,18 @@ struct Parser
     const char *path_pq;               ///< Path to the product quantizer for residuals
     const char *path_opq_matrix;       ///< Path to OPQ rotation matrix for OPQ fine encoding
     const char *path_norm_pq;          ///< Path to the product quantizer for norms of reconstructed base points
+    const char *path_refine_pq;        ///< Path to the product quantizer for refinement codes
     const char *path_index;            ///< Path to the constructed index
+    const char *path_lists;            ///< Path to the list file on local NVMe, only the hot lists are kept in RAM
+
+    //===================
+    // Server parameters
+    //===================
+    const char *path_socket;  ///< Path to the Unix domain socket to listen on
+    size_t port;              ///< Loopback TCP port to listen on, if path_socket is not set
+    size_t max_batch;         ///< Max number of queries in a micro-batch
+    size_t deadline_us;       ///< Max time in microseconds a query waits for its micro-batch to fill up
+    size_t nworkers;          ///< Number of pinned search worker threads, 0 - one per core
 
     Parser(int argc, char **argv)
     {
@@ -69,6 +100,31 @@ struct Parser
         if (argc == 1)
             usage();
 
+        do_reorder = false;
+        do_compact_links = false;
+        do_mmap_quantizer = false;
+        hugepages = "none";
+        do_pack_ids = false;
+        max_list_size = 0;
+        cache_mb = 1024;
+        io_threads = 8;
+        path_lists = nullptr;
+        encoding = "pq";
+        metric = "l2";
+        refine_code_size = 0;
+        refine_k = 256;
+        path_refine_pq = nullptr;
+        nsubc = 0;
+        nshards = 1;
+        nadd = 0;
+        pruning_mode = 0;
+        bound_scale = 0.5;
+        path_socket = nullptr;
+        port = 0;
+        max_batch = 64;
+        deadline_us = 1000;
+        nworkers = 0;
+
         for (size_t i = 1 ; i < argc; i++) {
             char *a = argv[i];
 
@@ -83,6 +139,18 @@ struct Parser
             //=================
             if (!strcmp (a, "-M")) sscanf(argv[++i], "%zu", &M);
             else if (!strcmp (a, "-efConstruction")) sscanf(argv[++i], "%zu", &efConstruction);
+            else if (!strcmp (a, "-reorder")) do_reorder = !strcmp(argv[++i], "on");
+            else if (!strcmp (a, "-compact_links")) do_compact_links = !strcmp(argv[++i], "on");
+            else if (!strcmp (a, "-mmap_quantizer")) do_mmap_quantizer = !strcmp(argv[++i], "on");
+
+            //===================
+            // Memory parameters
+            //===================
+            else if (!strcmp (a, "-hugepages")) hugepages = argv[++i];
+            else if (!strcmp (a, "-pack_ids")) do_pack_ids = !strcmp(argv[++i], "on");
+            else if (!strcmp (a, "-max_list_size")) sscanf(argv[++i], "%zu", &max_list_size);
+            else if (!strcmp (a, "-cache_mb")) sscanf(argv[++i], "%zu", &cache_mb);
+            else if (!strcmp (a, "-io_threads")) sscanf(argv[++i], "%zu", &io_threads);
 
             //=================
             // Data parameters
@@ -95,12 +163,17 @@ struct Parser
             else if (!strcmp (a, "-nq")) sscanf(argv[++i], "%zu", &nq);
             else if (!strcmp (a, "-ngt")) sscanf(argv[++i], "%zu", &ngt);
             else if (!strcmp (a, "-d")) sscanf(argv[++i], "%zu", &d);
+            else if (!strcmp (a, "-nshards")) sscanf(argv[++i], "%zu", &nshards);
+            else if (!strcmp (a, "-nadd")) sscanf(argv[++i], "%zu", &nadd);
 
             //===============
             // PQ parameters
             //===============
             else if (!strcmp (a, "-code_size"))sscanf(argv[++i], "%zu", &code_size);
             else if (!strcmp (a, "-opq")) do_opq = !strcmp(argv[++i], "on");
+            else if (!strcmp (a, "-encoding")) encoding = argv[++i];
+            else if (!strcmp (a, "-metric")) metric = argv[++i];
+            else if (!strcmp (a, "-refine_code_size")) sscanf(argv[++i], "%zu", &refine_code_size);
 
             //===================
             // Search parameters
@@ -110,6 +183,9 @@ struct Parser
             else if (!strcmp (a, "-max_codes")) sscanf(argv[++i], "%zu", &max_codes);
             else if (!strcmp (a, "-efSearch")) sscanf(argv[++i], "%zu", &efSearch);
             else if (!strcmp (a, "-pruning")) do_pruning = !strcmp(argv[++i], "on");
+            else if (!strcmp (a, "-pruning_mode")) sscanf(argv[++i], "%zu", &pruning_mode);
+            else if (!strcmp (a, "-bound_scale")) sscanf(argv[++i], "%f", &bound_scale);
+            else if (!strcmp (a, "-refine_k")) sscanf(argv[++i], "%zu", &refine_k);
 
             //=======
             // Paths
@@ -128,7 +204,18 @@ struct Parser
             else if (!strcmp (a, "-path_pq")) path_pq = argv[++i];
             else if (!strcmp (a, "-path_opq_matrix")) path_opq_matrix = argv[++i];
             else if (!strcmp (a, "-path_norm_pq")) path_norm_pq = argv[++i];
+            else if (!strcmp (a, "-path_refine_pq")) path_refine_pq = argv[++i];
             else if (!strcmp (a, "-path_index")) path_index = argv[++i];
+            else if (!strcmp (a, "-path_lists")) path_lists = argv[++i];
+
+            //===================
+            // Server parameters
+            //===================
+            else if (!strcmp (a, "-path_socket")) path_socket = argv[++i];
+            else if (!strcmp (a, "-port")) sscanf(argv[++i], "%zu", &port);
+            else if (!strcmp (a, "-max_batch")) sscanf(argv[++i], "%zu", &max_batch);
+            else if (!strcmp (a, "-deadline_us")) sscanf(argv[++i], "%zu", &deadline_us);
+            else if (!strcmp (a, "-nworkers")) sscanf(argv[++i], "%zu", &nworkers);
         }
     }
 
@@ -140,6 +227,17 @@ struct Parser
                 "###################\n"
                 "    -M #                  Min number of edges per point\n"
                 "    -efConstruction #     Max number of candidate vertices in priority queue to observe during construction\n"
+                "    -reorder on/off       Renumber HNSW vertices for memory locality\n"
+                "    -compact_links on/off Store HNSW links in the compact read-only storage\n"
+                "    -mmap_quantizer on/off Map the HNSW snapshot instead of reading it\n"
+                "#####################\n"
+                "# Memory Parameters #\n"
+                "#####################\n"
+                "    -hugepages none/thp/2mb/1gb Huge pages for the HNSW graph and the inverted lists, default: none\n"
+                "    -pack_ids on/off      Compress the ids of the inverted lists, the index becomes read-only\n"
+                "    -max_list_size #      Split the inverted lists larger than this, 0 - no splitting\n"
+                "    -cache_mb #           RAM cache of the tiered lists in MB, see -path_lists\n"
+                "    -io_threads #         Number of I/O threads reading the tiered lists\n"
                 "###################\n"
                 "# Data Parameters #\n"
                 "###################\n"
@@ -151,11 +249,16 @@ struct Parser
                 "    -nq #                 Number of queries\n"
                 "    -ngt #                Number of groundtruth neighbours per query\n"
                 "    -d #                  Vector dimension\n"
+                "    -nshards #            Number of shards the base set is split into by the sharded driver\n"
+                "    -nadd #               Number of base vectors after the first <nb> inserted into the built grouping index\n"
                 "#################\n"
                 "# PQ Parameters #\n"
                 "#################\n"
                 "    -code_size #          Code size per vector in bytes\n"
                 "    -opq on/off           Turn on/off OPQ compression\n"
+                "    -encoding pq/sq8      Residual encoding, sq8 stores d bytes per vector and ignores -code_size\n"
+                "    -metric l2/ip/cosine  Similarity, ip and cosine store no norm codes, cosine normalizes the vectors\n"
+                "    -refine_code_size #   Refinement code size per vector in bytes, 0 - no refinement\n"
                 "####################\n"
                 "# Search Parameters #\n"
                 "#####################\n"
@@ -164,6 +267,9 @@ struct Parser
                 "    -max_codes #          Max number of codes to visit to do a query\n"
                 "    -efSearch #           Max number of candidate vertices in priority queue to observe during searching\n"
                 "    -pruning on/off       Turn on/off pruning in the grouping scheme\n"
+                "    -pruning_mode #       Pruning mode: 0 - mean threshold, 1 - exact bound, 2 - scaled bound\n"
+                "    -bound_scale #        Scale of sub-group radii in the scaled bound pruning mode\n"
+                "    -refine_k #           Number of the best scan candidates re-ranked with the refinement codes\n"
                 "#########\n"
                 "# Paths #\n"
                 "#########\n"
@@ -181,8 +287,19 @@ struct Parser
                 "    -path_pq filename                 Path to the product quantizer for residuals\n"
                 "    -path_opq_matrix filename         Path to the rotation matrix for OPQ compression\n"
                 "    -path_norm_pq filename            Path to the product quantizer for norms of reconstructed base points\n"
+                "    -path_refine_pq filename          Path to the product quantizer for refinement codes\n"
                 "    "
                 "    -path_index filename              Path to the constructed index\n"
+                "    -path_lists filename              Path to the list file on local NVMe, written if missing or stale,\n"
+                "                                      only the hot lists are kept in RAM\n"
+                "#####################\n"
+                "# Server Parameters #\n"
+                "#####################\n"
+                "    -path_socket filename Path to the Unix domain socket to listen on\n"
+                "    -port #               Loopback TCP port to listen on, if -path_socket is not set\n"
+                "    -max_batch #          Max number of queries in a micro-batch\n"
+                "    -deadline_us #        Max time in microseconds a query waits for its micro-batch to fill up\n"
+                "    -nworkers #           Number of pinned search worker threads, 0 - one per core\n"
         );
         exit(0);
     }
@@ -0,0 +1,50 @@
+#ifndef IVF_HNSW_LIB_RWLOCK_H
+#define IVF_HNSW_LIB_RWLOCK_H
+
+#include <pthread.h>
+
+namespace ivfhnsw {
+    /** Reader-writer lock that prefers writers
+      *
+      * Searches hold it shared and maintenance operations that change the lists hold it exclusively.
+      * A waiting writer blocks new readers, so it is not starved by a steady flow of queries.
+      * The shared lock is not recursive. Exclusive locking works with std::lock_guard.
+    */
+    class RWLock {
+    public:
+        RWLock()
+        {
+            pthread_rwlockattr_t attr;
+            pthread_rwlockattr_init(&attr);
+            pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+            pthread_rwlock_init(&lock_, &attr);
+            pthread_rwlockattr_destroy(&attr);
+        }
+        ~RWLock() { pthread_rwlock_destroy(&lock_); }
+
+        void lock() { pthread_rwlock_wrlock(&lock_); }
+        void unlock() { pthread_rwlock_unlock(&lock_); }
+        void lock_shared() { pthread_rwlock_rdlock(&lock_); }
+        void unlock_shared() { pthread_rwlock_unlock(&lock_); }
+
+    private:
+        pthread_rwlock_t lock_;
+
+        RWLock(const RWLock &);
+        RWLock &operator=(const RWLock &);
+    };
+
+    /// Holds the lock shared in its scope
+    class SharedLockGuard {
+    public:
+        explicit SharedLockGuard(RWLock &lock): lock_(lock) { lock_.lock_shared(); }
+        ~SharedLockGuard() { lock_.unlock_shared(); }
+
+    private:
+        RWLock &lock_;
+
+        SharedLockGuard(const SharedLockGuard &);
+        SharedLockGuard &operator=(const SharedLockGuard &);
+    };
+}
+#endif //IVF_HNSW_LIB_RWLOCK_H
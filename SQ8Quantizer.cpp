@@ -0,0 +1,132 @@
+#include "SQ8Quantizer.h"
+
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+
+#include "utils.h"
+
+namespace ivfhnsw {
+
+    namespace {
+        const uint32_t sq8_nbins = 256;   ///< Bins of each range, the code c_j is the bin of the component
+    }
+
+    SQ8Quantizer::SQ8Quantizer(size_t dim):
+            d(dim), code_size(dim), vmin(dim, 0), vdiff(dim, 0)
+    {}
+
+    void SQ8Quantizer::train(size_t n, const float *x)
+    {
+        if (n == 0)
+            return;
+        std::vector<float> vmax(x, x + d);
+        vmin.assign(x, x + d);
+        for (size_t i = 1; i < n; i++) {
+            const float *xi = x + i * d;
+            for (size_t j = 0; j < d; j++) {
+                vmin[j] = std::min(vmin[j], xi[j]);
+                vmax[j] = std::max(vmax[j], xi[j]);
+            }
+        }
+        for (size_t j = 0; j < d; j++)
+            vdiff[j] = vmax[j] - vmin[j];
+    }
+
+    void SQ8Quantizer::compute_codes(const float *x, uint8_t *codes, size_t n) const
+    {
+        for (size_t i = 0; i < n; i++) {
+            const float *xi = x + i * d;
+            uint8_t *code = codes + i * code_size;
+            for (size_t j = 0; j < d; j++) {
+                if (vdiff[j] <= 0) {
+                    code[j] = 0;
+                    continue;
+                }
+                const float v = (xi[j] - vmin[j]) / vdiff[j];
+                code[j] = (uint8_t) std::min(255, std::max(0, (int) (v * sq8_nbins)));
+            }
+        }
+    }
+
+    void SQ8Quantizer::decode(const uint8_t *codes, float *x, size_t n) const
+    {
+        for (size_t i = 0; i < n; i++) {
+            const uint8_t *code = codes + i * code_size;
+            float *xi = x + i * d;
+            for (size_t j = 0; j < d; j++)
+                xi[j] = vmin[j] + (code[j] + 0.5f) * vdiff[j] / sq8_nbins;
+        }
+    }
+
+    void SQ8Quantizer::compute_inner_prod_tables(size_t n, const float *x, float *tables) const
+    {
+        for (size_t i = 0; i < n; i++) {
+            const float *xi = x + i * d;
+            float *table = tables + i * table_size();
+            float constant = 0;
+            for (size_t j = 0; j < d; j++) {
+                table[j] = xi[j] * vdiff[j] / sq8_nbins;
+                constant += xi[j] * (vmin[j] + 0.5f * vdiff[j] / sq8_nbins);
+            }
+            table[d] = constant;
+        }
+    }
+
+    float SQ8Quantizer::inner_product(const uint8_t *code, const float *table) const
+    {
+        size_t j = 0;
+        float result = table[d];
+#ifdef USE_AVX
+        // Widen 8 codes to floats and multiply them by the table weights
+        __m256 sum = _mm256_setzero_ps();
+        for (; j + 8 <= d; j += 8) {
+            const __m128i c8 = _mm_loadl_epi64((const __m128i *) (code + j));
+            const __m256 c = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(c8));
+            sum = _mm256_add_ps(sum, _mm256_mul_ps(c, _mm256_loadu_ps(table + j)));
+        }
+        float PORTABLE_ALIGN32 TmpRes[8];
+        _mm256_store_ps(TmpRes, sum);
+        result += TmpRes[0] + TmpRes[1] + TmpRes[2] + TmpRes[3] + TmpRes[4] + TmpRes[5] + TmpRes[6] + TmpRes[7];
+#endif
+        for (; j < d; j++)
+            result += table[j] * code[j];
+        return result;
+    }
+
+    void write_SQ8Quantizer(const SQ8Quantizer *sq, const char *path)
+    {
+        std::ofstream output(path, std::ios::binary);
+        write_variable(output, sq->d);
+        output.write((const char *) sq->vmin.data(), sq->d * sizeof(float));
+        output.write((const char *) sq->vdiff.data(), sq->d * sizeof(float));
+        write_variable(output, sq8_nbins);
+    }
+
+    SQ8Quantizer *read_SQ8Quantizer(const char *path)
+    {
+        std::ifstream input(path, std::ios::binary);
+        size_t d = 0;
+        read_variable(input, d);
+        if (!input || d == 0)
+            throw std::runtime_error(std::string("Wrong SQ8 quantizer: ") + path);
+
+        SQ8Quantizer *sq = new SQ8Quantizer(d);
+        input.read((char *) sq->vmin.data(), d * sizeof(float));
+        input.read((char *) sq->vdiff.data(), d * sizeof(float));
+        if (!input) {
+            delete sq;
+            throw std::runtime_error(std::string("Truncated SQ8 quantizer: ") + path);
+        }
+
+        // Quantizers written before the bin count was recorded have 255 bins, their codes do not decode with 256
+        uint32_t nbins = 255;
+        if (input.peek() != EOF)
+            read_variable(input, nbins);
+        if (nbins != sq8_nbins) {
+            delete sq;
+            throw std::runtime_error(std::string("SQ8 quantizer with 255 bins, retrain it and rebuild the index: ") + path);
+        }
+        return sq;
+    }
+}
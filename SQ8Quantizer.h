@@ -0,0 +1,53 @@
+#ifndef IVF_HNSW_LIB_SQ8QUANTIZER_H
+#define IVF_HNSW_LIB_SQ8QUANTIZER_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+namespace ivfhnsw {
+    /** 8-bit scalar quantizer with a range per dimension
+      *
+      * The component j of a vector is encoded with one byte c_j and reconstructed as
+      *
+      *     y_j = vmin_j + (c_j + 0.5) * vdiff_j / 256
+      *
+      * where [vmin_j, vmin_j + vdiff_j] is the range of the dimension in the training set
+      * split into 256 bins of equal width, c_j = min(255, floor(256 * (x_j - vmin_j) / vdiff_j)).
+      * Thus the inner product with the query x is
+      *
+      *     (x|y) = sum_j x_j * (vmin_j + 0.5 * vdiff_j / 256) + sum_j (x_j * vdiff_j / 256) * c_j
+      *             -----------------------------------------   -----------------------------------
+      *                            table[d]                             table[j] * c_j
+      *
+      * and the codes are scored with a SIMD dot product instead of table lookups.
+    */
+    struct SQ8Quantizer
+    {
+        size_t d;                   ///< Vector dimension
+        size_t code_size;           ///< Code size per vector in bytes, equals d
+        std::vector<float> vmin;    ///< Lower bound of each dimension
+        std::vector<float> vdiff;   ///< Range width of each dimension
+
+        explicit SQ8Quantizer(size_t dim);
+
+        /// Size of the inner product table of one query
+        size_t table_size() const { return d + 1; }
+
+        /// Set the ranges to the per-dimension min/max of n training vectors
+        void train(size_t n, const float *x);
+
+        void compute_codes(const float *x, uint8_t *codes, size_t n) const;
+        void decode(const uint8_t *codes, float *x, size_t n) const;
+
+        /// Compute inner product tables of n queries, size n * table_size()
+        void compute_inner_prod_tables(size_t n, const float *x, float *tables) const;
+
+        /// Inner product of the query with the reconstructed code, table of the query from compute_inner_prod_tables
+        float inner_product(const uint8_t *code, const float *table) const;
+    };
+
+    void write_SQ8Quantizer(const SQ8Quantizer *sq, const char *path);
+    SQ8Quantizer *read_SQ8Quantizer(const char *path);
+}
+#endif //IVF_HNSW_LIB_SQ8QUANTIZER_H
@@ -0,0 +1,153 @@
+#include <unordered_set>
+
+#include "ShardedIndex.h"
+
+namespace ivfhnsw {
+
+    //==============================
+    // Sharded index implementation
+    //==============================
+    ShardedIndex::ShardedIndex(bool own_shards):
+            own_shards(own_shards), nprobe(1), max_codes(0)
+    {}
+
+    ShardedIndex::~ShardedIndex()
+    {
+        if (!own_shards)
+            return;
+
+        // Shared quantizers and codebooks must be deleted only once
+        std::unordered_set<void *> deleted;
+        for (IndexIVF_HNSW *shard : shards) {
+            if (!deleted.insert(shard->quantizer).second) shard->quantizer = nullptr;
+            if (!deleted.insert(shard->pq).second) shard->pq = nullptr;
+            if (!deleted.insert(shard->sq).second) shard->sq = nullptr;
+            if (!deleted.insert(shard->norm_pq).second) shard->norm_pq = nullptr;
+            if (!deleted.insert(shard->opq_matrix).second) shard->opq_matrix = nullptr;
+            if (!deleted.insert(shard->refine_pq).second) shard->refine_pq = nullptr;
+            delete shard;
+        }
+    }
+
+    void ShardedIndex::share_trained(IndexIVF_HNSW *shard, const IndexIVF_HNSW *source)
+    {
+        if (shard->d != source->d || shard->nc != source->nc || shard->code_size != source->code_size ||
+            shard->encoding != source->encoding || shard->metric != source->metric) {
+            std::cout << "Shard parameters do not match the first shard" << std::endl;
+            abort();
+        }
+        if (shard->quantizer != source->quantizer) {
+            delete shard->quantizer;
+            shard->quantizer = source->quantizer;
+        }
+        if (shard->pq != source->pq) {
+            delete shard->pq;
+            shard->pq = source->pq;
+        }
+        if (shard->sq != source->sq) {
+            delete shard->sq;
+            shard->sq = source->sq;
+        }
+        if (shard->norm_pq != source->norm_pq) {
+            delete shard->norm_pq;
+            shard->norm_pq = source->norm_pq;
+        }
+        if (shard->opq_matrix != source->opq_matrix) {
+            delete shard->opq_matrix;
+            shard->opq_matrix = source->opq_matrix;
+        }
+        if (shard->refine_pq != source->refine_pq) {
+            delete shard->refine_pq;
+            shard->refine_pq = source->refine_pq;
+        }
+        shard->do_opq = source->do_opq;
+    }
+
+    void ShardedIndex::add_shard(IndexIVF_HNSW *shard, long id_offset, bool share_trained)
+    {
+        if (share_trained && !shards.empty())
+            ShardedIndex::share_trained(shard, shards[0]);
+
+        // The sizes are counted once, the search splits the budget with them
+        size_t size = 0;
+        for (size_t i = 0; i < shard->nc; i++)
+            size += shard->list_nvectors(i);
+
+        shards.push_back(shard);
+        id_offsets.push_back(id_offset);
+        shard_sizes.push_back(size);
+    }
+
+    size_t ShardedIndex::ntotal() const
+    {
+        size_t total = 0;
+        for (size_t size : shard_sizes)
+            total += size;
+        return total;
+    }
+
+    /** Scatter-gather search
+      *
+      * The global <max_codes> budget is split across the shards proportionally to
+      * their sizes, so the total number of visited codes is the same as for
+      * a single index with all vectors. Without a limit, a shard may visit all its codes.
+      * Each shard is searched by its own thread into a separate k-sized buffer.
+      * Then the buffers are merged with a max heap, translating local ids to global labels
+      * using the id offsets of the shards.
+    */
+    size_t ShardedIndex::search(size_t k, const float *x, float *distances, long *labels)
+    {
+        const size_t nshards = shards.size();
+
+        // Split the max_codes budget across the shards, rounded up so a non-empty shard visits at least one code
+        const size_t total = ntotal();
+        std::vector<SearchBudget> budgets(nshards);
+        for (size_t s = 0; s < nshards; s++) {
+            budgets[s].nprobe = nprobe;
+            budgets[s].max_codes = (max_codes == 0 || total == 0) ? shard_sizes[s]
+                                                                 : (max_codes * shard_sizes[s] + total - 1) / total;
+        }
+
+        // Fan the query out to the shards
+        std::vector<float> shard_distances(nshards * k);
+        std::vector<long> shard_labels(nshards * k);
+        std::vector<size_t> shard_ncodes(nshards, 0);
+
+        // A shard whose list can not be read fails the query after the fan-out
+        ParallelException errors;
+#pragma omp parallel for
+        for (size_t s = 0; s < nshards; s++) {
+            if (shard_sizes[s] == 0) {
+                faiss::maxheap_heapify(k, shard_distances.data() + s * k, shard_labels.data() + s * k);
+                continue;
+            }
+            errors.run([&] {
+                shard_ncodes[s] = shards[s]->search(k, x, shard_distances.data() + s * k,
+                                                    shard_labels.data() + s * k, &budgets[s]);
+            });
+        }
+        errors.rethrow();
+
+        // Merge the per-shard results into the global top-k
+        faiss::maxheap_heapify(k, distances, labels);
+
+        size_t ncode = 0;
+        for (size_t s = 0; s < nshards; s++) {
+            const float *shard_dist = shard_distances.data() + s * k;
+            const long *shard_label = shard_labels.data() + s * k;
+
+            for (size_t j = 0; j < k; j++) {
+                if (shard_label[j] < 0)
+                    continue;
+                // Shard results are sorted in ascending order
+                if (shard_dist[j] >= distances[0])
+                    break;
+                faiss::maxheap_pop(k, distances, labels);
+                faiss::maxheap_push(k, distances, labels, shard_dist[j], shard_label[j] + id_offsets[s]);
+            }
+            ncode += shard_ncodes[s];
+        }
+        faiss::maxheap_reorder(k, distances, labels);
+        return ncode;
+    }
+}
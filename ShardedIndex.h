@@ -0,0 +1,77 @@
+#ifndef IVF_HNSW_LIB_SHARDEDINDEX_H
+#define IVF_HNSW_LIB_SHARDEDINDEX_H
+
+#include "IndexIVF_HNSW.h"
+
+namespace ivfhnsw {
+    /** Index split into several independently built shards.
+      *
+      * Each shard is a complete IndexIVF_HNSW (or IndexIVF_HNSW_Grouping) instance
+      * over a disjoint range of ids. A shard stores local ids of type label_t, and the global
+      * label of a vector is its local id plus the id offset of the shard. Therefore
+      * a collection of 32-bit shards is not limited by the 32-bit id range of a single index.
+      *
+      * Shards may share the trained quantizer, product quantizers and OPQ matrix,
+      * so they are kept in memory only once.
+      *
+      * At search time, the query is sent to all shards in parallel, the global
+      * <max_codes> budget is split across the shards proportionally to their sizes,
+      * and the per-shard results are merged into the global top-k.
+      * The budgets are passed to the shards per query, so the shards are not modified
+      * and several threads may search the index concurrently.
+    */
+    struct ShardedIndex
+    {
+        typedef IndexIVF_HNSW::idx_t idx_t;
+
+        std::vector<IndexIVF_HNSW *> shards;  ///< Independently built shards
+        std::vector<long> id_offsets;         ///< Global id of the local id 0 of each shard
+        std::vector<size_t> shard_sizes;      ///< Number of vectors in each shard, counted by add_shard
+        bool own_shards;                      ///< Delete shards in the destructor
+
+        size_t nprobe;        ///< Number of probes at search time, the same for each shard
+        size_t max_codes;     ///< Max number of codes to visit to do a query over all shards, 0 - no limit
+
+    public:
+        explicit ShardedIndex(bool own_shards = true);
+        virtual ~ShardedIndex();
+
+        /** Add a constructed shard to the index.
+          *
+          * The shard must be filled, the vectors added to it later are not counted by the budget split.
+          *
+          * @param shard          shard index with trained quantizers and filled lists
+          * @param id_offset      global id corresponding to the local id 0 in the shard
+          * @param share_trained  replace the quantizer, PQs and OPQ matrix of the shard
+          *                       with the ones of the first shard
+        */
+        void add_shard(IndexIVF_HNSW *shard, long id_offset, bool share_trained = false);
+
+        /** Replace the quantizer, PQs and OPQ matrix of the shard with the ones of <source>
+          *
+          * Lets shards be filled with the trained parts of the first shard
+          * without loading them again. The parameters of the shards must match.
+        */
+        static void share_trained(IndexIVF_HNSW *shard, const IndexIVF_HNSW *source);
+
+        /// Number of vectors in the <shard_no>-th shard
+        size_t shard_size(size_t shard_no) const { return shard_sizes[shard_no]; }
+
+        /// Total number of vectors in all shards
+        size_t ntotal() const;
+
+        /** Query a vector of dimension d to all shards and merge the results.
+         *
+         * Return at most k vectors. If there are not enough results for a
+         * query, the result array is padded with -1s.
+         *
+         * @param k           number of the closest vertices to search
+         * @param x           query vector, size d
+         * @param distances   output pairwise distances, size k
+         * @param labels      output global labels of the nearest neighbours, size k
+         * @return            number of codes visited in all shards
+         */
+        size_t search(size_t k, const float *x, float *distances, long *labels);
+    };
+}
+#endif //IVF_HNSW_LIB_SHARDEDINDEX_H
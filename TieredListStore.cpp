@@ -0,0 +1,445 @@
+#include "TieredListStore.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <new>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace ivfhnsw {
+
+    namespace {
+        /// Alignment of the list records in the file and of the read buffers, required by O_DIRECT
+        const size_t record_alignment = 4096;
+
+        const char list_file_magic[4] = {'I', 'V', 'F', 'L'};
+        const uint32_t list_file_version = 2;
+
+        /// Attempts to read a list before the pins of the list fail
+        const size_t read_attempts = 3;
+
+        struct ListFileHeader {
+            char magic[4];
+            uint32_t version;
+            uint64_t nlists;
+            uint32_t id_size;
+            uint32_t code_size;
+            uint32_t norm_code_size;
+            uint32_t refine_code_size;
+            uint64_t generation;    ///< Generation of the lists of the index the file is written from
+        };
+
+        size_t align_up(size_t size)
+        {
+            return (size + record_alignment - 1) / record_alignment * record_alignment;
+        }
+
+        /// Offset of the first list record, after the header and the directory
+        size_t data_offset(size_t nlists)
+        {
+            return align_up(sizeof(ListFileHeader) + nlists * (sizeof(uint64_t) + sizeof(uint32_t)));
+        }
+
+        bool pread_full(int fd, uint8_t *buf, size_t size, size_t offset)
+        {
+            while (size > 0) {
+                ssize_t nread = pread(fd, buf, size, offset);
+                if (nread < 0 && errno == EINTR)
+                    continue;
+                if (nread <= 0)
+                    return false;
+                buf += nread;
+                offset += nread;
+                size -= nread;
+            }
+            return true;
+        }
+
+        void write_zeros(std::ostream &output, size_t n)
+        {
+            static const char zeros[record_alignment] = {};
+            output.write(zeros, n);
+        }
+
+        bool same_layout(const ListFileHeader &header, const ListLayout &layout)
+        {
+            return header.id_size == layout.id_size && header.code_size == layout.code_size &&
+                   header.norm_code_size == layout.norm_code_size && header.refine_code_size == layout.refine_code_size;
+        }
+
+        /// Read the header and the directory of a list file, false if it is not a list file or it is truncated
+        bool read_directory(std::istream &input, ListFileHeader &header,
+                            std::vector<uint64_t> &offsets, std::vector<uint32_t> &sizes)
+        {
+            input.seekg(0, std::ios::end);
+            const uint64_t file_size = input.tellg();
+            input.seekg(0, std::ios::beg);
+            input.read((char *) &header, sizeof(header));
+            if (!input || memcmp(header.magic, list_file_magic, sizeof(header.magic)) != 0 ||
+                header.version != list_file_version ||
+                header.nlists > file_size / (sizeof(uint64_t) + sizeof(uint32_t)))
+                return false;
+            offsets.resize(header.nlists);
+            sizes.resize(header.nlists);
+            input.read((char *) offsets.data(), header.nlists * sizeof(uint64_t));
+            input.read((char *) sizes.data(), header.nlists * sizeof(uint32_t));
+            if (!input)
+                return false;
+
+            // A truncated file misses the last records
+            const size_t entry_size = header.id_size + header.code_size + header.norm_code_size + header.refine_code_size;
+            for (size_t i = 0; i < header.nlists; i++)
+                if (offsets[i] + align_up(sizes[i] * entry_size) > file_size)
+                    return false;
+            return true;
+        }
+    }
+
+    //=========
+    // ListPin
+    //=========
+    ListPin::ListPin(ListPin &&other): data_(other.data_), npins_(other.npins_)
+    {
+        other.npins_ = nullptr;
+    }
+
+    ListPin &ListPin::operator=(ListPin &&other)
+    {
+        if (this != &other) {
+            release();
+            data_ = other.data_;
+            npins_ = other.npins_;
+            other.npins_ = nullptr;
+        }
+        return *this;
+    }
+
+    void ListPin::release()
+    {
+        // The pins are taken under the guard of the store, so an eviction never sees a pin being taken
+        if (npins_)
+            (*npins_)--;
+        npins_ = nullptr;
+    }
+
+    //=================
+    // TieredListStore
+    //=================
+    void TieredListStore::write(const char *path, uint64_t generation, const ListLayout &layout, size_t nlists,
+                                const std::function<ListData(size_t)> &get_list)
+    {
+        const size_t entry_size = layout.entry_size();
+        std::vector<uint64_t> offsets(nlists);
+        std::vector<uint32_t> sizes(nlists);
+        size_t offset = data_offset(nlists);
+        for (size_t i = 0; i < nlists; i++) {
+            const size_t size = get_list(i).size;
+            if (size > UINT32_MAX)
+                throw std::runtime_error(std::string("List is too large for the list file: ") + path);
+            sizes[i] = size;
+            offsets[i] = offset;
+            offset += align_up(size * entry_size);
+        }
+
+        // The file is replaced by a rename, so a store reading the previous file keeps reading it
+        const std::string path_tmp = std::string(path) + ".tmp";
+        std::ofstream output(path_tmp.c_str(), std::ios::binary);
+        ListFileHeader header;
+        memcpy(header.magic, list_file_magic, sizeof(header.magic));
+        header.version = list_file_version;
+        header.nlists = nlists;
+        header.id_size = layout.id_size;
+        header.code_size = layout.code_size;
+        header.norm_code_size = layout.norm_code_size;
+        header.refine_code_size = layout.refine_code_size;
+        header.generation = generation;
+        output.write((const char *) &header, sizeof(header));
+        output.write((const char *) offsets.data(), nlists * sizeof(uint64_t));
+        output.write((const char *) sizes.data(), nlists * sizeof(uint32_t));
+        const size_t directory_end = sizeof(header) + nlists * (sizeof(uint64_t) + sizeof(uint32_t));
+        write_zeros(output, data_offset(nlists) - directory_end);
+
+        for (size_t i = 0; i < nlists; i++) {
+            const ListData list = get_list(i);
+            output.write((const char *) list.ids, list.size * layout.id_size);
+            output.write((const char *) list.codes, list.size * layout.code_size);
+            output.write((const char *) list.norm_codes, list.size * layout.norm_code_size);
+            output.write((const char *) list.refine_codes, list.size * layout.refine_code_size);
+            const size_t record_size = list.size * entry_size;
+            write_zeros(output, align_up(record_size) - record_size);
+        }
+        output.close();
+        if (!output || rename(path_tmp.c_str(), path) != 0) {
+            remove(path_tmp.c_str());
+            throw std::runtime_error(std::string("Failed to write the lists to ") + path);
+        }
+    }
+
+    bool TieredListStore::matches(const char *path, uint64_t generation, const ListLayout &layout,
+                                  const std::vector<size_t> &sizes)
+    {
+        std::ifstream input(path, std::ios::binary);
+        ListFileHeader header;
+        std::vector<uint64_t> offsets;
+        std::vector<uint32_t> file_sizes;
+        if (!input || !read_directory(input, header, offsets, file_sizes) || !same_layout(header, layout) ||
+            header.generation != generation)
+            return false;
+        return sizes.size() == file_sizes.size() && std::equal(sizes.begin(), sizes.end(), file_sizes.begin());
+    }
+
+    TieredListStore::TieredListStore(const char *path, const ListLayout &layout, size_t cache_bytes, size_t nthreads):
+            path_(path), layout_(layout), fd_(-1), cache_bytes_(cache_bytes), used_bytes_(0), clock_hand_(0),
+            stopping_(false), nlookups_(0), nhits_(0), nreads_(0), nread_bytes_(0), nwaits_(0), wait_us_(0)
+    {
+        // The header and the directory are read once with buffered I/O
+        std::ifstream input(path, std::ios::binary);
+        ListFileHeader header;
+        if (!read_directory(input, header, offsets_, sizes_))
+            throw std::runtime_error(std::string("Not a list file or truncated: ") + path);
+        if (!same_layout(header, layout))
+            throw std::runtime_error(std::string("Entry layout of the list file does not match the index: ") + path);
+        slot_of_list_.assign(header.nlists, -1);
+
+        // Cold lists bypass the page cache where the file system supports it
+        fd_ = open(path, O_RDONLY | O_DIRECT);
+        if (fd_ < 0)
+            fd_ = open(path, O_RDONLY);
+        if (fd_ < 0)
+            throw std::runtime_error(std::string("Can not open the list file: ") + path);
+
+        for (size_t i = 0; i < std::max<size_t>(1, nthreads); i++)
+            io_threads_.emplace_back(&TieredListStore::read_lists, this);
+    }
+
+    TieredListStore::~TieredListStore()
+    {
+        {
+            std::lock_guard<std::mutex> lock(guard_);
+            stopping_ = true;
+        }
+        read_cv_.notify_all();
+        for (std::thread &thread : io_threads_)
+            thread.join();
+        for (const std::unique_ptr<Entry> &entry : entries_)
+            free(entry->buffer);
+        if (fd_ >= 0)
+            close(fd_);
+    }
+
+    size_t TieredListStore::record_size(size_t list_no) const
+    {
+        return align_up(sizes_[list_no] * layout_.entry_size());
+    }
+
+    void TieredListStore::prefetch(size_t list_no)
+    {
+        if (sizes_[list_no] == 0)
+            return;
+        nlookups_++;
+        std::lock_guard<std::mutex> lock(guard_);
+        bool hit;
+        size_t slot;
+        lookup(list_no, false, hit, slot);
+        if (hit)
+            nhits_++;
+    }
+
+    ListPin TieredListStore::pin(size_t list_no)
+    {
+        if (sizes_[list_no] == 0)
+            return ListPin(ListData{0, nullptr, nullptr, nullptr, nullptr});
+
+        std::unique_lock<std::mutex> lock(guard_);
+        bool hit;
+        size_t slot;
+        Entry *entry = lookup(list_no, true, hit, slot);
+        entry->npins++;
+
+        if (entry->state == ENTRY_LOADING) {
+            const std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+            loaded_cv_.wait(lock, [entry] { return entry->state != ENTRY_LOADING; });
+            nwaits_++;
+            wait_us_ += std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - begin).count();
+        }
+        if (entry->state == ENTRY_FAILED) {
+            // The last pin frees the slot, so the list is read again by the next lookup
+            if (--entry->npins == 0) {
+                entry->state = ENTRY_FREE;
+                slot_of_list_[list_no] = -1;
+                free_slots_.push_back(slot);
+            }
+            throw std::runtime_error(path_ + ": failed to read list " + std::to_string(list_no));
+        }
+        return ListPin(&entry->npins, list_data(*entry));
+    }
+
+    TieredListStore::Entry *TieredListStore::lookup(size_t list_no, bool may_exceed, bool &hit, size_t &slot)
+    {
+        if (slot_of_list_[list_no] >= 0) {
+            slot = slot_of_list_[list_no];
+            Entry *entry = entries_[slot].get();
+            entry->referenced = true;
+            hit = true;
+            return entry;
+        }
+        hit = false;
+        const size_t nbytes = record_size(list_no);
+        if (!evict(nbytes) && !may_exceed)
+            return nullptr;
+
+        void *buffer = nullptr;
+        if (posix_memalign(&buffer, record_alignment, nbytes) != 0)
+            throw std::bad_alloc();
+
+        if (free_slots_.empty()) {
+            free_slots_.push_back(entries_.size());
+            entries_.emplace_back(new Entry());
+        }
+        slot = free_slots_.back();
+        free_slots_.pop_back();
+
+        Entry *entry = entries_[slot].get();
+        entry->list_no = list_no;
+        entry->buffer = (uint8_t *) buffer;
+        entry->nbytes = nbytes;
+        entry->state = ENTRY_LOADING;
+        entry->npins = 0;
+        entry->referenced = true;
+
+        used_bytes_ += nbytes;
+        slot_of_list_[list_no] = slot;
+        nreads_++;
+        nread_bytes_ += nbytes;
+        read_queue_.push_back(slot);
+        read_cv_.notify_one();
+        return entry;
+    }
+
+    /** CLOCK eviction
+      *
+      * The hand sweeps the slots, a list looked up since the last sweep gets a second chance.
+      * Pinned lists and lists being read are skipped. Two sweeps are enough to clear all CLOCK bits,
+      * if the lists still do not fit, the rest of the cache is pinned.
+    */
+    bool TieredListStore::evict(size_t nbytes)
+    {
+        for (size_t nvisited = 0; nvisited < 2 * entries_.size(); nvisited++) {
+            if (used_bytes_ + nbytes <= cache_bytes_)
+                break;
+            if (clock_hand_ >= entries_.size())
+                clock_hand_ = 0;
+            const size_t slot = clock_hand_++;
+            Entry &entry = *entries_[slot];
+            if (entry.state == ENTRY_FREE || entry.state == ENTRY_LOADING || entry.npins > 0)
+                continue;
+            if (entry.referenced) {
+                entry.referenced = false;
+                continue;
+            }
+            free(entry.buffer);
+            entry.buffer = nullptr;
+            used_bytes_ -= entry.nbytes;
+            entry.nbytes = 0;
+            entry.state = ENTRY_FREE;
+            slot_of_list_[entry.list_no] = -1;
+            free_slots_.push_back(slot);
+        }
+        return used_bytes_ + nbytes <= cache_bytes_;
+    }
+
+    void TieredListStore::read_lists()
+    {
+        for (;;) {
+            Entry *entry;
+            {
+                std::unique_lock<std::mutex> lock(guard_);
+                read_cv_.wait(lock, [this] { return stopping_ || !read_queue_.empty(); });
+                if (stopping_)
+                    return;
+                entry = entries_[read_queue_.front()].get();
+                read_queue_.pop_front();
+            }
+            // The buffer of a list being read is neither evicted nor moved.
+            // Transient errors of the device are retried before the list fails
+            bool ok = false;
+            for (size_t attempt = 0; attempt < read_attempts && !ok; attempt++)
+                ok = pread_full(fd_, entry->buffer, entry->nbytes, offsets_[entry->list_no]);
+            {
+                std::lock_guard<std::mutex> lock(guard_);
+                if (ok) {
+                    entry->state = ENTRY_READY;
+                } else {
+                    entry->state = ENTRY_FAILED;
+                    free(entry->buffer);
+                    entry->buffer = nullptr;
+                    used_bytes_ -= entry->nbytes;
+                    entry->nbytes = 0;
+                }
+            }
+            loaded_cv_.notify_all();
+        }
+    }
+
+    ListData TieredListStore::list_data(const Entry &entry) const
+    {
+        const size_t n = sizes_[entry.list_no];
+        const uint8_t *ptr = entry.buffer;
+        ListData data;
+        data.size = n;
+        data.ids = layout_.id_size ? (const label_t *) ptr : nullptr;
+        ptr += n * layout_.id_size;
+        data.codes = layout_.code_size ? ptr : nullptr;
+        ptr += n * layout_.code_size;
+        data.norm_codes = layout_.norm_code_size ? ptr : nullptr;
+        ptr += n * layout_.norm_code_size;
+        data.refine_codes = layout_.refine_code_size ? ptr : nullptr;
+        return data;
+    }
+
+    size_t TieredListStore::cached_bytes() const
+    {
+        std::lock_guard<std::mutex> lock(guard_);
+        return used_bytes_;
+    }
+
+    TieredListStore::Stats TieredListStore::stats() const
+    {
+        Stats stats;
+        stats.nlookups = nlookups_;
+        stats.nhits = nhits_;
+        stats.nreads = nreads_;
+        stats.nread_bytes = nread_bytes_;
+        stats.nwaits = nwaits_;
+        stats.wait_us = wait_us_;
+        return stats;
+    }
+
+    void TieredListStore::reset_stats()
+    {
+        nlookups_ = 0;
+        nhits_ = 0;
+        nreads_ = 0;
+        nread_bytes_ = 0;
+        nwaits_ = 0;
+        wait_us_ = 0;
+    }
+
+    void TieredListStore::report_stats(std::ostream &out, size_t nqueries) const
+    {
+        const Stats stats = this->stats();
+        nqueries = std::max<size_t>(1, nqueries);
+        out << "Tiered lists: hit rate " << 100. * stats.nhits / std::max<size_t>(1, stats.nlookups) << "%, "
+            << 1. * stats.nreads / nqueries << " reads (" << stats.nread_bytes / nqueries / 1024. << " KB) and "
+            << 1. * stats.wait_us / nqueries << " us of I/O wait per query, "
+            << (cached_bytes() >> 20) << " MB cached" << std::endl;
+    }
+}
@@ -0,0 +1,192 @@
+#ifndef IVF_HNSW_LIB_TIEREDLISTSTORE_H
+#define IVF_HNSW_LIB_TIEREDLISTSTORE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Label.h"
+
+namespace ivfhnsw {
+    /// Data of an inverted list of <size> entries, the arrays which are not stored are nullptr
+    struct ListData {
+        size_t size;                  ///< Number of entries, with the gaps of the sub-groups
+        const label_t *ids;           ///< Ids of the entries
+        const uint8_t *codes;         ///< Residual codes of the entries
+        const uint8_t *norm_codes;    ///< Norm codes of the entries
+        const uint8_t *refine_codes;  ///< Refinement codes of the entries
+    };
+
+    /// Sizes of the arrays of one list entry in bytes, 0 - the array is not stored
+    struct ListLayout {
+        size_t id_size;
+        size_t code_size;
+        size_t norm_code_size;
+        size_t refine_code_size;
+
+        size_t entry_size() const { return id_size + code_size + norm_code_size + refine_code_size; }
+    };
+
+    class TieredListStore;
+
+    /// List data pinned in the cache of the store or resident in the index, see TieredListStore::pin
+    class ListPin {
+    public:
+        /// Data resident in the index, never evicted
+        explicit ListPin(const ListData &data): data_(data), npins_(nullptr) {}
+        ListPin(ListPin &&other);
+        ListPin &operator=(ListPin &&other);
+        ~ListPin() { release(); }
+
+        const ListData &operator*() const { return data_; }
+        const ListData *operator->() const { return &data_; }
+
+    private:
+        friend class TieredListStore;
+        ListData data_;
+        std::atomic<size_t> *npins_;  ///< Pin count of the cached list, nullptr for resident data
+
+        ListPin(std::atomic<size_t> *npins, const ListData &data): data_(data), npins_(npins) {}
+        void release();
+
+        ListPin(const ListPin &);
+        ListPin &operator=(const ListPin &);
+    };
+
+    /** Inverted lists in a file on local NVMe with a bounded RAM cache of the hot lists
+      *
+      * Probes are heavily skewed to a small part of the lists, so only the hot ones need to be resident.
+      * Each list is one record of the file aligned to 4 KB: the ids, codes, norm codes
+      * and refinement codes of all its entries. The file is read with O_DIRECT where supported,
+      * so cold lists do not fill up the page cache next to the cache of the store.
+      *
+      * The cache is bounded by <cache_bytes> and evicts the lists with CLOCK. A search calls prefetch
+      * for the probed lists as soon as the coarse search returns: the missing lists are read by a pool
+      * of I/O threads with pread while the query computes the sub-centroid distances and scans
+      * the lists that are already cached. pin waits for the list and keeps it from eviction
+      * until the pin is released. If all cached lists are pinned, the cache exceeds its bound
+      * rather than blocking the search. A query pins each of its lists once.
+      *
+      * Errors of reading the file are reported with std::runtime_error.
+    */
+    class TieredListStore {
+    public:
+        /// Counters since the last reset_stats
+        struct Stats {
+            size_t nlookups;       ///< Prefetches of non-empty lists, one per query and probed list
+            size_t nhits;          ///< Prefetches of lists which were cached or being read already
+            size_t nreads;         ///< Lists read from the file, including the prefetched ones
+            size_t nread_bytes;    ///< Bytes read from the file
+            size_t nwaits;         ///< Pins which waited for a read
+            size_t wait_us;        ///< Total time the pins waited for reads
+        };
+
+        /** Write the lists to a file
+          *
+          * The file is written to <path>.tmp and renamed over <path>, so the stores opened on the previous file
+          * keep reading it.
+          *
+          * @param generation  generation of the lists, changed by the index whenever its lists change
+          * @param layout      entry layout of the lists
+          * @param nlists      number of lists
+          * @param get_list    data of the list by its number
+        */
+        static void write(const char *path, uint64_t generation, const ListLayout &layout, size_t nlists,
+                          const std::function<ListData(size_t)> &get_list);
+
+        /// Whether <path> is a complete list file of the generation with the entry layout and the list sizes
+        static bool matches(const char *path, uint64_t generation, const ListLayout &layout,
+                            const std::vector<size_t> &sizes);
+
+        /** Open the lists written by write
+          *
+          * @param layout       expected entry layout, must match the file
+          * @param cache_bytes  max size of the cached lists
+          * @param nthreads     number of I/O threads
+        */
+        TieredListStore(const char *path, const ListLayout &layout, size_t cache_bytes, size_t nthreads);
+        ~TieredListStore();
+
+        size_t nlists() const { return sizes_.size(); }
+        size_t list_size(size_t list_no) const { return sizes_[list_no]; }
+
+        /// Start reading the list if it is not cached, does not block. Counted in the stats as a lookup of a query
+        void prefetch(size_t list_no);
+
+        /** Wait for the list to be cached and keep it in the cache until the pin is released
+          *
+          * A failed read is retried by the I/O thread, then the pin throws std::runtime_error
+          * and the next pin of the list reads it again.
+        */
+        ListPin pin(size_t list_no);
+
+        /// Size of the cached lists in bytes
+        size_t cached_bytes() const;
+
+        Stats stats() const;
+        void reset_stats();
+
+        /// Print the hit rate and the reads and the I/O wait per query
+        void report_stats(std::ostream &out, size_t nqueries) const;
+
+    private:
+        enum EntryState { ENTRY_FREE, ENTRY_LOADING, ENTRY_READY, ENTRY_FAILED };
+
+        /// Cached list
+        struct Entry {
+            size_t list_no;
+            uint8_t *buffer;    ///< Record of the list, aligned for O_DIRECT
+            size_t nbytes;      ///< Size of the buffer
+            EntryState state;
+            std::atomic<size_t> npins;  ///< Taken under the guard, released by the pins without it
+            bool referenced;            ///< CLOCK bit, set by the lookups
+        };
+
+        std::string path_;
+        ListLayout layout_;
+        int fd_;
+        std::vector<uint64_t> offsets_;   ///< Offset of each list record in the file
+        std::vector<uint32_t> sizes_;     ///< Number of entries of each list
+
+        size_t cache_bytes_;
+        size_t used_bytes_;
+        std::vector<std::unique_ptr<Entry> > entries_;  ///< Slots of the cached lists
+        std::vector<size_t> free_slots_;
+        std::vector<int64_t> slot_of_list_;             ///< -1 - the list is not cached
+        size_t clock_hand_;
+        mutable std::mutex guard_;                      ///< Guards the cache and the read queue
+        std::condition_variable loaded_cv_;
+
+        std::deque<size_t> read_queue_;                 ///< Slots waiting for a read
+        std::condition_variable read_cv_;
+        std::vector<std::thread> io_threads_;
+        bool stopping_;
+
+        std::atomic<size_t> nlookups_, nhits_, nreads_, nread_bytes_, nwaits_, wait_us_;
+
+        /// Size of the list record in the file
+        size_t record_size(size_t list_no) const;
+
+        /// Slot of the list, a read is queued if it is not cached, nullptr if the cache is full and <may_exceed> is false
+        Entry *lookup(size_t list_no, bool may_exceed, bool &hit, size_t &slot);
+
+        /// Evict unpinned lists with CLOCK until <nbytes> more fit in the cache, false if they do not
+        bool evict(size_t nbytes);
+
+        void read_lists();
+        ListData list_data(const Entry &entry) const;
+
+        TieredListStore(const TieredListStore &);
+        TieredListStore &operator=(const TieredListStore &);
+    };
+}
+#endif //IVF_HNSW_LIB_TIEREDLISTSTORE_H
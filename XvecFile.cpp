@@ -0,0 +1,87 @@
+#include "XvecFile.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <x86intrin.h>
+
+namespace ivfhnsw {
+
+    void convert_to_floats(const uint8_t *x, size_t n, float *out)
+    {
+        size_t i = 0;
+#ifdef __AVX2__
+        for (; i + 16 <= n; i += 16) {
+            const __m128i bytes = _mm_loadu_si128((const __m128i *) (x + i));
+            const __m256 lo = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(bytes));
+            const __m256 hi = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_srli_si128(bytes, 8)));
+            _mm256_storeu_ps(out + i, lo);
+            _mm256_storeu_ps(out + i + 8, hi);
+        }
+#endif
+        for (; i < n; i++)
+            out[i] = x[i];
+    }
+
+    XvecFile::XvecFile(const char *path, size_t elem_size):
+            path_(path), elem_size_(elem_size), d_(0), n_(0), stride_(0), mapped_(nullptr), mapped_size_(0)
+    {
+        int fd = open(path, O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            if (fd >= 0)
+                close(fd);
+            throw std::runtime_error("Failed to open " + path_);
+        }
+        mapped_size_ = st.st_size;
+        void *mapped = (mapped_size_ == 0) ? MAP_FAILED : mmap(nullptr, mapped_size_, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mapped == MAP_FAILED)
+            throw std::runtime_error("Failed to mmap " + path_);
+        mapped_ = (char *) mapped;
+        // Datasets are mostly streamed, let the kernel read ahead aggressively
+        madvise(mapped_, mapped_size_, MADV_SEQUENTIAL);
+
+        d_ = *(const uint32_t *) mapped_;
+        stride_ = sizeof(uint32_t) + d_ * elem_size_;
+        n_ = mapped_size_ / stride_;
+        if (d_ == 0 || mapped_size_ % stride_ != 0) {
+            munmap(mapped_, mapped_size_);
+            throw std::runtime_error(path_ + ": file size " + std::to_string(mapped_size_) +
+                                     " is not a multiple of the row size " + std::to_string(stride_));
+        }
+    }
+
+    XvecFile::~XvecFile()
+    {
+        munmap(mapped_, mapped_size_);
+    }
+
+    void XvecFile::check(size_t d, size_t n) const
+    {
+        if (d_ != d)
+            throw std::runtime_error(path_ + ": dimension " + std::to_string(d_) + ", expected " + std::to_string(d));
+        if (n_ < n)
+            throw std::runtime_error(path_ + ": " + std::to_string(n_) + " rows, expected at least " + std::to_string(n));
+    }
+
+    void XvecFile::check_elem_size(size_t elem_size) const
+    {
+        if (elem_size != elem_size_)
+            throw std::runtime_error(path_ + ": element size " + std::to_string(elem_size_) +
+                                     ", requested " + std::to_string(elem_size));
+    }
+
+    void XvecFile::check_range(size_t begin, size_t n) const
+    {
+        if (begin > n_ || n > n_ - begin)
+            throw std::runtime_error(path_ + ": rows [" + std::to_string(begin) + ", " + std::to_string(begin + n) +
+                                     ") out of " + std::to_string(n_));
+    }
+
+    void XvecFile::validate_rows(size_t begin, size_t n) const
+    {
+        for_rows(begin, n, [](size_t) {});
+    }
+}
@@ -0,0 +1,135 @@
+#ifndef IVF_HNSW_LIB_XVECFILE_H
+#define IVF_HNSW_LIB_XVECFILE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <stdexcept>
+
+namespace ivfhnsw {
+    /// Rows of an xvec file in place: row i starts at data + i * stride
+    template<typename T>
+    struct XvecView {
+        const T *data;   ///< Elements of the first row
+        size_t d;        ///< Row dimension
+        size_t stride;   ///< Distance between consecutive rows in elements
+        size_t n;        ///< Number of rows
+
+        const T *operator[](size_t i) const { return data + i * stride; }
+    };
+
+    /// Convert <n> elements to floats
+    template<typename T>
+    void convert_to_floats(const T *x, size_t n, float *out)
+    {
+        for (size_t i = 0; i < n; i++)
+            out[i] = 1. * x[i];
+    }
+
+    inline void convert_to_floats(const float *x, size_t n, float *out)
+    {
+        memcpy(out, x, n * sizeof(float));
+    }
+
+    /// Convert <n> bytes to floats, 16 at a time with AVX2
+    void convert_to_floats(const uint8_t *x, size_t n, float *out);
+
+    /** Read-only memory mapped fvecs/ivecs/bvecs file
+      *
+      * Each row is a 4-byte dimension followed by d elements. Opening the file takes O(1):
+      * the file is mapped and its size is checked against the row stride. The dimension
+      * headers of the rows are validated in parallel by view, read and read_floats,
+      * i.e. while their pages are being touched anyway, so a dataset is never scanned twice.
+      *
+      * Rows are accessed in place with view; read and read_floats copy or convert
+      * them in parallel chunks to contiguous arrays for the batch interfaces of the index.
+      * Errors are reported with std::runtime_error.
+    */
+    class XvecFile {
+    public:
+        /// Map the file with elements of <elem_size> bytes
+        XvecFile(const char *path, size_t elem_size);
+        ~XvecFile();
+
+        size_t dim() const { return d_; }
+        size_t size() const { return n_; }     ///< Number of rows
+
+        /// Check that the rows have dimension d and there are at least n of them
+        void check(size_t d, size_t n) const;
+
+        /// Zero-copy view of the rows [begin, begin + n), their headers are validated
+        template<typename T>
+        XvecView<T> view(size_t begin, size_t n) const
+        {
+            check_elem_size(sizeof(T));
+            validate_rows(begin, n);
+            return XvecView<T>{(const T *) row_data(begin), d_, stride_ / sizeof(T), n};
+        }
+
+        /// Copy the rows [begin, begin + n) to the contiguous array <out>, size n * dim()
+        template<typename T>
+        void read(size_t begin, size_t n, T *out) const
+        {
+            check_elem_size(sizeof(T));
+            const size_t row_size = d_ * sizeof(T);
+            for_rows(begin, n, [&](size_t i) {
+                memcpy(out + (i - begin) * d_, row_data(i), row_size);
+            });
+        }
+
+        /// Convert the rows [begin, begin + n) of elements of type T to floats, size n * dim()
+        template<typename T>
+        void read_floats(size_t begin, size_t n, float *out) const
+        {
+            check_elem_size(sizeof(T));
+            for_rows(begin, n, [&](size_t i) {
+                convert_to_floats((const T *) row_data(i), d_, out + (i - begin) * d_);
+            });
+        }
+
+    private:
+        std::string path_;
+        size_t elem_size_;
+        size_t d_;            ///< Row dimension
+        size_t n_;            ///< Number of rows
+        size_t stride_;       ///< Row size in bytes with the header
+        char *mapped_;
+        size_t mapped_size_;
+
+        const char *row_data(size_t i) const { return mapped_ + i * stride_ + sizeof(uint32_t); }
+
+        void check_elem_size(size_t elem_size) const;
+        void check_range(size_t begin, size_t n) const;
+
+        /// Validate the headers of the rows [begin, begin + n) in parallel
+        void validate_rows(size_t begin, size_t n) const;
+
+        /// Validate the rows [begin, begin + n) and call process(i) for each row i in parallel chunks
+        template<typename F>
+        void for_rows(size_t begin, size_t n, F process) const
+        {
+            check_range(begin, n);
+            const size_t chunk_size = 4096;
+            size_t nbad = 0;
+#pragma omp parallel for schedule(dynamic) reduction(+:nbad)
+            for (size_t chunk_begin = begin; chunk_begin < begin + n; chunk_begin += chunk_size) {
+                const size_t chunk_end = std::min(begin + n, chunk_begin + chunk_size);
+                for (size_t i = chunk_begin; i < chunk_end; i++) {
+                    if (*(const uint32_t *) (mapped_ + i * stride_) != d_) {
+                        nbad++;
+                        continue;
+                    }
+                    process(i);
+                }
+            }
+            if (nbad > 0)
+                throw std::runtime_error(path_ + ": " + std::to_string(nbad) + " rows with a wrong dimension");
+        }
+
+        XvecFile(const XvecFile &);
+        XvecFile &operator=(const XvecFile &);
+    };
+}
+#endif //IVF_HNSW_LIB_XVECFILE_H
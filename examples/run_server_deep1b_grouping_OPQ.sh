@@ -0,0 +1,88 @@
+#!/bin/bash
+
+################################
+# HNSW construction parameters #
+################################
+
+M="16"                # Min number of edges per point
+efConstruction="500"  # Max number of candidate vertices in priority queue to observe during construction
+
+###################
+# Data parameters #
+###################
+
+nc="999973"           # Number of centroids for HNSW quantizer
+nsubc="64"            # Number of subcentroids per group
+
+d="96"                # Vector dimension
+
+#################
+# PQ parameters #
+#################
+
+code_size="16"        # Code size per vector in bytes
+opq="on"              # Turn on/off opq encoding
+
+#####################
+# Search parameters #
+#####################
+
+nprobe="210"           # Number of probes at query time
+max_codes="100000"     # Max number of codes to visit to do a query
+efSearch="210"         # Max number of candidate vertices in priority queue to observe during seaching
+pruning="on"           # Turn on/off pruning
+
+#####################
+# Server parameters #
+#####################
+
+max_batch="64"         # Max number of queries in a micro-batch
+deadline_us="1000"     # Max time in microseconds a query waits for its micro-batch to fill up
+nworkers="0"           # Number of pinned search worker threads, 0 - one per core
+
+#########
+# Paths #
+#########
+
+path_data="${PWD}/data/DEEP1B"
+path_model="${PWD}/models/DEEP1B"
+
+path_centroids="${path_data}/centroids_deep1b.fvecs"
+
+path_edges="${path_model}/hnsw_M${M}_ef${efConstruction}.ivecs"
+path_info="${path_model}/hnsw_M${M}_ef${efConstruction}.bin"
+
+path_pq="${path_model}/pq${code_size}_nsubc${nsubc}.opq"
+path_norm_pq="${path_model}/norm_pq${code_size}_nsubc${nsubc}.opq"
+path_opq_matrix="${path_model}/matrix_pq${code_size}_nsubc${nsubc}.opq"
+
+path_index="${path_model}/ivfhnsw_OPQ${code_size}_nsubc${nsubc}.index"
+
+path_socket="/tmp/ivfhnsw_deep1b.sock"
+
+#######
+# Run #
+#######
+${PWD}/bin/ivfhnsw_server \
+                                -M ${M} \
+                                -efConstruction ${efConstruction} \
+                                -nc ${nc} \
+                                -nsubc ${nsubc} \
+                                -d ${d} \
+                                -code_size ${code_size} \
+                                -opq ${opq} \
+                                -nprobe ${nprobe} \
+                                -max_codes ${max_codes} \
+                                -efSearch ${efSearch} \
+                                -path_centroids ${path_centroids} \
+                                -path_edges ${path_edges} \
+                                -path_info ${path_info} \
+                                -path_pq ${path_pq} \
+                                -path_norm_pq ${path_norm_pq} \
+                                -path_opq_matrix ${path_opq_matrix} \
+                                -path_index ${path_index} \
+                                -pruning ${pruning} \
+                                -max_batch ${max_batch} \
+                                -deadline_us ${deadline_us} \
+                                -nworkers ${nworkers} \
+                                -path_socket ${path_socket}
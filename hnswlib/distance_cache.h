@@ -0,0 +1,107 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace hnswlib {
+
+    typedef uint32_t idx_t;
+
+    /** Distances from one query to graph nodes, computed during the search
+      *
+      * A sparse open-addressing hash table keyed by internal ids, sized to the nodes one search touches
+      * rather than to the whole graph. An entry is valid only if its tag equals the current epoch,
+      * so starting the next query takes O(1) instead of clearing the table.
+      * The table grows if a query touches more nodes than expected. Call reset before each query.
+      * Not thread-safe, use one cache per thread.
+    */
+    class DistanceCache {
+    public:
+        DistanceCache(): shift_(64), size_(0), epoch_(0) {}
+
+        /// Invalidate all entries and make room for about <n> nodes without growing
+        void reset(size_t n)
+        {
+            if (2 * n > entries_.size())
+                allocate(2 * n);
+            size_ = 0;
+            epoch_++;
+            if (epoch_ == 0) {
+                memset(entries_.data(), 0, entries_.size() * sizeof(Entry));
+                epoch_++;
+            }
+        }
+
+        inline void insert(idx_t id, float dist)
+        {
+            if (2 * (size_ + 1) > entries_.size())
+                grow();
+            Entry &entry = entries_[probe(id)];
+            if (entry.epoch != epoch_) {
+                entry.epoch = epoch_;
+                entry.id = id;
+                size_++;
+            }
+            entry.dist = dist;
+        }
+
+        /// Return true and set <dist> if the distance to the node is cached
+        inline bool find(idx_t id, float &dist) const
+        {
+            if (entries_.empty())
+                return false;
+            const Entry &entry = entries_[probe(id)];
+            if (entry.epoch != epoch_)
+                return false;
+            dist = entry.dist;
+            return true;
+        }
+
+    private:
+        struct Entry {
+            uint32_t epoch;
+            idx_t id;
+            float dist;
+        };
+        std::vector<Entry> entries_;  ///< Power of two slots, at most half of them used
+        size_t shift_;                ///< 64 - log2 of the number of slots
+        size_t size_;                 ///< Entries of the current epoch
+        uint32_t epoch_;
+
+        /// Slot of the node or the empty slot where it goes, with linear probing
+        inline size_t probe(idx_t id) const
+        {
+            const size_t mask = entries_.size() - 1;
+            size_t slot = (id * 0x9E3779B97F4A7C15ull) >> shift_;
+            while (entries_[slot].epoch == epoch_ && entries_[slot].id != id)
+                slot = (slot + 1) & mask;
+            return slot;
+        }
+
+        /// Drop all entries and make at least <nslots> slots
+        void allocate(size_t nslots)
+        {
+            size_t capacity = 16;
+            shift_ = 60;
+            while (capacity < nslots) {
+                capacity *= 2;
+                shift_--;
+            }
+            entries_.assign(capacity, Entry{0, 0, 0});
+            epoch_ = 0;
+        }
+
+        /// Double the table keeping the entries of the current epoch
+        void grow()
+        {
+            std::vector<Entry> old;
+            old.swap(entries_);
+            const uint32_t epoch = epoch_;
+            allocate(2 * old.size());
+            epoch_ = epoch;
+            for (const Entry &entry : old)
+                if (entry.epoch == epoch_)
+                    entries_[probe(entry.id)] = entry;
+        }
+    };
+}
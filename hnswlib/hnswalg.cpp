@@ -6,11 +6,18 @@ namespace hnswlib {
                                      const std::string &dataLocation,
                                      const std::string &edgeLocation)
     {
+        inner_product_ = false;
         LoadInfo(infoLocation);
         LoadData(dataLocation);
         LoadEdges(edgeLocation);
     }
 
+    HierarchicalNSW::HierarchicalNSW(const std::string &snapshotLocation, bool do_mmap)
+    {
+        inner_product_ = false;
+        LoadSnapshot(snapshotLocation, do_mmap);
+    }
+
     HierarchicalNSW::HierarchicalNSW(size_t d, size_t maxelements, size_t M, size_t maxM, size_t efConstruction)
 {
     d_ = d;
@@ -18,6 +25,7 @@ namespace hnswlib {
 
     efConstruction_ = efConstruction;
     efSearch = efConstruction;
+    inner_product_ = false;
 
     maxelements_ = maxelements;
     M_ = M;
@@ -26,9 +34,9 @@ namespace hnswlib {
     size_data_per_element = size_links_level0 + data_size_;
     offset_data = size_links_level0;
 
-    std::cout << (data_level0_memory_ ? 1 : 0) << std::endl;
-    data_level0_memory_ = (char *) malloc(maxelements_ * size_data_per_element);
-    std::cout << (data_level0_memory_ ? 1 : 0) << std::endl;
+    data_level0_memory_ = (char *) hugePageAlloc(maxelements_ * size_data_per_element, "hnsw nodes");
+    mapped_memory_ = nullptr;
+    mapped_size_ = 0;
 
     std::cout << "Size Mb: " << (maxelements_ * size_data_per_element) / (1000 * 1000) << std::endl;
 
@@ -36,25 +44,43 @@ namespace hnswlib {
 
     enterpoint_node = 0;
     cur_element_count = 0;
+    compact_links_ = false;
+    link_id_bytes_ = sizeof(idx_t);
 }
 
 HierarchicalNSW::~HierarchicalNSW()
 {
-    free(data_level0_memory_);
+    releaseNodeMemory();
     delete visitedlistpool;
 }
 
+void HierarchicalNSW::releaseNodeMemory()
+{
+    if (mapped_memory_) {
+        munmap(mapped_memory_, mapped_size_);
+        mapped_memory_ = nullptr;
+        mapped_size_ = 0;
+    } else
+        hugePageFree(data_level0_memory_);
+    data_level0_memory_ = nullptr;
+}
+
 
-std::priority_queue<std::pair<float, idx_t>> HierarchicalNSW::searchBaseLayer(const float *point, size_t ef)
+std::priority_queue<std::pair<float, idx_t>> HierarchicalNSW::searchBaseLayer(const float *point, size_t ef,
+                                                                            DistanceCache *cache)
 {
     VisitedList *vl = visitedlistpool->getFreeVisitedList();
     vl_type *massVisited = vl->mass;
     vl_type currentV = vl->curV;
     std::priority_queue<std::pair<float, idx_t >> topResults;
     std::priority_queue<std::pair<float, idx_t >> candidateSet;
+    thread_local std::vector<idx_t> links_buffer;
+    links_buffer.resize(maxM_ + 1);
 
     float dist = fstdistfunc(point, getDataByInternalId(enterpoint_node));
     dist_calc++;
+    if (cache)
+        cache->insert(enterpoint_node, dist);
 
     topResults.emplace(dist, enterpoint_node);
     candidateSet.emplace(-dist, enterpoint_node);
@@ -70,9 +96,8 @@ std::priority_queue<std::pair<float, idx_t>> HierarchicalNSW::searchBaseLayer(co
         candidateSet.pop();
         idx_t curNodeNum = curr_el_pair.second;
 
-        uint8_t *ll_cur = get_linklist0(curNodeNum);
-        size_t size = *ll_cur;
-        idx_t *data = (idx_t *)(ll_cur + 1);
+        const idx_t *data;
+        size_t size = getLinks(curNodeNum, data, links_buffer.data());
 
         _mm_prefetch((char *) (massVisited + *data), _MM_HINT_T0);
         _mm_prefetch((char *) (massVisited + *data + 64), _MM_HINT_T0);
@@ -89,11 +114,13 @@ std::priority_queue<std::pair<float, idx_t>> HierarchicalNSW::searchBaseLayer(co
 
                 float dist = fstdistfunc(point, getDataByInternalId(tnum));
                 dist_calc++;
+                if (cache)
+                    cache->insert(tnum, dist);
 
                 if (topResults.top().first > dist || topResults.size() < ef) {
                     candidateSet.emplace(-dist, tnum);
 
-                    _mm_prefetch(get_linklist0(candidateSet.top().second), _MM_HINT_T0);
+                    prefetchLinks(candidateSet.top().second);
                     topResults.emplace(dist, tnum);
 
                     if (topResults.size() > ef)
@@ -109,6 +136,144 @@ std::priority_queue<std::pair<float, idx_t>> HierarchicalNSW::searchBaseLayer(co
 }
 
 
+/**
+ * Interleaved traversal of the base layer
+ *
+ * A step of the traversal for a single query is a chain of dependent cache misses:
+ * the link list of the candidate, the visited marks of its neighbors and the vectors of the unvisited neighbors.
+ * Here every step is split into stages, and each stage is done for all active queries of the group
+ * before the next stage starts:
+ *   1) pop the closest candidate and prefetch its link list,
+ *   2) prefetch the visited marks of its neighbors,
+ *   3) mark unvisited neighbors and prefetch their vectors,
+ *   4) compute distances to the unvisited neighbors and update the heaps.
+ * While a query waits for its prefetched lines, the other queries of the group do useful work.
+ */
+void HierarchicalNSW::searchBaseLayerInterleaved(const float *x, size_t nx, size_t ef,
+                                                 std::priority_queue<std::pair<float, idx_t>> *results,
+                                                 DistanceCache *caches)
+{
+    struct QueryState {
+        const float *point;
+        VisitedList *vl;
+        std::priority_queue<std::pair<float, idx_t>> candidateSet;
+        float lowerBound;
+        bool active;
+        idx_t curNodeNum;         // current candidate
+        size_t size;              // number of links of the current candidate
+        const idx_t *data;        // links of the current candidate
+        std::vector<idx_t> links; // buffer for decoded links
+        size_t nunvisited;        // number of unvisited neighbors of the current candidate
+        std::vector<idx_t> unvisited;
+    };
+    std::vector<QueryState> states(nx);
+    const size_t nlines = (data_size_ + 63) / 64;
+
+    for (size_t q = 0; q < nx; q++) {
+        QueryState &state = states[q];
+        std::priority_queue<std::pair<float, idx_t>> &topResults = results[q];
+        while (!topResults.empty())
+            topResults.pop();
+
+        state.point = x + q * d_;
+        state.vl = visitedlistpool->getFreeVisitedList();
+        state.unvisited.resize(maxM_);
+        state.links.resize(maxM_ + 1);
+
+        float dist = fstdistfunc(state.point, getDataByInternalId(enterpoint_node));
+        dist_calc++;
+        if (caches)
+            caches[q].insert(enterpoint_node, dist);
+
+        topResults.emplace(dist, enterpoint_node);
+        state.candidateSet.emplace(-dist, enterpoint_node);
+        state.vl->mass[enterpoint_node] = state.vl->curV;
+        state.lowerBound = dist;
+        state.active = true;
+    }
+
+    size_t nactive = nx;
+    while (nactive > 0) {
+        // Stage 1: pop the closest candidate and prefetch its link list
+        for (size_t q = 0; q < nx; q++) {
+            QueryState &state = states[q];
+            if (!state.active)
+                continue;
+
+            if (state.candidateSet.empty() || -state.candidateSet.top().first > state.lowerBound) {
+                state.active = false;
+                visitedlistpool->releaseVisitedList(state.vl);
+                nactive--;
+                continue;
+            }
+            state.curNodeNum = state.candidateSet.top().second;
+            state.candidateSet.pop();
+            prefetchLinks(state.curNodeNum);
+        }
+
+        // Stage 2: prefetch visited marks of the neighbors
+        for (size_t q = 0; q < nx; q++) {
+            QueryState &state = states[q];
+            if (!state.active)
+                continue;
+
+            state.size = getLinks(state.curNodeNum, state.data, state.links.data());
+            vl_type *massVisited = state.vl->mass;
+            for (size_t j = 0; j < state.size; j++)
+                _mm_prefetch((char *) (massVisited + state.data[j]), _MM_HINT_T0);
+        }
+
+        // Stage 3: mark unvisited neighbors and prefetch their vectors
+        for (size_t q = 0; q < nx; q++) {
+            QueryState &state = states[q];
+            if (!state.active)
+                continue;
+
+            vl_type *massVisited = state.vl->mass;
+            vl_type currentV = state.vl->curV;
+            state.nunvisited = 0;
+            for (size_t j = 0; j < state.size; j++) {
+                idx_t tnum = state.data[j];
+                if (massVisited[tnum] == currentV)
+                    continue;
+                massVisited[tnum] = currentV;
+                state.unvisited[state.nunvisited++] = tnum;
+
+                const char *vec = (const char *) getDataByInternalId(tnum);
+                for (size_t line = 0; line < nlines; line++)
+                    _mm_prefetch(vec + 64 * line, _MM_HINT_T0);
+            }
+        }
+
+        // Stage 4: compute distances and update heaps
+        for (size_t q = 0; q < nx; q++) {
+            QueryState &state = states[q];
+            if (!state.active)
+                continue;
+
+            std::priority_queue<std::pair<float, idx_t>> &topResults = results[q];
+            for (size_t j = 0; j < state.nunvisited; j++) {
+                idx_t tnum = state.unvisited[j];
+                float dist = fstdistfunc(state.point, getDataByInternalId(tnum));
+                dist_calc++;
+                if (caches)
+                    caches[q].insert(tnum, dist);
+
+                if (topResults.top().first > dist || topResults.size() < ef) {
+                    state.candidateSet.emplace(-dist, tnum);
+                    topResults.emplace(dist, tnum);
+
+                    if (topResults.size() > ef)
+                        topResults.pop();
+
+                    state.lowerBound = topResults.top().first;
+                }
+            }
+        }
+    }
+}
+
+
 void HierarchicalNSW::getNeighborsByHeuristic(std::priority_queue<std::pair<float, idx_t>> &topResults, size_t NN)
 {
     if (topResults.size() < NN)
@@ -209,11 +374,18 @@ void HierarchicalNSW::mutuallyConnectNewElement(const float *point, idx_t cur_c,
 
 void HierarchicalNSW::addPoint(const float *point)
 {
+    if (compact_links_)
+        throw std::runtime_error("Points can not be added to the graph with compact links");
     if (cur_element_count >= maxelements_) {
         std::cout << "The number of elements exceeds the specified limit\n";
         throw std::runtime_error("The number of elements exceeds the specified limit");
     }
     idx_t cur_c = cur_element_count++;
+    // Nodes added after reordering keep their ids
+    if (!external_ids_.empty()) {
+        external_ids_.push_back(cur_c);
+        internal_ids_.push_back(cur_c);
+    }
     memset((char *) get_linklist0(cur_c), 0, size_data_per_element);
     memcpy(getDataByInternalId(cur_c), point, data_size_);
 
@@ -224,28 +396,230 @@ void HierarchicalNSW::addPoint(const float *point)
     }
 };
 
-std::priority_queue<std::pair<float, idx_t>> HierarchicalNSW::searchKnn(const float *query, size_t k)
+void HierarchicalNSW::resizeIndex(size_t new_maxelements)
+{
+    if (compact_links_)
+        throw std::runtime_error("The graph with compact links can not be resized");
+    if (new_maxelements < cur_element_count)
+        throw std::runtime_error("The graph can not be resized below the number of elements");
+
+    char *new_memory = (char *) hugePageAlloc(new_maxelements * size_data_per_element, "hnsw nodes");
+    memcpy(new_memory, data_level0_memory_, cur_element_count * size_data_per_element);
+    releaseNodeMemory();
+    data_level0_memory_ = new_memory;
+    maxelements_ = new_maxelements;
+
+    // Visited lists are sized by the number of nodes
+    delete visitedlistpool;
+    visitedlistpool = new VisitedListPool(1, maxelements_);
+}
+
+std::priority_queue<std::pair<float, idx_t>> HierarchicalNSW::searchKnn(const float *query, size_t k, DistanceCache *cache)
 {
-    auto topResults = searchBaseLayer(query, std::max(efSearch,k));
+    auto topResults = searchBaseLayer(query, std::max(efSearch,k), cache);
     while (topResults.size() > k)
         topResults.pop();
 
+    toExternalLabels(topResults);
     return topResults;
 };
 
+void HierarchicalNSW::searchKnnInterleaved(const float *x, size_t n, size_t k,
+                                           std::priority_queue<std::pair<float, idx_t>> *results, size_t interleave,
+                                           DistanceCache *caches)
+{
+    interleave = std::max<size_t>(interleave, 1);
+    for (size_t i = 0; i < n; i += interleave) {
+        const size_t nx = std::min(interleave, n - i);
+        searchBaseLayerInterleaved(x + i * d_, nx, std::max(efSearch, k), results + i, caches ? caches + i : nullptr);
+        for (size_t q = i; q < i + nx; q++) {
+            while (results[q].size() > k)
+                results[q].pop();
+            toExternalLabels(results[q]);
+        }
+    }
+}
+
+void HierarchicalNSW::toExternalLabels(std::priority_queue<std::pair<float, idx_t>> &topResults) const
+{
+    if (external_ids_.empty())
+        return;
+
+    std::vector<std::pair<float, idx_t>> buffer;
+    buffer.reserve(topResults.size());
+    while (!topResults.empty()) {
+        buffer.emplace_back(topResults.top().first, external_ids_[topResults.top().second]);
+        topResults.pop();
+    }
+    for (const std::pair<float, idx_t> &result : buffer)
+        topResults.push(result);
+}
+
+/**
+ * Nodes are renumbered in the BFS order starting from the enter point,
+ * nodes unreachable from it are appended in their current order.
+ * Thus the neighbors of a node mostly get close ids, and the graph walk touches fewer pages and cache lines.
+ */
+void HierarchicalNSW::reorderNodes()
+{
+    if (compact_links_)
+        throw std::runtime_error("Nodes can not be reordered in the graph with compact links");
+    std::cout << "Reordering " << cur_element_count << " nodes" << std::endl;
+
+    // BFS order: new_ids[old internal id] -> new internal id
+    const idx_t no_id = std::numeric_limits<idx_t>::max();
+    std::vector<idx_t> new_ids(cur_element_count, no_id);
+    std::vector<idx_t> order;
+    order.reserve(cur_element_count);
+
+    for (size_t root = 0; root < cur_element_count; root++) {
+        idx_t start = (root == 0) ? enterpoint_node : (idx_t) root;
+        if (new_ids[start] != no_id)
+            continue;
+
+        new_ids[start] = order.size();
+        order.push_back(start);
+        for (size_t head = order.size() - 1; head < order.size(); head++) {
+            uint8_t *ll_cur = get_linklist0(order[head]);
+            size_t size = *ll_cur;
+            idx_t *data = (idx_t *)(ll_cur + 1);
+            for (size_t j = 0; j < size; j++) {
+                if (new_ids[data[j]] != no_id)
+                    continue;
+                new_ids[data[j]] = order.size();
+                order.push_back(data[j]);
+            }
+        }
+    }
+
+    // Move nodes to their new positions and rewrite links
+    char *reordered_memory = (char *) hugePageAlloc(maxelements_ * size_data_per_element, "hnsw nodes");
+    if (!reordered_memory)
+        throw std::runtime_error("Not enough memory to reorder nodes");
+
+    for (size_t new_id = 0; new_id < cur_element_count; new_id++) {
+        char *node = reordered_memory + new_id * size_data_per_element;
+        memcpy(node, get_linklist0(order[new_id]), size_data_per_element);
+
+        uint8_t *ll_cur = (uint8_t *) node;
+        size_t size = *ll_cur;
+        idx_t *data = (idx_t *)(ll_cur + 1);
+        for (size_t j = 0; j < size; j++)
+            data[j] = new_ids[data[j]];
+    }
+    releaseNodeMemory();
+    data_level0_memory_ = reordered_memory;
+    enterpoint_node = new_ids[enterpoint_node];
+
+    // Compose with the previous order
+    std::vector<idx_t> external_ids(cur_element_count);
+    for (size_t new_id = 0; new_id < cur_element_count; new_id++)
+        external_ids[new_id] = getExternalLabel(order[new_id]);
+
+    external_ids_.swap(external_ids);
+    internal_ids_.resize(cur_element_count);
+    for (size_t new_id = 0; new_id < cur_element_count; new_id++)
+        internal_ids_[external_ids_[new_id]] = new_id;
+}
+
+void HierarchicalNSW::compactLinks()
+{
+    if (compact_links_)
+        return;
+
+    if (maxelements_ <= (1 << 16))
+        link_id_bytes_ = 2;
+    else if (maxelements_ <= (1 << 24))
+        link_id_bytes_ = 3;
+    else
+        link_id_bytes_ = 4;
+
+    size_t nlinks = 0;
+    for (size_t i = 0; i < cur_element_count; i++)
+        nlinks += *get_linklist0(i);
+    if (nlinks > std::numeric_limits<uint32_t>::max())
+        throw std::runtime_error("Too many links for the compact storage");
+
+    // Pack links. The padding lets SIMD decoders load 16 bytes past the last link
+    link_offsets_.resize(maxelements_ + 1);
+    link_data_.resize(nlinks * link_id_bytes_ + 16);
+    size_t offset = 0;
+    for (size_t i = 0; i < maxelements_; i++) {
+        link_offsets_[i] = offset;
+        if (i >= cur_element_count)
+            continue;
+
+        uint8_t *ll_cur = get_linklist0(i);
+        size_t size = *ll_cur;
+        idx_t *data = (idx_t *)(ll_cur + 1);
+        for (size_t j = 0; j < size; j++, offset++)
+            memcpy(link_data_.data() + offset * link_id_bytes_, data + j, link_id_bytes_);
+    }
+    link_offsets_[maxelements_] = offset;
+
+    // Keep only vectors in the node array
+    char *vectors_memory = (char *) hugePageAlloc(maxelements_ * data_size_, "hnsw nodes");
+    if (!vectors_memory)
+        throw std::runtime_error("Not enough memory to compact links");
+    for (size_t i = 0; i < cur_element_count; i++)
+        memcpy(vectors_memory + i * data_size_, getDataByInternalId(i), data_size_);
+
+    releaseNodeMemory();
+    data_level0_memory_ = vectors_memory;
+    size_data_per_element = data_size_;
+    offset_data = 0;
+    compact_links_ = true;
+
+    std::cout << "Compacted links: " << link_id_bytes_ * 8 << "-bit ids, "
+              << (link_data_.size() + link_offsets_.size() * sizeof(uint32_t)) / (1000 * 1000) << " Mb instead of "
+              << (maxelements_ * size_links_level0) / (1000 * 1000) << " Mb" << std::endl;
+}
+
+void HierarchicalNSW::decodeLinks16(const uint8_t *packed, size_t size, idx_t *links)
+{
+    size_t j = 0;
+    for (; j + 4 <= size; j += 4) {
+        __m128i packed16 = _mm_loadl_epi64((const __m128i *) (packed + 2 * j));
+        _mm_storeu_si128((__m128i *) (links + j), _mm_cvtepu16_epi32(packed16));
+    }
+    for (; j < size; j++)
+        links[j] = ((const uint16_t *) packed)[j];
+}
+
+void HierarchicalNSW::decodeLinks24(const uint8_t *packed, size_t size, idx_t *links)
+{
+    const __m128i shuffle = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    size_t j = 0;
+    for (; j + 4 <= size; j += 4) {
+        __m128i packed24 = _mm_loadu_si128((const __m128i *) (packed + 3 * j));
+        _mm_storeu_si128((__m128i *) (links + j), _mm_shuffle_epi8(packed24, shuffle));
+    }
+    for (; j < size; j++) {
+        const uint8_t *link = packed + 3 * j;
+        links[j] = link[0] | (link[1] << 8) | (link[2] << 16);
+    }
+}
+
 void HierarchicalNSW::SaveInfo(const std::string &location)
 {
     std::cout << "Saving info to " << location << std::endl;
     std::ofstream output(location, std::ios::binary);
 
-    writeBinaryPOD(output, maxelements_);
+    // Only the added nodes are saved, not the room reserved by resizeIndex
+    writeBinaryPOD(output, cur_element_count);
     writeBinaryPOD(output, enterpoint_node);
     writeBinaryPOD(output, data_size_);
-    writeBinaryPOD(output, offset_data);
-    writeBinaryPOD(output, size_data_per_element);
+    // Compact links are saved in the usual layout
+    writeBinaryPOD(output, compact_links_ ? size_links_level0 : offset_data);
+    writeBinaryPOD(output, compact_links_ ? size_links_level0 + data_size_ : size_data_per_element);
     writeBinaryPOD(output, M_);
     writeBinaryPOD(output, maxM_);
     writeBinaryPOD(output, size_links_level0);
+
+    // External labels of nodes, if they are reordered
+    size_t nlabels = external_ids_.size();
+    writeBinaryPOD(output, nlabels);
+    output.write((char *) external_ids_.data(), nlabels * sizeof(idx_t));
 }
 
 
@@ -254,16 +628,30 @@ void HierarchicalNSW::SaveEdges(const std::string &location)
     std::cout << "Saving edges to " << location << std::endl;
     std::ofstream output(location, std::ios::binary);
 
-    for (size_t i = 0; i < maxelements_; i++) {
-        uint8_t *ll_cur = get_linklist0(i);
-        uint32_t size = *ll_cur;
+    std::vector<idx_t> links_buffer(maxM_ + 1);
+    for (size_t i = 0; i < cur_element_count; i++) {
+        const idx_t *data;
+        uint32_t size = getLinks(i, data, links_buffer.data());
 
         output.write((char *) &size, sizeof(uint32_t));
-        idx_t *data = (idx_t *)(ll_cur + 1);
         output.write((char *) data, sizeof(idx_t) * size);
     }
 }
 
+void HierarchicalNSW::SaveData(const std::string &location)
+{
+    std::cout << "Saving data to " << location << std::endl;
+    std::ofstream output(location, std::ios::binary);
+
+    const uint32_t dim = d_;
+    for (size_t i = 0; i < cur_element_count; i++) {
+        output.write((char *) &dim, sizeof(uint32_t));
+        output.write((char *) getDataByLabel(i), data_size_);
+    }
+    if (!output)
+        throw std::runtime_error("Failed to write HNSW data: " + location);
+}
+
 void HierarchicalNSW::LoadInfo(const std::string &location)
 {
     std::cout << "Loading info from " << location << std::endl;
@@ -277,12 +665,43 @@ void HierarchicalNSW::LoadInfo(const std::string &location)
     readBinaryPOD(input, M_);
     readBinaryPOD(input, maxM_);
     readBinaryPOD(input, size_links_level0);
+    if (!input)
+        throw std::runtime_error("Truncated HNSW info: " + location);
+
+    // External labels of nodes. Info files saved before reordering was introduced end here
+    size_t nlabels = 0;
+    if (input.peek() != EOF) {
+        readBinaryPOD(input, nlabels);
+        if (!input)
+            throw std::runtime_error("Truncated HNSW info: " + location);
+        if (nlabels != 0 && nlabels != maxelements_)
+            throw std::runtime_error("Wrong number of HNSW labels: " + location);
+    }
+    external_ids_.resize(nlabels);
+    input.read((char *) external_ids_.data(), nlabels * sizeof(idx_t));
+    if (!input)
+        throw std::runtime_error("Truncated HNSW info: " + location);
+
+    // The labels must be a permutation of the nodes
+    internal_ids_.resize(nlabels);
+    std::vector<bool> seen(nlabels, false);
+    for (size_t i = 0; i < nlabels; i++) {
+        const size_t label = external_ids_[i];
+        if (label >= nlabels || seen[label])
+            throw std::runtime_error("HNSW labels are not a permutation: " + location);
+        seen[label] = true;
+        internal_ids_[label] = i;
+    }
 
     d_ = data_size_ / sizeof(float);
-    data_level0_memory_ = (char *) malloc(maxelements_ * size_data_per_element);
+    data_level0_memory_ = (char *) hugePageAlloc(maxelements_ * size_data_per_element, "hnsw nodes");
+    mapped_memory_ = nullptr;
+    mapped_size_ = 0;
 
     efConstruction_ = 0;
     cur_element_count = maxelements_;
+    compact_links_ = false;
+    link_id_bytes_ = sizeof(idx_t);
 
     visitedlistpool = new VisitedListPool(1, maxelements_);
 }
@@ -291,29 +710,47 @@ void HierarchicalNSW::LoadData(const std::string &location)
 {
     std::cout << "Loading data from " << location << std::endl;
     std::ifstream input(location, std::ios::binary);
-
-    uint32_t dim;
-    float mass[d_];
-    for (size_t i = 0; i < maxelements_; i++) {
-        input.read((char *) &dim, sizeof(uint32_t));
-        if (dim != d_) {
-            std::cout << "Wront data dim" << std::endl;
-            exit(1);
+    if (!input)
+        throw std::runtime_error("Failed to open HNSW data: " + location);
+
+    // Read vectors in large chunks of rows instead of one row at a time
+    const size_t row_size = sizeof(uint32_t) + data_size_;
+    const size_t chunk_rows = std::max<size_t>(1, (64 << 20) / row_size);
+    std::vector<char> chunk(chunk_rows * row_size);
+
+    for (size_t i = 0; i < maxelements_; i += chunk_rows) {
+        const size_t nrows = std::min(chunk_rows, maxelements_ - i);
+        input.read(chunk.data(), nrows * row_size);
+        if (!input)
+            throw std::runtime_error("Truncated HNSW data: " + location);
+
+        for (size_t r = 0; r < nrows; r++) {
+            const char *row = chunk.data() + r * row_size;
+            uint32_t dim;
+            memcpy(&dim, row, sizeof(uint32_t));
+            if (dim != d_)
+                throw std::runtime_error("Wrong data dim: " + location);
+            memcpy(getDataByLabel(i + r), row + sizeof(uint32_t), data_size_);
         }
-        input.read((char *) mass, dim * sizeof(float));
-        memcpy(getDataByInternalId(i), mass, data_size_);
     }
 }
 
 void HierarchicalNSW::LoadEdges(const std::string &location)
 {
     std::cout << "Loading edges from " << location << std::endl;
-    std::ifstream input(location, std::ios::binary);
+
+    // Large stream buffer turns the small per-node reads into memcpys
+    std::vector<char> stream_buffer(64 << 20);
+    std::ifstream input;
+    input.rdbuf()->pubsetbuf(stream_buffer.data(), stream_buffer.size());
+    input.open(location, std::ios::binary);
 
     uint32_t size;
 
     for (size_t i = 0; i < maxelements_; i++) {
         input.read((char *) &size, sizeof(uint32_t));
+        if (!input || size > maxM_)
+            throw std::runtime_error("Wrong HNSW edges: " + location);
 
         uint8_t *ll_cur = get_linklist0(i);
         *ll_cur = size;
@@ -321,10 +758,187 @@ void HierarchicalNSW::LoadEdges(const std::string &location)
 
         input.read((char *) data, size * sizeof(idx_t));
     }
+    if (!input)
+        throw std::runtime_error("Truncated HNSW edges: " + location);
+}
+
+namespace {
+    const uint64_t snapshot_magic = 0x50414e5357534e48;  // "HNSWSNAP"
+    const uint64_t snapshot_version = 2;
+    const size_t snapshot_data_offset = 4096;  // The node array starts at a page boundary
+    const size_t snapshot_max_sources = 4;
+
+    /// Version of a source file of the snapshot, a rewritten file changes its modification time
+    struct SourceStamp {
+        uint64_t size;
+        int64_t mtime_ns;   ///< -1 - the file does not exist
+
+        bool operator==(const SourceStamp &other) const {
+            return size == other.size && mtime_ns == other.mtime_ns;
+        }
+    };
+
+    SourceStamp stamp_of(const std::string &path)
+    {
+        SourceStamp stamp = {0, -1};
+        struct stat st;
+        if (stat(path.c_str(), &st) == 0) {
+            stamp.size = st.st_size;
+            stamp.mtime_ns = int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+        }
+        return stamp;
+    }
+
+    struct SnapshotHeader {
+        uint64_t magic;
+        uint64_t version;
+        uint64_t maxelements;
+        uint64_t cur_element_count;
+        uint64_t enterpoint_node;
+        uint64_t data_size;
+        uint64_t offset_data;
+        uint64_t size_data_per_element;
+        uint64_t M;
+        uint64_t maxM;
+        uint64_t size_links_level0;
+        uint64_t compact_links;
+        uint64_t link_id_bytes;
+        uint64_t nexternal_ids;
+        uint64_t nlink_offsets;
+        uint64_t nlink_data;
+        uint64_t nsources;
+        SourceStamp sources[snapshot_max_sources];
+    };
+}
+
+bool HierarchicalNSW::IsSnapshotOf(const std::string &location, const std::vector<std::string> &sources)
+{
+    std::ifstream input(location, std::ios::binary);
+    SnapshotHeader header;
+    input.read((char *) &header, sizeof(header));
+    if (!input || header.magic != snapshot_magic || header.version != snapshot_version
+        || header.nsources != sources.size())
+        return false;
+
+    for (size_t i = 0; i < sources.size(); i++)
+        if (!(header.sources[i] == stamp_of(sources[i])))
+            return false;
+    return true;
+}
+
+void HierarchicalNSW::SaveSnapshot(const std::string &location, const std::vector<std::string> &sources)
+{
+    std::cout << "Saving snapshot to " << location << std::endl;
+    if (sources.size() > snapshot_max_sources)
+        throw std::runtime_error("Too many sources of HNSW snapshot: " + location);
+    std::ofstream output(location, std::ios::binary);
+
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = snapshot_magic;
+    header.version = snapshot_version;
+    header.maxelements = cur_element_count;
+    header.cur_element_count = cur_element_count;
+    header.enterpoint_node = enterpoint_node;
+    header.data_size = data_size_;
+    header.offset_data = offset_data;
+    header.size_data_per_element = size_data_per_element;
+    header.M = M_;
+    header.maxM = maxM_;
+    header.size_links_level0 = size_links_level0;
+    header.compact_links = compact_links_;
+    header.link_id_bytes = link_id_bytes_;
+    header.nexternal_ids = external_ids_.size();
+    header.nlink_offsets = link_offsets_.size();
+    header.nlink_data = link_data_.size();
+    header.nsources = sources.size();
+    for (size_t i = 0; i < sources.size(); i++)
+        header.sources[i] = stamp_of(sources[i]);
+
+    std::vector<char> page(snapshot_data_offset, 0);
+    memcpy(page.data(), &header, sizeof(header));
+    output.write(page.data(), page.size());
+
+    output.write(data_level0_memory_, cur_element_count * size_data_per_element);
+    output.write((char *) external_ids_.data(), external_ids_.size() * sizeof(idx_t));
+    output.write((char *) link_offsets_.data(), link_offsets_.size() * sizeof(uint32_t));
+    output.write((char *) link_data_.data(), link_data_.size());
+    if (!output)
+        throw std::runtime_error("Failed to write HNSW snapshot: " + location);
+}
+
+void HierarchicalNSW::LoadSnapshot(const std::string &location, bool do_mmap)
+{
+    std::cout << "Loading snapshot from " << location << (do_mmap ? " (mmap)" : "") << std::endl;
+    std::ifstream input(location, std::ios::binary);
+
+    SnapshotHeader header;
+    input.read((char *) &header, sizeof(header));
+    if (!input || header.magic != snapshot_magic || header.version != snapshot_version)
+        throw std::runtime_error("Wrong HNSW snapshot: " + location);
+
+    maxelements_ = header.maxelements;
+    cur_element_count = header.cur_element_count;
+    enterpoint_node = header.enterpoint_node;
+    data_size_ = header.data_size;
+    offset_data = header.offset_data;
+    size_data_per_element = header.size_data_per_element;
+    M_ = header.M;
+    maxM_ = header.maxM;
+    size_links_level0 = header.size_links_level0;
+    compact_links_ = header.compact_links;
+    link_id_bytes_ = header.link_id_bytes;
+
+    d_ = data_size_ / sizeof(float);
+    efConstruction_ = 0;
+    visitedlistpool = new VisitedListPool(1, maxelements_);
+
+    const size_t node_memory_size = maxelements_ * size_data_per_element;
+    if (do_mmap) {
+        input.seekg(0, std::ios::end);
+        mapped_size_ = input.tellg();
+
+        // Private mapping, so the centroids can be rotated in place without touching the file
+        int fd = open(location.c_str(), O_RDONLY);
+        void *mapped = (fd < 0) ? MAP_FAILED : mmap(nullptr, mapped_size_, PROT_READ | PROT_WRITE,
+                                                    MAP_PRIVATE | MAP_POPULATE, fd, 0);
+        if (fd >= 0)
+            close(fd);
+        if (mapped == MAP_FAILED)
+            throw std::runtime_error("Failed to mmap HNSW snapshot: " + location);
+
+        mapped_memory_ = (char *) mapped;
+        data_level0_memory_ = mapped_memory_ + snapshot_data_offset;
+    } else {
+        mapped_memory_ = nullptr;
+        mapped_size_ = 0;
+        data_level0_memory_ = (char *) hugePageAlloc(node_memory_size, "hnsw nodes");
+        if (!data_level0_memory_)
+            throw std::runtime_error("Not enough memory to load HNSW snapshot");
+        input.seekg(snapshot_data_offset);
+        input.read(data_level0_memory_, node_memory_size);
+    }
+
+    input.seekg(snapshot_data_offset + node_memory_size);
+    external_ids_.resize(header.nexternal_ids);
+    input.read((char *) external_ids_.data(), external_ids_.size() * sizeof(idx_t));
+    link_offsets_.resize(header.nlink_offsets);
+    input.read((char *) link_offsets_.data(), link_offsets_.size() * sizeof(uint32_t));
+    link_data_.resize(header.nlink_data);
+    input.read((char *) link_data_.data(), link_data_.size());
+    if (!input)
+        throw std::runtime_error("Truncated HNSW snapshot: " + location);
+
+    internal_ids_.resize(external_ids_.size());
+    for (size_t i = 0; i < external_ids_.size(); i++)
+        internal_ids_[external_ids_[i]] = i;
 }
 
-float HierarchicalNSW::fstdistfunc(const float *x, const float *y)
+float HierarchicalNSW::fstdistfunc(const float *x, const float *y) const
 {
+    if (inner_product_)
+        return -innerProduct(x, y);
+
     float PORTABLE_ALIGN32 TmpRes[8];
 #ifdef USE_AVX
     size_t qty16 = d_ >> 4;
@@ -397,4 +1011,36 @@ float HierarchicalNSW::fstdistfunc(const float *x, const float *y)
     return (res);
 #endif
 }
+
+float HierarchicalNSW::innerProduct(const float *x, const float *y) const
+{
+    float PORTABLE_ALIGN32 TmpRes[8];
+    const float *pEnd1 = x + ((d_ >> 4) << 4);
+#ifdef USE_AVX
+    __m256 sum = _mm256_set1_ps(0);
+
+    while (x < pEnd1) {
+        sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_loadu_ps(x), _mm256_loadu_ps(y)));
+        x += 8;
+        y += 8;
+        sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_loadu_ps(x), _mm256_loadu_ps(y)));
+        x += 8;
+        y += 8;
+    }
+    _mm256_store_ps(TmpRes, sum);
+    return TmpRes[0] + TmpRes[1] + TmpRes[2] + TmpRes[3] + TmpRes[4] + TmpRes[5] + TmpRes[6] + TmpRes[7];
+#else
+    __m128 sum = _mm_set1_ps(0);
+
+    while (x < pEnd1) {
+        for (int i = 0; i < 4; i++) {
+            sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(x), _mm_loadu_ps(y)));
+            x += 4;
+            y += 4;
+        }
+    }
+    _mm_store_ps(TmpRes, sum);
+    return TmpRes[0] + TmpRes[1] + TmpRes[2] + TmpRes[3];
+#endif
+}
 }
@@ -1,6 +1,8 @@
 #pragma once
 
 #include "visited_list_pool.h"
+#include "distance_cache.h"
+#include "hugepage_alloc.h"
 #include <random>
 #include <iostream>
 #include <fstream>
@@ -12,6 +14,11 @@
 #include <map>
 #include <cmath>
 #include <queue>
+#include <limits>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 //#include <faiss/Heap.h>
 
@@ -58,6 +65,8 @@ namespace hnswlib {
         size_t dist_calc;
 
         char *data_level0_memory_;
+        char *mapped_memory_;     ///< Start of the mmap'd snapshot, if the node array lives in it
+        size_t mapped_size_;      ///< Size of the mmap'd snapshot
 
         size_t d_;
         size_t data_size_;
@@ -68,8 +77,19 @@ namespace hnswlib {
         size_t size_links_level0;
         size_t efSearch;
 
+        bool inner_product_;                ///< Distance is the negated inner product instead of L2 sqr, for max inner product search
+
+        bool compact_links_;                ///< Links are stored in link_offsets_ and link_data_ instead of the node array
+        size_t link_id_bytes_;              ///< Bytes per link in the compact storage: 2, 3 or 4
+        std::vector<uint32_t> link_offsets_;  ///< Offset of the links of each node in link_data_, in links, size maxelements_ + 1
+        std::vector<uint8_t> link_data_;      ///< Packed links of all nodes
+
+        std::vector<idx_t> external_ids_;   ///< External label of each internal node, empty if nodes are not reordered
+        std::vector<idx_t> internal_ids_;   ///< Internal node of each external label, empty if nodes are not reordered
+
     public:
         HierarchicalNSW(const std::string &infoLocation, const std::string &dataLocation, const std::string &edgeLocation);
+        explicit HierarchicalNSW(const std::string &snapshotLocation, bool do_mmap = false);
         HierarchicalNSW(size_t d, size_t maxelements, size_t M, size_t maxM, size_t efConstruction = 500);
         ~HierarchicalNSW();
 
@@ -81,7 +101,78 @@ namespace hnswlib {
             return (uint8_t *) (data_level0_memory_ + internal_id * size_data_per_element);
         }
 
-        std::priority_queue<std::pair<float, idx_t>> searchBaseLayer(const float *x, size_t ef);
+        /** Links of the node at the base layer
+          *
+          * In the compact storage links are decoded to the buffer of size maxM_,
+          * otherwise they are returned in place.
+          *
+          * @return number of links
+        */
+        inline size_t getLinks(idx_t internal_id, const idx_t *&links, idx_t *buffer) const {
+            if (!compact_links_) {
+                uint8_t *ll_cur = get_linklist0(internal_id);
+                links = (idx_t *)(ll_cur + 1);
+                return *ll_cur;
+            }
+            const size_t begin = link_offsets_[internal_id];
+            const size_t size = link_offsets_[internal_id + 1] - begin;
+            const uint8_t *packed = link_data_.data() + begin * link_id_bytes_;
+            switch (link_id_bytes_) {
+                case 2: decodeLinks16(packed, size, buffer); break;
+                case 3: decodeLinks24(packed, size, buffer); break;
+                default:
+                    links = (const idx_t *) packed;
+                    return size;
+            }
+            links = buffer;
+            return size;
+        }
+
+        inline void prefetchLinks(idx_t internal_id) const {
+            if (!compact_links_)
+                _mm_prefetch((char *) get_linklist0(internal_id), _MM_HINT_T0);
+            else
+                _mm_prefetch((char *) (link_data_.data() + link_offsets_[internal_id] * link_id_bytes_), _MM_HINT_T0);
+        }
+
+        inline idx_t getExternalLabel(idx_t internal_id) const {
+            return external_ids_.empty() ? internal_id : external_ids_[internal_id];
+        }
+
+        inline idx_t getInternalId(idx_t label) const {
+            return internal_ids_.empty() ? label : internal_ids_[label];
+        }
+
+        /// Vector of the node with the external label, i.e. its index in the input data
+        inline float *getDataByLabel(idx_t label) const {
+            return getDataByInternalId(getInternalId(label));
+        }
+
+        /** Search the base layer
+          *
+          * @param x      query
+          * @param ef     max number of candidate vertices in priority queue to observe
+          * @param cache  if not null, receives every distance computed during the walk, keyed by internal id.
+          *               The caller resets it for the query.
+        */
+        std::priority_queue<std::pair<float, idx_t>> searchBaseLayer(const float *x, size_t ef,
+                                                                     DistanceCache *cache = nullptr);
+
+        /** Search the base layer for a group of queries in lockstep.
+          *
+          * Each step of the traversal is split into stages, and every stage is done for all queries
+          * of the group before the next one. Thus memory loads issued by prefetches for one query
+          * overlap with distance computations for the others. Results are the same as for searchBaseLayer.
+          *
+          * @param x        queries, size nx * d
+          * @param nx       number of queries in the group
+          * @param ef       max number of candidate vertices in priority queue to observe
+          * @param results  output top results for each query, size nx
+          * @param caches   if not null, receive the distances computed for each query, size nx, see searchBaseLayer
+        */
+        void searchBaseLayerInterleaved(const float *x, size_t nx, size_t ef,
+                                        std::priority_queue<std::pair<float, idx_t>> *results,
+                                        DistanceCache *caches = nullptr);
 
         void getNeighborsByHeuristic(std::priority_queue<std::pair<float, idx_t>> &topResults, size_t NN);
 
@@ -89,15 +180,89 @@ namespace hnswlib {
 
         void addPoint(const float *point);
 
-        std::priority_queue<std::pair<float, idx_t >> searchKnn(const float *query_data, size_t k);
+        /** Reallocate the node array for <new_maxelements> nodes, at least the current number of nodes
+          *
+          * The nodes are copied, so the graph may grow beyond the size it was built for.
+          * Not thread-safe: the graph must not be searched meanwhile.
+        */
+        void resizeIndex(size_t new_maxelements);
+
+        /// Search k nearest vertices, optionally exporting all computed distances to the cache, see searchBaseLayer
+        std::priority_queue<std::pair<float, idx_t >> searchKnn(const float *query_data, size_t k,
+                                                                DistanceCache *cache = nullptr);
+
+        /** Search k nearest vertices for n queries, traversing <interleave> queries at once
+          *
+          * @param x           queries, size n * d
+          * @param n           number of queries
+          * @param k           number of the nearest vertices to search
+          * @param results     output top results for each query, size n
+          * @param interleave  number of queries traversed in lockstep
+          * @param caches      if not null, receive the distances computed for each query, size n, see searchBaseLayer
+        */
+        void searchKnnInterleaved(const float *x, size_t n, size_t k,
+                                  std::priority_queue<std::pair<float, idx_t>> *results, size_t interleave = 8,
+                                  DistanceCache *caches = nullptr);
+
+        /** Renumber nodes in the BFS order from the enter point, so neighbors in the graph lie close in memory.
+          *
+          * Search results and getDataByLabel keep addressing nodes by their external labels,
+          * i.e. by their indices in the input data. The mapping is saved by SaveInfo.
+          * Requires a temporary copy of the node array.
+        */
+        void reorderNodes();
+
+        /** Move links from the fixed-size slots of the node array to the compact storage.
+          *
+          * Links of all nodes are stored back to back with 16-bit ids if maxelements_ <= 2^16,
+          * 24-bit ids if maxelements_ <= 2^24 and 32-bit ids otherwise. The node array keeps only vectors.
+          * After compaction the graph is read-only: points can not be added.
+        */
+        void compactLinks();
+
+        /// Replace internal ids in the search results with external labels
+        void toExternalLabels(std::priority_queue<std::pair<float, idx_t>> &topResults) const;
 
         void SaveInfo(const std::string &location);
         void SaveEdges(const std::string &location);
 
+        /// Save the vectors of the nodes by their labels in the fvecs format read by LoadData
+        void SaveData(const std::string &location);
+
         void LoadInfo(const std::string &location);
         void LoadData(const std::string &location);
         void LoadEdges(const std::string &location);
+
+        /** Save the node array as-is with a header, together with compact links and external labels, if any.
+          *
+          * The node array starts at a page boundary of the file, so it can be loaded
+          * with one sequential read or mmap'd directly.
+          * @param sources  files the graph was loaded from or saved to, their sizes and modification times
+          *                 are kept in the header to detect a stale snapshot, see IsSnapshotOf
+        */
+        void SaveSnapshot(const std::string &location, const std::vector<std::string> &sources);
+
+        /// Whether the snapshot exists and was saved with the current versions of the source files
+        static bool IsSnapshotOf(const std::string &location, const std::vector<std::string> &sources);
+
+        /** Load the snapshot saved by SaveSnapshot
+          *
+          * @param do_mmap  map the node array from the file (private copy-on-write mapping)
+          *                 instead of reading it into allocated memory
+        */
+        void LoadSnapshot(const std::string &location, bool do_mmap = false);
         
-        float fstdistfunc(const float *x, const float *y);
+        /// L2 sqr distance, or the negated inner product if inner_product_ is set
+        float fstdistfunc(const float *x, const float *y) const;
+
+        /// Inner product of two vectors, the dimension must be a multiple of 16
+        float innerProduct(const float *x, const float *y) const;
+
+    private:
+        /// Free the node array or unmap the snapshot it lives in
+        void releaseNodeMemory();
+
+        static void decodeLinks16(const uint8_t *packed, size_t size, idx_t *links);
+        static void decodeLinks24(const uint8_t *packed, size_t size, idx_t *links);
     };
 }
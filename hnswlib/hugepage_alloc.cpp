@@ -0,0 +1,468 @@
+#include "hugepage_alloc.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <sys/mman.h>
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+namespace hnswlib {
+
+    namespace {
+        const size_t huge_page_2mb = 1 << 21;
+        const size_t huge_page_1gb = 1 << 30;
+
+        enum Method {
+            METHOD_HUGETLB_1GB = 0,
+            METHOD_HUGETLB_2MB = 1,
+            METHOD_THP = 2,
+            METHOD_MALLOC = 3,
+            NMETHODS = 4
+        };
+        const char *method_names[NMETHODS] = {"hugetlb 1GB", "hugetlb 2MB", "THP", "malloc"};
+
+        struct Region {
+            size_t length;      ///< Mapped length
+            size_t requested;   ///< Requested size
+            Method method;
+            const char *tag;
+        };
+
+        struct TagStats {
+            size_t requested = 0;
+            size_t mapped[NMETHODS] = {0, 0, 0, 0};
+        };
+
+        //================================================
+        // Slab of one size class, carved from large chunks
+        //================================================
+        struct Chunk {
+            char *cur;          ///< Next never used block
+            char *end;
+            void *free_list;    ///< Freed blocks, linked through their first word
+            size_t nused;       ///< Blocks allocated from the chunk, including the ones cached by threads
+        };
+
+        struct SizeClass {
+            std::mutex guard;
+            std::map<uintptr_t, Chunk> chunks;   ///< By the start address
+            std::set<uintptr_t> available;       ///< Chunks with free blocks, the lowest addresses are used first
+            uintptr_t empty = 0;                 ///< Empty chunk kept for reuse, 0 - none
+        };
+
+        const size_t slab_min_size = 64;
+        const size_t slab_max_size = 1 << 20;
+        const size_t nslab_classes = 57;           ///< size_class(slab_max_size) + 1
+        const size_t thread_cache_bytes = 1 << 16; ///< Max size of the free blocks cached by a thread per class
+
+        struct HugePageState {
+            std::mutex guard;
+            HugePageMode mode = HUGEPAGE_NONE;
+            std::map<uintptr_t, Region> regions;
+            std::map<std::string, TagStats> stats;
+            SizeClass classes[nslab_classes];
+        };
+
+        /// Never destroyed, so containers with static storage duration may free after exit
+        HugePageState &state()
+        {
+            static HugePageState *s = new HugePageState();
+            return *s;
+        }
+
+        size_t round_up(size_t size, size_t alignment)
+        {
+            return (size + alignment - 1) / alignment * alignment;
+        }
+
+        void *map_hugetlb(size_t length, int page_flag)
+        {
+            void *ptr = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | page_flag, -1, 0);
+            return (ptr == MAP_FAILED) ? nullptr : ptr;
+        }
+
+        /// Anonymous mapping aligned to 2 MB, so THP can back all of it
+        void *map_thp(size_t length)
+        {
+            char *ptr = (char *) mmap(nullptr, length + huge_page_2mb, PROT_READ | PROT_WRITE,
+                                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (ptr == MAP_FAILED)
+                return nullptr;
+
+            char *aligned = (char *) round_up((uintptr_t) ptr, huge_page_2mb);
+            if (aligned > ptr)
+                munmap(ptr, aligned - ptr);
+            munmap(aligned + length, ptr + huge_page_2mb - aligned);
+#ifdef MADV_HUGEPAGE
+            madvise(aligned, length, MADV_HUGEPAGE);
+#endif
+            return aligned;
+        }
+
+        /** Size class of the slab allocation
+          *
+          * Four classes per power of two: 2^b, 1.25 * 2^b, 1.5 * 2^b and 1.75 * 2^b,
+          * so at most 25% of a block is wasted.
+        */
+        size_t size_class(size_t size, size_t &class_size)
+        {
+            if (size <= slab_min_size) {
+                class_size = slab_min_size;
+                return 0;
+            }
+            size_t b = 63 - __builtin_clzll(size - 1);
+            size_t step = (size_t) 1 << (b - 2);
+            class_size = round_up(size, step);
+            return (b - 6) * 4 + class_size / step - 4;
+        }
+
+        /// Allocate a block of the class, the lock of the class must be held
+        void *take_block(SizeClass &cls, size_t class_size, const char *tag)
+        {
+            if (cls.available.empty()) {
+                const size_t chunk_size = round_up(std::max(huge_page_2mb, 8 * class_size), huge_page_2mb);
+                char *base = (char *) hugePageAlloc(chunk_size, tag);
+                if (!base)
+                    return nullptr;
+                Chunk chunk = {base, base + chunk_size, nullptr, 0};
+                cls.chunks[(uintptr_t) base] = chunk;
+                cls.available.insert((uintptr_t) base);
+            }
+            const uintptr_t base = *cls.available.begin();
+            Chunk &chunk = cls.chunks[base];
+            if (base == cls.empty)
+                cls.empty = 0;
+
+            void *ptr;
+            if (chunk.free_list) {
+                ptr = chunk.free_list;
+                chunk.free_list = *(void **) ptr;
+            } else {
+                ptr = chunk.cur;
+                chunk.cur += class_size;
+            }
+            chunk.nused++;
+            if (!chunk.free_list && (size_t) (chunk.end - chunk.cur) < class_size)
+                cls.available.erase(base);
+            return ptr;
+        }
+
+        /// Free a block of the class and release its chunk if it is empty, the lock of the class must be held
+        void return_block(SizeClass &cls, void *ptr)
+        {
+            auto it = --cls.chunks.upper_bound((uintptr_t) ptr);
+            const uintptr_t base = it->first;
+            Chunk &chunk = it->second;
+            *(void **) ptr = chunk.free_list;
+            chunk.free_list = ptr;
+            cls.available.insert(base);
+            if (--chunk.nused > 0)
+                return;
+
+            // Keep one empty chunk, so a class which is freed and refilled does not map chunks over and over
+            if (cls.empty && cls.empty != base) {
+                cls.available.erase(cls.empty);
+                cls.chunks.erase(cls.empty);
+                hugePageFree((void *) cls.empty);
+            }
+            cls.empty = base;
+            chunk.free_list = nullptr;
+            chunk.cur = (char *) base;
+        }
+
+        /// Free blocks cached by a thread, returned to the slabs when the thread exits
+        struct ThreadCache {
+            std::vector<void *> blocks[nslab_classes];
+
+            ~ThreadCache()
+            {
+                for (size_t c = 0; c < nslab_classes; c++) {
+                    if (blocks[c].empty())
+                        continue;
+                    SizeClass &cls = state().classes[c];
+                    std::unique_lock<std::mutex> lock(cls.guard);
+                    for (void *ptr : blocks[c])
+                        return_block(cls, ptr);
+                }
+            }
+        };
+
+        thread_local ThreadCache *cache_of_thread = nullptr;
+        thread_local bool thread_exiting = false;
+
+        struct ThreadCacheOwner {
+            ~ThreadCacheOwner()
+            {
+                thread_exiting = true;
+                delete cache_of_thread;
+                cache_of_thread = nullptr;
+            }
+        };
+
+        /// Cache of the calling thread, nullptr once the thread is exiting,
+        /// e.g. for the containers with static storage duration freed after the thread-local caches
+        ThreadCache *thread_cache()
+        {
+            thread_local ThreadCacheOwner owner;
+            if (!cache_of_thread && !thread_exiting)
+                cache_of_thread = new ThreadCache();
+            return cache_of_thread;
+        }
+    }
+
+    void setHugePageMode(HugePageMode mode)
+    {
+        std::unique_lock<std::mutex> lock(state().guard);
+        state().mode = mode;
+    }
+
+    HugePageMode getHugePageMode()
+    {
+        std::unique_lock<std::mutex> lock(state().guard);
+        return state().mode;
+    }
+
+    HugePageMode parseHugePageMode(const char *name)
+    {
+        if (!strcmp(name, "none")) return HUGEPAGE_NONE;
+        if (!strcmp(name, "thp")) return HUGEPAGE_THP;
+        if (!strcmp(name, "2mb")) return HUGEPAGE_2MB;
+        if (!strcmp(name, "1gb")) return HUGEPAGE_1GB;
+        std::cout << "Wrong huge page mode: " << name << ", expected none, thp, 2mb or 1gb" << std::endl;
+        exit(1);
+    }
+
+    void *hugePageAlloc(size_t size, const char *tag)
+    {
+        const HugePageMode mode = getHugePageMode();
+
+        // Small allocations would waste most of a huge page
+        if (mode == HUGEPAGE_NONE || size < huge_page_2mb) {
+            void *ptr = nullptr;
+            return posix_memalign(&ptr, 64, std::max<size_t>(size, 1)) ? nullptr : ptr;
+        }
+
+        void *ptr = nullptr;
+        size_t length = 0;
+        Method method = METHOD_MALLOC;
+
+        if (mode >= HUGEPAGE_1GB && size >= huge_page_1gb) {
+            length = round_up(size, huge_page_1gb);
+            ptr = map_hugetlb(length, MAP_HUGE_1GB);
+            method = METHOD_HUGETLB_1GB;
+        }
+        if (!ptr && mode >= HUGEPAGE_2MB) {
+            length = round_up(size, huge_page_2mb);
+            ptr = map_hugetlb(length, MAP_HUGE_2MB);
+            method = METHOD_HUGETLB_2MB;
+        }
+        if (!ptr) {
+            length = round_up(size, huge_page_2mb);
+            ptr = map_thp(length);
+            method = METHOD_THP;
+        }
+        if (!ptr) {
+            length = size;
+            if (posix_memalign(&ptr, 64, size))
+                return nullptr;
+            method = METHOD_MALLOC;
+        }
+
+        std::unique_lock<std::mutex> lock(state().guard);
+        Region region = {length, size, method, tag};
+        state().regions[(uintptr_t) ptr] = region;
+        TagStats &stats = state().stats[tag];
+        stats.requested += size;
+        stats.mapped[method] += length;
+        return ptr;
+    }
+
+    void hugePageFree(void *ptr)
+    {
+        if (!ptr)
+            return;
+
+        Region region;
+        {
+            std::unique_lock<std::mutex> lock(state().guard);
+            auto it = state().regions.find((uintptr_t) ptr);
+            if (it == state().regions.end()) {
+                lock.unlock();
+                free(ptr);
+                return;
+            }
+            region = it->second;
+            state().regions.erase(it);
+
+            TagStats &stats = state().stats[region.tag];
+            stats.requested -= region.requested;
+            stats.mapped[region.method] -= region.length;
+        }
+        if (region.method == METHOD_MALLOC)
+            free(ptr);
+        else
+            munmap(ptr, region.length);
+    }
+
+    void *hugePageSlabAlloc(size_t size, const char *tag)
+    {
+        if (size > slab_max_size)
+            return hugePageAlloc(size, tag);
+
+        size_t class_size;
+        const size_t class_no = size_class(size, class_size);
+
+        ThreadCache *cache = thread_cache();
+        if (cache && !cache->blocks[class_no].empty()) {
+            void *ptr = cache->blocks[class_no].back();
+            cache->blocks[class_no].pop_back();
+            return ptr;
+        }
+
+        // Refill the cache with half of its capacity
+        const size_t nblocks = cache ? std::max<size_t>(1, thread_cache_bytes / class_size / 2) : 1;
+        SizeClass &cls = state().classes[class_no];
+        std::unique_lock<std::mutex> lock(cls.guard);
+        void *ptr = take_block(cls, class_size, tag);
+        for (size_t i = 1; ptr && i < nblocks; i++) {
+            void *block = take_block(cls, class_size, tag);
+            if (!block)
+                break;
+            cache->blocks[class_no].push_back(block);
+        }
+        return ptr;
+    }
+
+    void hugePageSlabFree(void *ptr, size_t size)
+    {
+        if (!ptr)
+            return;
+        if (size > slab_max_size) {
+            hugePageFree(ptr);
+            return;
+        }
+        size_t class_size;
+        const size_t class_no = size_class(size, class_size);
+
+        ThreadCache *cache = thread_cache();
+        if (cache) {
+            std::vector<void *> &blocks = cache->blocks[class_no];
+            blocks.push_back(ptr);
+            if (blocks.size() * class_size <= thread_cache_bytes)
+                return;
+            // Return the older half of the cache to the slab
+            const size_t nreturned = blocks.size() / 2;
+            SizeClass &cls = state().classes[class_no];
+            std::unique_lock<std::mutex> lock(cls.guard);
+            for (size_t i = 0; i < nreturned; i++)
+                return_block(cls, blocks[i]);
+            blocks.erase(blocks.begin(), blocks.begin() + nreturned);
+            return;
+        }
+        SizeClass &cls = state().classes[class_no];
+        std::unique_lock<std::mutex> lock(cls.guard);
+        return_block(cls, ptr);
+    }
+
+    void reportHugePages(std::ostream &out)
+    {
+        struct Usage {
+            double rss = 0;       ///< Resident bytes
+            double hugetlb = 0;   ///< Resident bytes on hugetlbfs pages
+            double thp = 0;       ///< Resident bytes on transparent huge pages
+        };
+        std::map<std::string, TagStats> stats;
+        std::map<uintptr_t, Region> regions;
+        HugePageMode mode;
+        {
+            std::unique_lock<std::mutex> lock(state().guard);
+            stats = state().stats;
+            regions = state().regions;
+            mode = state().mode;
+        }
+
+        // Walk the mappings and attribute their huge page counters to the regions
+        // proportionally to the overlap, since adjacent regions may be merged into one mapping
+        std::map<std::string, Usage> usage;
+        std::ifstream smaps("/proc/self/smaps");
+        std::string line;
+        uintptr_t vma_begin = 0, vma_end = 0;
+        std::map<std::string, double> overlap;
+
+        auto account = [&](const char *field, double kb) {
+            for (auto &tag_overlap : overlap) {
+                Usage &u = usage[tag_overlap.first];
+                const double bytes = kb * 1024 * tag_overlap.second / (vma_end - vma_begin);
+                if (!strcmp(field, "Rss:")) u.rss += bytes;
+                else if (!strcmp(field, "AnonHugePages:")) u.thp += bytes;
+                else u.hugetlb += bytes;
+            }
+        };
+
+        while (std::getline(smaps, line)) {
+            unsigned long begin, end;
+            char field[64];
+            unsigned long kb;
+            if (sscanf(line.c_str(), "%lx-%lx ", &begin, &end) == 2 && line.find(':') > line.find(' ')) {
+                vma_begin = begin;
+                vma_end = end;
+                overlap.clear();
+                auto it = regions.upper_bound(vma_begin);
+                if (it != regions.begin())
+                    --it;
+                for (; it != regions.end() && it->first < vma_end; ++it) {
+                    if (it->second.method == METHOD_MALLOC)
+                        continue;
+                    const uintptr_t lo = std::max<uintptr_t>(it->first, vma_begin);
+                    const uintptr_t hi = std::min<uintptr_t>(it->first + it->second.length, vma_end);
+                    if (hi > lo)
+                        overlap[it->second.tag] += hi - lo;
+                }
+            } else if (!overlap.empty() && sscanf(line.c_str(), "%63s %lu kB", field, &kb) == 2) {
+                if (!strcmp(field, "Rss:") || !strcmp(field, "AnonHugePages:") ||
+                    !strcmp(field, "Private_Hugetlb:") || !strcmp(field, "Shared_Hugetlb:"))
+                    account(field, kb);
+            }
+        }
+
+        const char *mode_names[] = {"none", "thp", "2mb", "1gb"};
+        out << "Huge pages, mode " << mode_names[mode] << ":" << std::endl;
+        for (auto &tag_stats : stats) {
+            const TagStats &s = tag_stats.second;
+            const Usage &u = usage[tag_stats.first];
+            // hugetlbfs pages are not counted in Rss
+            const double resident = u.rss + u.hugetlb;
+            const double huge = u.hugetlb + u.thp;
+
+            std::ostringstream line_out;
+            line_out << "  " << tag_stats.first << ": " << s.requested / (1000 * 1000) << " Mb requested,";
+            for (size_t m = 0; m < NMETHODS; m++)
+                if (s.mapped[m] > 0)
+                    line_out << " " << method_names[m] << " " << s.mapped[m] / (1000 * 1000) << " Mb,";
+            line_out << " resident " << (size_t) (resident / (1000 * 1000)) << " Mb, on huge pages "
+                     << (size_t) (huge / (1000 * 1000)) << " Mb";
+            if (resident > 0)
+                line_out << " (" << (size_t) (100 * huge / resident) << "%)";
+            out << line_out.str() << std::endl;
+        }
+    }
+}
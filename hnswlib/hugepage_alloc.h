@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <new>
+#include <ostream>
+#include <utility>
+
+namespace hnswlib {
+
+    //==========================================
+    // Huge page backed allocations
+    //==========================================
+    // Large arrays accessed at random (the HNSW node array, the visited lists,
+    // the inverted list codes) are backed with huge pages to reduce TLB misses.
+    //
+    // Every mode falls back to the next one if the system refuses the request:
+    // 1 GB hugetlbfs -> 2 MB hugetlbfs -> transparent huge pages -> malloc.
+    // Explicit hugetlbfs pages must be reserved beforehand, e.g.
+    //   echo 20000 > /proc/sys/vm/nr_hugepages
+    // Allocations smaller than a huge page are served by malloc.
+    //==========================================
+    enum HugePageMode {
+        HUGEPAGE_NONE = 0,  ///< Plain malloc
+        HUGEPAGE_THP = 1,   ///< Anonymous mmap with madvise(MADV_HUGEPAGE)
+        HUGEPAGE_2MB = 2,   ///< Explicit 2 MB hugetlbfs pages
+        HUGEPAGE_1GB = 3,   ///< Explicit 1 GB hugetlbfs pages for allocations of at least 1 GB
+    };
+
+    /// Mode of the following allocations, HUGEPAGE_NONE by default
+    void setHugePageMode(HugePageMode mode);
+    HugePageMode getHugePageMode();
+
+    /// Parse "none", "thp", "2mb" or "1gb", exit on the wrong value
+    HugePageMode parseHugePageMode(const char *name);
+
+    /** Allocate memory, backed with huge pages if it is large enough
+      *
+      * @param size   size in bytes
+      * @param tag    static name of the allocation kind for reportHugePages
+      * @return       pointer aligned to at least 64 bytes, nullptr if out of memory
+    */
+    void *hugePageAlloc(size_t size, const char *tag);
+
+    /// Free memory allocated by hugePageAlloc, nullptr is ignored
+    void hugePageFree(void *ptr);
+
+    /** Small-object allocation from huge page backed slabs
+      *
+      * Sizes are rounded up to one of four size classes per power of two,
+      * freed blocks are reused by later allocations of the same class.
+      * Each thread keeps a small cache of free blocks per class, so most calls take no lock.
+      * A chunk of the slab whose blocks are all freed is returned to the system,
+      * except one empty chunk per class kept for reuse.
+      * Allocations above 1 MB go to hugePageAlloc directly.
+      * The size passed to hugePageSlabFree must be the one passed to hugePageSlabAlloc.
+    */
+    void *hugePageSlabAlloc(size_t size, const char *tag);
+    void hugePageSlabFree(void *ptr, size_t size);
+
+    /** Print how much of the tracked memory is actually backed with huge pages
+      *
+      * Per allocation tag: bytes requested, bytes mapped with each method and
+      * resident bytes on hugetlbfs and THP pages according to /proc/self/smaps.
+    */
+    void reportHugePages(std::ostream &out);
+
+    /// STL allocator for containers which should live on huge page backed slabs
+    template<typename T>
+    struct HugePageAllocator
+    {
+        typedef T value_type;
+        typedef T *pointer;
+        typedef const T *const_pointer;
+        typedef T &reference;
+        typedef const T &const_reference;
+        typedef size_t size_type;
+        typedef ptrdiff_t difference_type;
+
+        template<typename U>
+        struct rebind { typedef HugePageAllocator<U> other; };
+
+        HugePageAllocator() {}
+        template<typename U>
+        HugePageAllocator(const HugePageAllocator<U> &) {}
+
+        T *allocate(size_t n) {
+            if (n > std::numeric_limits<size_t>::max() / sizeof(T))
+                throw std::bad_alloc();
+            void *ptr = hugePageSlabAlloc(n * sizeof(T), "inverted lists");
+            if (!ptr)
+                throw std::bad_alloc();
+            return (T *) ptr;
+        }
+
+        void deallocate(T *ptr, size_t n) {
+            hugePageSlabFree(ptr, n * sizeof(T));
+        }
+
+        template<typename U, typename... Args>
+        void construct(U *ptr, Args &&... args) {
+            ::new((void *) ptr) U(std::forward<Args>(args)...);
+        }
+
+        template<typename U>
+        void destroy(U *ptr) { ptr->~U(); }
+
+        size_t max_size() const { return std::numeric_limits<size_t>::max() / sizeof(T); }
+    };
+
+    template<typename T, typename U>
+    bool operator==(const HugePageAllocator<T> &, const HugePageAllocator<U> &) { return true; }
+
+    template<typename T, typename U>
+    bool operator!=(const HugePageAllocator<T> &, const HugePageAllocator<U> &) { return false; }
+}
@@ -2,6 +2,8 @@
 #include <mutex>
 #include <string.h>
 #include <deque>
+#include <new>
+#include "hugepage_alloc.h"
 
 namespace hnswlib{
 
@@ -17,7 +19,9 @@ public:
 	{
 		curV = -1;
 		numelements = numelements1;
-		mass = new vl_type[numelements];
+		mass = (vl_type *) hugePageAlloc(numelements * sizeof(vl_type), "visited lists");
+		if (!mass)
+			throw std::bad_alloc();
 	}
 
 	void reset()
@@ -29,7 +33,7 @@ public:
 		}
 	};
 
-	~VisitedList() { delete mass; }
+	~VisitedList() { hugePageFree(mass); }
 };
 
 ///////////////////////////////////////////////////////////
@@ -0,0 +1,597 @@
+#include <iostream>
+#include <algorithm>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <stdexcept>
+
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <ivf-hnsw/IndexIVF_HNSW_Grouping.h>
+#include <ivf-hnsw/IndexHandle.h>
+#include <ivf-hnsw/Parser.h>
+#include "protocol.h"
+
+using namespace ivfhnsw;
+using namespace ivfhnsw::server;
+
+typedef std::chrono::steady_clock Clock;
+
+static_assert(sizeof(long) == sizeof(int64_t), "labels are sent as int64");
+
+/// Upper bounds on the request size, so a broken client can not make the server allocate arbitrary memory
+const uint32_t MAX_QUERIES_PER_REQUEST = 1 << 16;
+const uint32_t MAX_K = 1 << 16;
+const size_t MAX_RESULTS_PER_REQUEST = 1 << 24;  ///< Bound on nq * k, 192 MB of distances and labels
+
+static float elapsed_us(Clock::time_point begin, Clock::time_point end)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count();
+}
+
+//===========================================
+// Search request received from a connection
+//===========================================
+struct Request
+{
+    RequestHeader header;
+    std::vector<float> queries;     ///< size nq * d
+    std::vector<float> distances;   ///< size nq * k
+    std::vector<long> labels;       ///< size nq * k
+
+    Clock::time_point arrival;      ///< Request is read from the socket
+    Clock::time_point dispatch;     ///< Micro-batch with the request is sent to the workers
+    Clock::time_point completion;   ///< Last query of the request is searched
+    uint32_t batch_size;            ///< Number of queries in the micro-batch
+
+    std::atomic<size_t> nremaining; ///< Number of queries which are not searched yet
+    std::atomic<bool> failed;       ///< Some queries failed, their results are missing
+    std::mutex done_guard;
+    std::condition_variable done_cv;
+    bool done;
+
+    Request(): batch_size(0), nremaining(0), failed(false), done(false) {}
+
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(done_guard);
+        done_cv.wait(lock, [this] { return done; });
+    }
+
+    void complete_query()
+    {
+        if (--nremaining > 0)
+            return;
+        completion = Clock::now();
+        std::unique_lock<std::mutex> lock(done_guard);
+        done = true;
+        done_cv.notify_all();
+    }
+};
+
+/// Query of a request which is a part of a micro-batch
+struct QueryRef
+{
+    Request *request;
+    size_t query_no;
+};
+
+/// Micro-batch of queries, split into contiguous ranges between the workers
+struct Batch
+{
+    std::vector<QueryRef> queries;
+};
+
+//=======================================
+// Pool of worker threads pinned to cores
+//=======================================
+class WorkerPool
+{
+    struct Task {
+        std::shared_ptr<Batch> batch;
+        size_t begin;
+        size_t end;
+    };
+
+    IndexHandle &handle;
+    std::vector<std::thread> workers;
+
+    std::deque<Task> tasks;
+    std::mutex tasks_guard;
+    std::condition_variable tasks_cv;
+
+public:
+    WorkerPool(IndexHandle &handle, size_t nworkers): handle(handle)
+    {
+        const size_t ncores = std::max(1u, std::thread::hardware_concurrency());
+        for (size_t i = 0; i < nworkers; i++) {
+            workers.emplace_back(&WorkerPool::run, this);
+
+            cpu_set_t cpuset;
+            CPU_ZERO(&cpuset);
+            CPU_SET(i % ncores, &cpuset);
+            if (pthread_setaffinity_np(workers.back().native_handle(), sizeof(cpu_set_t), &cpuset))
+                std::cout << "Failed to pin worker " << i << " to core " << i % ncores << std::endl;
+        }
+    }
+
+    size_t size() const { return workers.size(); }
+
+    /// Split the batch into one contiguous range of queries per worker
+    void submit(std::shared_ptr<Batch> batch)
+    {
+        const size_t n = batch->queries.size();
+        const size_t range_size = (n + workers.size() - 1) / workers.size();
+        {
+            std::unique_lock<std::mutex> lock(tasks_guard);
+            for (size_t begin = 0; begin < n; begin += range_size)
+                tasks.push_back(Task{batch, begin, std::min(n, begin + range_size)});
+        }
+        tasks_cv.notify_all();
+    }
+
+private:
+    void run()
+    {
+        for (;;) {
+            Task task;
+            {
+                std::unique_lock<std::mutex> lock(tasks_guard);
+                tasks_cv.wait(lock, [this] { return !tasks.empty(); });
+                task = tasks.front();
+                tasks.pop_front();
+            }
+            // The whole range is searched on one snapshot, since the queries are preprocessed for it.
+            // The snapshot is released before waiting for the next task, so a reload drains within a batch
+            const IndexHandle::SnapshotPtr snapshot = handle.acquire();
+            IndexIVF_HNSW *index = snapshot->index.get();
+
+            // Rotate the queries of the range and compute their tables at once
+            const size_t d = index->d;
+            const size_t table_size = index->table_size();
+            const size_t nq = task.end - task.begin;
+            thread_local std::vector<float> queries, preprocessed, tables;
+            queries.resize(nq * d);
+            preprocessed.resize(nq * d);
+            tables.resize(nq * table_size);
+            for (size_t i = 0; i < nq; i++) {
+                const QueryRef &ref = task.batch->queries[task.begin + i];
+                memcpy(queries.data() + i * d, ref.request->queries.data() + ref.query_no * d, d * sizeof(float));
+            }
+            index->preprocess_queries(nq, queries.data(), preprocessed.data(), tables.data());
+
+            // Groups of queries traverse the quantizer in lockstep
+            const size_t interleave = std::max<size_t>(index->ninterleaved, 1);
+            thread_local IndexIVF_HNSW::CoarseProbes probes;
+            for (size_t group_begin = 0; group_begin < nq; group_begin += interleave) {
+                const size_t ng = std::min(interleave, nq - group_begin);
+                index->coarse_search(ng, preprocessed.data() + group_begin * d, index->nprobe, probes);
+
+                for (size_t i = group_begin; i < group_begin + ng; i++) {
+                    const QueryRef &ref = task.batch->queries[task.begin + i];
+                    Request *request = ref.request;
+                    const size_t k = request->header.k;
+
+                    float *distances = request->distances.data() + ref.query_no * k;
+                    long *labels = request->labels.data() + ref.query_no * k;
+                    // A failed read of a tiered list fails the query, not the worker
+                    try {
+                        index->search_probed(k, preprocessed.data() + i * d, tables.data() + i * table_size,
+                                             probes, i - group_begin, distances, labels);
+                    } catch (const std::exception &e) {
+                        std::fill(distances, distances + k, std::numeric_limits<float>::max());
+                        std::fill(labels, labels + k, -1);
+                        if (!request->failed.exchange(true))
+                            std::cout << "Search failed: " << e.what() << std::endl;
+                    }
+                    request->complete_query();
+                }
+            }
+        }
+    }
+};
+
+//=====================================================================
+// Coalesce concurrent requests into micro-batches bounded by a deadline
+//=====================================================================
+// A micro-batch is dispatched when it contains <max_batch> queries
+// or when the oldest pending request has waited for <deadline_us>.
+//=====================================================================
+class Batcher
+{
+    WorkerPool &pool;
+    const size_t max_batch;
+    const size_t deadline_us;
+
+    std::deque<Request *> pending;
+    size_t npending_queries;
+    std::mutex pending_guard;
+    std::condition_variable pending_cv;
+
+public:
+    Batcher(WorkerPool &pool, size_t max_batch, size_t deadline_us):
+            pool(pool), max_batch(max_batch), deadline_us(deadline_us), npending_queries(0)
+    {}
+
+    void submit(Request *request)
+    {
+        {
+            std::unique_lock<std::mutex> lock(pending_guard);
+            pending.push_back(request);
+            npending_queries += request->header.nq;
+        }
+        pending_cv.notify_one();
+    }
+
+    void run()
+    {
+        for (;;) {
+            std::shared_ptr<Batch> batch = std::make_shared<Batch>();
+            std::vector<Request *> requests;
+            {
+                std::unique_lock<std::mutex> lock(pending_guard);
+                pending_cv.wait(lock, [this] { return !pending.empty(); });
+
+                const Clock::time_point deadline = pending.front()->arrival + std::chrono::microseconds(deadline_us);
+                pending_cv.wait_until(lock, deadline, [this] { return npending_queries >= max_batch; });
+
+                // Take requests in the arrival order, at least one request per batch
+                size_t nqueries = 0;
+                while (!pending.empty()) {
+                    Request *request = pending.front();
+                    if (!requests.empty() && nqueries + request->header.nq > max_batch)
+                        break;
+                    requests.push_back(request);
+                    nqueries += request->header.nq;
+                    npending_queries -= request->header.nq;
+                    pending.pop_front();
+                }
+            }
+            const Clock::time_point dispatch = Clock::now();
+            for (Request *request : requests) {
+                request->dispatch = dispatch;
+                for (size_t q = 0; q < request->header.nq; q++)
+                    batch->queries.push_back(QueryRef{request, q});
+            }
+            for (Request *request : requests)
+                request->batch_size = batch->queries.size();
+
+            pool.submit(batch);
+        }
+    }
+};
+
+//=========
+// Sockets
+//=========
+static bool read_full(int fd, void *buf, size_t size)
+{
+    char *ptr = (char *) buf;
+    while (size > 0) {
+        ssize_t nread = read(fd, ptr, size);
+        if (nread < 0 && errno == EINTR)
+            continue;
+        if (nread <= 0)
+            return false;
+        ptr += nread;
+        size -= nread;
+    }
+    return true;
+}
+
+static bool write_full(int fd, const void *buf, size_t size)
+{
+    const char *ptr = (const char *) buf;
+    while (size > 0) {
+        ssize_t nwritten = write(fd, ptr, size);
+        if (nwritten < 0 && errno == EINTR)
+            continue;
+        if (nwritten <= 0)
+            return false;
+        ptr += nwritten;
+        size -= nwritten;
+    }
+    return true;
+}
+
+static bool send_error(int fd, const RequestHeader &header)
+{
+    ResponseHeader response = {PROTOCOL_MAGIC, STATUS_BAD_REQUEST, header.nq, header.k, 0, 0, 0, 0};
+    return write_full(fd, &response, sizeof(response));
+}
+
+/// Serve requests of one connection until it is closed
+static void serve_connection(int fd, Batcher *batcher, size_t d)
+{
+    for (;;) {
+        Request request;
+        if (!read_full(fd, &request.header, sizeof(RequestHeader)))
+            break;
+        request.arrival = Clock::now();
+
+        const RequestHeader &header = request.header;
+        if (header.magic != PROTOCOL_MAGIC || header.type != REQUEST_SEARCH || header.d != d ||
+            header.nq == 0 || header.nq > MAX_QUERIES_PER_REQUEST || header.k == 0 || header.k > MAX_K ||
+            (size_t) header.nq * header.k > MAX_RESULTS_PER_REQUEST) {
+            // The payload size is unknown, so the connection can not be resynchronized
+            send_error(fd, header);
+            break;
+        }
+        request.queries.resize((size_t) header.nq * d);
+        if (!read_full(fd, request.queries.data(), request.queries.size() * sizeof(float)))
+            break;
+
+        const size_t nresults = (size_t) header.nq * header.k;
+        request.distances.resize(nresults);
+        request.labels.resize(nresults);
+        request.nremaining = header.nq;
+
+        batcher->submit(&request);
+        request.wait();
+
+        ResponseHeader response;
+        response.magic = PROTOCOL_MAGIC;
+        response.status = request.failed ? STATUS_SEARCH_FAILED : STATUS_OK;
+        response.nq = header.nq;
+        response.k = header.k;
+        response.batch_size = request.batch_size;
+        response.queue_us = elapsed_us(request.arrival, request.dispatch);
+        response.search_us = elapsed_us(request.dispatch, request.completion);
+        response.total_us = elapsed_us(request.arrival, Clock::now());
+
+        if (!write_full(fd, &response, sizeof(response)) ||
+            !write_full(fd, request.distances.data(), request.distances.size() * sizeof(float)) ||
+            !write_full(fd, request.labels.data(), request.labels.size() * sizeof(long)))
+            break;
+    }
+    close(fd);
+}
+
+static int listen_socket(const Parser &opt)
+{
+    int fd;
+    if (opt.path_socket) {
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(opt.path_socket) >= sizeof(addr.sun_path)) {
+            std::cout << "Socket path is too long: " << opt.path_socket << std::endl;
+            exit(1);
+        }
+        strcpy(addr.sun_path, opt.path_socket);
+        unlink(opt.path_socket);
+        if (fd < 0 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+            perror("bind");
+            exit(1);
+        }
+        std::cout << "Listening on " << opt.path_socket << std::endl;
+    } else {
+        if (opt.port == 0) {
+            std::cout << "Either -path_socket or -port must be set" << std::endl;
+            exit(1);
+        }
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        int reuse = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(opt.port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (fd < 0 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+            perror("bind");
+            exit(1);
+        }
+        std::cout << "Listening on 127.0.0.1:" << opt.port << std::endl;
+    }
+    if (listen(fd, 128) < 0) {
+        perror("listen");
+        exit(1);
+    }
+    return fd;
+}
+
+//============
+// Load index
+//============
+// Missing files are reported with std::runtime_error, so a failed reload keeps the served index
+static void check_index_file(const char *path)
+{
+    if (!path || !exists(path))
+        throw std::runtime_error(std::string("Missing index file: ") + (path ? path : "(not set)"));
+}
+
+static IndexIVF_HNSW *load_index(const Parser &opt)
+{
+    const char *required[] = {opt.path_centroids, opt.path_info, opt.path_edges,
+                              opt.path_pq, opt.path_norm_pq, opt.path_index};
+    for (const char *path : required)
+        check_index_file(path);
+    if (opt.refine_code_size > 0)
+        check_index_file(opt.path_refine_pq);
+    if (opt.do_opq)
+        check_index_file(opt.path_opq_matrix);
+
+    std::unique_ptr<IndexIVF_HNSW> guard;
+    IndexIVF_HNSW *index;
+    if (opt.nsubc > 0)
+        index = new IndexIVF_HNSW_Grouping(opt.d, opt.nc, opt.code_size, 8, opt.nsubc);
+    else
+        index = new IndexIVF_HNSW(opt.d, opt.nc, opt.code_size, 8);
+    guard.reset(index);
+    index->mmap_quantizer = opt.do_mmap_quantizer;
+    index->set_metric(parse_metric(opt.metric));
+    // An index with split lists is searched with the quantizer saved next to it
+    if (IndexIVF_HNSW::has_split_quantizer(opt.path_index))
+        index->read_split_quantizer(opt.path_index, opt.efConstruction);
+    else
+        index->build_quantizer(opt.path_centroids, opt.path_info, opt.path_edges, opt.M, opt.efConstruction,
+                               opt.do_reorder);
+    if (opt.do_compact_links)
+        index->quantizer->compactLinks();
+    index->do_opq = opt.do_opq;
+    index->set_encoding(parse_residual_encoding(opt.encoding));
+    if (opt.refine_code_size > 0)
+        index->enable_refinement(opt.refine_code_size);
+
+    std::cout << "Loading Residual " << opt.encoding << " codebook from " << opt.path_pq << std::endl;
+    index->read_residual_quantizer(opt.path_pq);
+
+    if (opt.do_opq) {
+        std::cout << "Loading Residual OPQ rotation matrix from " << opt.path_opq_matrix << std::endl;
+        index->opq_matrix = dynamic_cast<faiss::LinearTransform *>(faiss::read_VectorTransform(opt.path_opq_matrix));
+    }
+    std::cout << "Loading Norm PQ codebook from " << opt.path_norm_pq << std::endl;
+    if (index->norm_pq) delete index->norm_pq;
+    index->norm_pq = faiss::read_ProductQuantizer(opt.path_norm_pq);
+
+    if (index->refine_pq) {
+        std::cout << "Loading Refinement PQ codebook from " << opt.path_refine_pq << std::endl;
+        delete index->refine_pq;
+        index->refine_pq = faiss::read_ProductQuantizer(opt.path_refine_pq);
+    }
+
+    // With a list file only the hot lists are kept in RAM, and the lists of the index file are not loaded at all
+    if (opt.path_lists) {
+        std::cout << "Loading index from " << opt.path_index << ", lists from " << opt.path_lists << std::endl;
+        index->read_tiered(opt.path_index, opt.path_lists, opt.cache_mb << 20, opt.io_threads);
+    } else {
+        std::cout << "Loading index from " << opt.path_index << std::endl;
+        index->read(opt.path_index);
+    }
+    if (opt.do_pack_ids)
+        index->pack_ids();
+
+    // For correct search using OPQ encoding rotate points in the coarse quantizer
+    if (opt.do_opq) {
+        std::cout << "Rotating centroids" << std::endl;
+        index->rotate_quantizer();
+    }
+
+    index->nprobe = opt.nprobe;
+    index->max_codes = opt.max_codes;
+    index->refine_k = opt.refine_k;
+    index->quantizer->efSearch = opt.efSearch;
+    if (opt.nsubc > 0) {
+        IndexIVF_HNSW_Grouping *grouping = dynamic_cast<IndexIVF_HNSW_Grouping *>(index);
+        grouping->do_pruning = opt.do_pruning;
+        grouping->pruning_mode = (PruningMode) opt.pruning_mode;
+        grouping->bound_scale = opt.bound_scale;
+        if (opt.do_pruning && opt.pruning_mode != PRUNING_THRESHOLD)
+            grouping->compute_subgroup_radii();
+    }
+    return guard.release();
+}
+
+//==================================================================
+// Reload the index from the same paths on SIGHUP and hot-swap it in
+//==================================================================
+// A rebuild is rolled out by renaming the new files over the old ones and sending SIGHUP.
+// The new index is loaded next to the served one, then published atomically:
+// in-flight micro-batches finish on the old snapshot, which is freed once they drain.
+// With -path_lists the new index loads only its metadata and starts with an empty cache,
+// so the lists are not held twice in RAM. A list file that does not match the new index
+// is rewritten, which reads the lists of the index file once.
+// If loading fails, the old index keeps serving.
+//==================================================================
+static void reload_on_sighup(const Parser *opt, IndexHandle *handle, sigset_t signals)
+{
+    for (;;) {
+        int signal_no = 0;
+        if (sigwait(&signals, &signal_no) != 0 || signal_no != SIGHUP)
+            continue;
+
+        std::cout << "Reloading index" << std::endl;
+        const Clock::time_point begin = Clock::now();
+        IndexIVF_HNSW *index;
+        try {
+            index = load_index(*opt);
+        } catch (const std::exception &e) {
+            std::cout << "Reload failed, keep serving version " << handle->acquire()->version
+                      << ": " << e.what() << std::endl;
+            continue;
+        }
+        const Clock::time_point loaded = Clock::now();
+        const uint64_t version = handle->publish(index);
+        std::cout << "Serving version " << version << ", loaded in " << elapsed_us(begin, loaded) / 1e6
+                  << " s, previous version drained in " << elapsed_us(loaded, Clock::now()) / 1e3
+                  << " ms" << std::endl;
+    }
+}
+
+//==========================================================
+// Query-serving daemon: load an index once and serve queries
+// over a Unix domain socket or a loopback TCP port
+//==========================================================
+int main(int argc, char **argv)
+{
+    //===============
+    // Parse Options
+    //===============
+    Parser opt = Parser(argc, argv);
+    hnswlib::setHugePageMode(hnswlib::parseHugePageMode(opt.hugepages));
+    signal(SIGPIPE, SIG_IGN);
+
+    // SIGHUP is blocked in all threads and taken by the reloader with sigwait
+    sigset_t reload_signals;
+    sigemptyset(&reload_signals);
+    sigaddset(&reload_signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &reload_signals, nullptr);
+
+    IndexIVF_HNSW *index;
+    try {
+        index = load_index(opt);
+    } catch (const std::exception &e) {
+        std::cout << e.what() << std::endl;
+        exit(1);
+    }
+    hnswlib::reportHugePages(std::cout);
+    IndexHandle handle(index);
+
+    const size_t nworkers = (opt.nworkers > 0) ? opt.nworkers : std::max(1u, std::thread::hardware_concurrency());
+    std::cout << "Starting " << nworkers << " workers, max batch " << opt.max_batch
+              << ", deadline " << opt.deadline_us << " us" << std::endl;
+
+    WorkerPool pool(handle, nworkers);
+    Batcher batcher(pool, std::max<size_t>(1, opt.max_batch), opt.deadline_us);
+    std::thread batcher_thread(&Batcher::run, &batcher);
+    std::thread reloader_thread(reload_on_sighup, &opt, &handle, reload_signals);
+
+    const int listen_fd = listen_socket(opt);
+    for (;;) {
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("accept");
+            break;
+        }
+        if (!opt.path_socket) {
+            int nodelay = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        }
+        std::thread(serve_connection, fd, &batcher, opt.d).detach();
+    }
+    close(listen_fd);
+    // Workers, the batcher and the reloader never return, so the index is left to the process exit
+    exit(1);
+}
@@ -0,0 +1,54 @@
+#ifndef IVF_HNSW_LIB_SERVER_PROTOCOL_H
+#define IVF_HNSW_LIB_SERVER_PROTOCOL_H
+
+#include <cstdint>
+
+//==========================================
+// Binary protocol of the query-serving daemon
+//==========================================
+// All fields are little endian.
+//
+// Request:  RequestHeader, followed by nq * d float queries.
+// Response: ResponseHeader, followed by nq * k float distances
+//           and nq * k int64 labels, both row-major per query.
+//           The labels of missing results are -1.
+//
+// A connection may send any number of requests one after another,
+// each response is sent in the order of the requests.
+//==========================================
+namespace ivfhnsw {
+namespace server {
+
+    const uint32_t PROTOCOL_MAGIC = 0x49564648;  ///< "IVFH"
+
+    enum RequestType : uint32_t {
+        REQUEST_SEARCH = 1,   ///< Search nq queries for k nearest neighbours
+    };
+
+    enum ResponseStatus : uint32_t {
+        STATUS_OK = 0,
+        STATUS_BAD_REQUEST = 1,   ///< Wrong magic, type, dimension or too many queries or results
+        STATUS_SEARCH_FAILED = 2, ///< Some queries failed, e.g. a tiered list could not be read, their labels are -1
+    };
+
+    struct RequestHeader {
+        uint32_t magic;       ///< PROTOCOL_MAGIC
+        uint32_t type;        ///< RequestType
+        uint32_t nq;          ///< Number of queries
+        uint32_t k;           ///< Number of the nearest neighbours per query
+        uint32_t d;           ///< Query dimension, must match the index dimension
+    };
+
+    struct ResponseHeader {
+        uint32_t magic;       ///< PROTOCOL_MAGIC
+        uint32_t status;      ///< ResponseStatus
+        uint32_t nq;          ///< Number of queries
+        uint32_t k;           ///< Number of the nearest neighbours per query
+        uint32_t batch_size;  ///< Number of queries in the micro-batch the request was executed in
+        float queue_us;       ///< Time from the request arrival to the micro-batch dispatch
+        float search_us;      ///< Time from the micro-batch dispatch to the last query completion
+        float total_us;       ///< Time from the request arrival to the response
+    };
+}
+}
+#endif //IVF_HNSW_LIB_SERVER_PROTOCOL_H
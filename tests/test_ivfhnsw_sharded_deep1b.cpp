@@ -0,0 +1,174 @@
+#include <iostream>
+#include <fstream>
+#include <cstdio>
+#include <stdlib.h>
+#include <queue>
+#include <string>
+#include <unordered_set>
+
+#include <ivf-hnsw/IndexIVF_HNSW.h>
+#include <ivf-hnsw/ShardedIndex.h>
+#include <ivf-hnsw/Parser.h>
+
+using namespace hnswlib;
+using namespace ivfhnsw;
+
+//============================================================
+// IVF-HNSW on DEEP1B split into <nshards> shards of base ids
+//============================================================
+// The shards share the quantizer and the codebooks trained by test_ivfhnsw_deep1b,
+// which is run first with the same parameters. Each shard indexes a contiguous range
+// of base vectors with local ids and is saved to <path_index>.shard<s>.
+//============================================================
+int main(int argc, char **argv)
+{
+    //===============
+    // Parse Options
+    //===============
+    Parser opt = Parser(argc, argv);
+    hnswlib::setHugePageMode(hnswlib::parseHugePageMode(opt.hugepages));
+
+    const size_t batch_size = 1000000;
+    const size_t nbatches = opt.nb / batch_size;
+    const size_t nshards = std::max<size_t>(1, std::min(opt.nshards, nbatches));
+    if (!labels_fit((nbatches + nshards - 1) / nshards * batch_size)) {
+        std::cout << "Local ids of the shards do not fit 32 bits, increase -nshards" << std::endl;
+        exit(1);
+    }
+    const char *required[] = {opt.path_pq, opt.path_norm_pq, opt.path_precomputed_idxs};
+    for (const char *path : required) {
+        if (!exists(path)) {
+            std::cout << "Missing " << path << ", run test_ivfhnsw_deep1b first" << std::endl;
+            exit(1);
+        }
+    }
+
+    //==================
+    // Load Groundtruth
+    //==================
+    std::cout << "Loading groundtruth from " << opt.path_gt << std::endl;
+    std::vector<idx_t> massQA(opt.nq * opt.ngt);
+    {
+        XvecFile gt_file(opt.path_gt, sizeof(idx_t));
+        gt_file.check(opt.ngt, opt.nq);
+        gt_file.read<idx_t>(0, opt.nq, massQA.data());
+    }
+    //==============
+    // Load Queries
+    //==============
+    std::cout << "Loading queries from " << opt.path_q << std::endl;
+    std::vector<float> massQ(opt.nq * opt.d);
+    {
+        XvecFile query_file(opt.path_q, sizeof(float));
+        query_file.check(opt.d, opt.nq);
+        query_file.read_floats<float>(0, opt.nq, massQ.data());
+    }
+    //=================================
+    // Load the shared trained parts
+    //=================================
+    IndexIVF_HNSW *first = new IndexIVF_HNSW(opt.d, opt.nc, opt.code_size, 8);
+    first->set_metric(parse_metric(opt.metric));
+    first->build_quantizer(opt.path_centroids, opt.path_info, opt.path_edges, opt.M, opt.efConstruction,
+                           opt.do_reorder);
+    first->do_opq = opt.do_opq;
+    first->set_encoding(parse_residual_encoding(opt.encoding));
+
+    std::cout << "Loading Residual " << opt.encoding << " codebook from " << opt.path_pq << std::endl;
+    first->read_residual_quantizer(opt.path_pq);
+    if (opt.do_opq) {
+        std::cout << "Loading OPQ rotation matrix from " << opt.path_opq_matrix << std::endl;
+        first->opq_matrix = dynamic_cast<faiss::LinearTransform *>(faiss::read_VectorTransform(opt.path_opq_matrix));
+    }
+    std::cout << "Loading Norm PQ codebook from " << opt.path_norm_pq << std::endl;
+    if (first->norm_pq) delete first->norm_pq;
+    first->norm_pq = faiss::read_ProductQuantizer(opt.path_norm_pq);
+
+    //=============================
+    // Construct or load the shards
+    //=============================
+    ShardedIndex index;
+    XvecFile base_file(opt.path_base, sizeof(float));
+    XvecFile idx_file(opt.path_precomputed_idxs, sizeof(idx_t));
+    base_file.check(opt.d, opt.nb);
+    idx_file.check(batch_size, nbatches);
+
+    for (size_t s = 0; s < nshards; s++) {
+        const size_t batch_begin = s * nbatches / nshards;
+        const size_t batch_end = (s + 1) * nbatches / nshards;
+        const std::string path_shard = std::string(opt.path_index) + ".shard" + std::to_string(s);
+
+        IndexIVF_HNSW *shard = first;
+        if (s > 0) {
+            shard = new IndexIVF_HNSW(opt.d, opt.nc, opt.code_size, 8);
+            shard->set_metric(parse_metric(opt.metric));
+            shard->set_encoding(parse_residual_encoding(opt.encoding));
+            ShardedIndex::share_trained(shard, first);
+        }
+
+        if (exists(path_shard.c_str())) {
+            std::cout << "Loading shard " << s << " from " << path_shard << std::endl;
+            shard->read(path_shard.c_str());
+        } else {
+            std::cout << "Adding batches [" << batch_begin << ", " << batch_end << ") to shard " << s << std::endl;
+            std::vector<float> batch(batch_size * opt.d);
+            std::vector<label_t> ids_batch(batch_size);
+            for (size_t b = batch_begin; b < batch_end; b++) {
+                const idx_t *idx_batch = idx_file.view<idx_t>(b, 1)[0];
+                base_file.read_floats<float>(b * batch_size, batch_size, batch.data());
+
+                // Local ids of the shard, the global ones are restored with the id offset
+                for (size_t i = 0; i < batch_size; i++)
+                    ids_batch[i] = (b - batch_begin) * batch_size + i;
+                shard->add_batch(batch_size, batch.data(), ids_batch.data(), idx_batch);
+            }
+            shard->compute_centroid_norms();
+
+            std::cout << "Saving shard " << s << " to " << path_shard << std::endl;
+            shard->write(path_shard.c_str());
+        }
+        index.add_shard(shard, batch_begin * batch_size);
+    }
+
+    // For correct search using OPQ encoding rotate points in the shared coarse quantizer once
+    if (opt.do_opq) {
+        std::cout << "Rotating centroids"<< std::endl;
+        first->rotate_quantizer();
+    }
+
+    //=======================
+    // Set search parameters
+    //=======================
+    index.nprobe = opt.nprobe;
+    index.max_codes = opt.max_codes;
+    first->quantizer->efSearch = opt.efSearch;
+
+    hnswlib::reportHugePages(std::cout);
+
+    //========
+    // Search
+    //========
+    size_t correct = 0;
+    size_t ncode = 0;
+    float distances[opt.k];
+    long labels[opt.k];
+
+    StopW stopw = StopW();
+    for (size_t i = 0; i < opt.nq; i++) {
+        ncode += index.search(opt.k, massQ.data() + i * opt.d, distances, labels);
+
+        for (size_t j = 0; j < opt.k; j++)
+            if (labels[j] == massQA[opt.ngt * i]) {
+                correct++;
+                break;
+            }
+    }
+    //===================
+    // Represent results
+    //===================
+    const float time_us_per_query = stopw.getElapsedTimeMicro() / opt.nq;
+    std::cout << "Shards: " << nshards << ", vectors: " << index.ntotal() << std::endl;
+    std::cout << "Recall@" << opt.k << ": " << 1.0f * correct / opt.nq << std::endl;
+    std::cout << "Time per query: " << time_us_per_query << " us, codes per query: "
+              << 1. * ncode / opt.nq << std::endl;
+    return 0;
+}
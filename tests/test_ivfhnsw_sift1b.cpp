@@ -20,6 +20,11 @@ int main(int argc, char **argv)
     // Parse Options
     //===============
     Parser opt = Parser(argc, argv);
+    if (!labels_fit(opt.nb)) {
+        std::cout << "Ids of " << opt.nb << " base vectors do not fit 32 bits, build with -DIVFHNSW_64BIT_IDS=ON" << std::endl;
+        exit(1);
+    }
+    hnswlib::setHugePageMode(hnswlib::parseHugePageMode(opt.hugepages));
 
     //==================
     // Load Groundtruth
@@ -27,8 +32,9 @@ int main(int argc, char **argv)
     std::cout << "Loading groundtruth from " << opt.path_gt << std::endl;
     std::vector<idx_t> massQA(opt.nq * opt.ngt);
     {
-        std::ifstream gt_input(opt.path_gt, std::ios::binary);
-        readXvec<idx_t>(gt_input, massQA.data(), opt.ngt, opt.nq);
+        XvecFile gt_file(opt.path_gt, sizeof(idx_t));
+        gt_file.check(opt.ngt, opt.nq);
+        gt_file.read<idx_t>(0, opt.nq, massQA.data());
     }
 
     //==============
@@ -37,23 +43,35 @@ int main(int argc, char **argv)
     std::cout << "Loading queries from " << opt.path_q << std::endl;
     std::vector<float> massQ(opt.nq * opt.d);
     {
-        std::ifstream query_input(opt.path_q, std::ios::binary);
-        readXvecFvec<uint8_t>(query_input, massQ.data(), opt.d, opt.nq);
+        XvecFile query_file(opt.path_q, sizeof(uint8_t));
+        query_file.check(opt.d, opt.nq);
+        query_file.read_floats<uint8_t>(0, opt.nq, massQ.data());
     }
     //==================
     // Initialize Index
     //==================
     IndexIVF_HNSW *index = new IndexIVF_HNSW(opt.d, opt.nc, opt.code_size, 8);
-    index->build_quantizer(opt.path_centroids, opt.path_info, opt.path_edges, opt.M, opt.efConstruction);
+    index->set_metric(parse_metric(opt.metric));
+    // An index with split lists is searched with the quantizer saved next to it
+    if (IndexIVF_HNSW::has_split_quantizer(opt.path_index))
+        index->read_split_quantizer(opt.path_index, opt.efConstruction);
+    else
+        index->build_quantizer(opt.path_centroids, opt.path_info, opt.path_edges, opt.M, opt.efConstruction,
+                               opt.do_reorder);
+    if (opt.do_compact_links)
+        index->quantizer->compactLinks();
     index->do_opq = opt.do_opq;
+    index->set_encoding(parse_residual_encoding(opt.encoding));
+    if (opt.refine_code_size > 0)
+        index->enable_refinement(opt.refine_code_size);
 
     //==========
     // Train PQ
     //==========
-    if (exists(opt.path_pq) && exists(opt.path_norm_pq)) {
-        std::cout << "Loading Residual PQ codebook from " << opt.path_pq << std::endl;
-        if (index->pq) delete index->pq;
-        index->pq = faiss::read_ProductQuantizer(opt.path_pq);
+    if (exists(opt.path_pq) && exists(opt.path_norm_pq) &&
+        (!index->refine_pq || exists(opt.path_refine_pq))) {
+        std::cout << "Loading Residual " << opt.encoding << " codebook from " << opt.path_pq << std::endl;
+        index->read_residual_quantizer(opt.path_pq);
 
         if (opt.do_opq){
             std::cout << "Loading OPQ rotation matrix from " << opt.path_opq_matrix << std::endl;
@@ -62,13 +80,20 @@ int main(int argc, char **argv)
         std::cout << "Loading Norm PQ codebook from " << opt.path_norm_pq << std::endl;
         if (index->norm_pq) delete index->norm_pq;
         index->norm_pq = faiss::read_ProductQuantizer(opt.path_norm_pq);
+
+        if (index->refine_pq) {
+            std::cout << "Loading Refinement PQ codebook from " << opt.path_refine_pq << std::endl;
+            delete index->refine_pq;
+            index->refine_pq = faiss::read_ProductQuantizer(opt.path_refine_pq);
+        }
     }
     else {
         // Load learn set
         std::vector<float> trainvecs(opt.nt * opt.d);
         {
-            std::ifstream learn_input(opt.path_learn, std::ios::binary);
-            readXvecFvec<uint8_t>(learn_input, trainvecs.data(), opt.d, opt.nt);
+            XvecFile learn_file(opt.path_learn, sizeof(uint8_t));
+            learn_file.check(opt.d, opt.nt);
+            learn_file.read_floats<uint8_t>(0, opt.nt, trainvecs.data());
         }
         // Set Random Subset of sub_nt trainvecs
         std::vector<float> trainvecs_rnd_subset(opt.nsubt * opt.d);
@@ -77,8 +102,8 @@ int main(int argc, char **argv)
         std::cout << "Training PQ codebooks" << std::endl;
         index->train_pq(opt.nsubt, trainvecs_rnd_subset.data());
 
-        std::cout << "Saving Residual PQ codebook to " << opt.path_pq << std::endl;
-        faiss::write_ProductQuantizer(index->pq, opt.path_pq);
+        std::cout << "Saving Residual " << opt.encoding << " codebook to " << opt.path_pq << std::endl;
+        index->write_residual_quantizer(opt.path_pq);
 
         if (opt.do_opq){
             std::cout << "Saving OPQ rotation matrix to " << opt.path_opq_matrix << std::endl;
@@ -86,6 +111,11 @@ int main(int argc, char **argv)
         }
         std::cout << "Saving Norm PQ codebook to " << opt.path_norm_pq << std::endl;
         faiss::write_ProductQuantizer(index->norm_pq, opt.path_norm_pq);
+
+        if (index->refine_pq) {
+            std::cout << "Saving Refinement PQ codebook to " << opt.path_refine_pq << std::endl;
+            faiss::write_ProductQuantizer(index->refine_pq, opt.path_refine_pq);
+        }
     }
 
     /************************/
@@ -95,7 +125,8 @@ int main(int argc, char **argv)
         std::cout << "Precomputing indices" << std::endl;
         StopW stopw = StopW();
 
-        std::ifstream input(opt.path_base, std::ios::binary);
+        XvecFile base_file(opt.path_base, sizeof(uint8_t));
+        base_file.check(opt.d, opt.nb);
         std::ofstream output(opt.path_precomputed_idxs, std::ios::binary);
 
         const uint32_t batch_size = 1000000;
@@ -110,7 +141,7 @@ int main(int argc, char **argv)
                 std::cout << "[" << stopw.getElapsedTimeMicro() / 1000000 << "s] "
                           << (100.*i) / nbatches << "%" << std::endl;
             }
-            readXvecFvec<uint8_t>(input, batch.data(), opt.d, batch_size);
+            base_file.read_floats<uint8_t>(i * batch_size, batch_size, batch.data());
             index->assign(batch_size, batch.data(), precomputed_idx.data());
 
             output.write((char *) &batch_size, sizeof(uint32_t));
@@ -125,40 +156,56 @@ int main(int argc, char **argv)
         // Load Index
         std::cout << "Loading index from " << opt.path_index << std::endl;
         index->read(opt.path_index);
+        if (opt.do_pack_ids)
+            index->pack_ids();
     } else {
         // Add elements
         StopW stopw = StopW();
 
-        std::ifstream base_input(opt.path_base, std::ios::binary);
-        std::ifstream idx_input(opt.path_precomputed_idxs, std::ios::binary);
-
         const size_t batch_size = 1000000;
         const size_t nbatches = opt.nb / batch_size;
+
+        // Precomputed indices are stored one batch per row and passed to add_batch in place
+        XvecFile base_file(opt.path_base, sizeof(uint8_t));
+        XvecFile idx_file(opt.path_precomputed_idxs, sizeof(idx_t));
+        base_file.check(opt.d, opt.nb);
+        idx_file.check(batch_size, nbatches);
+
         std::vector<float> batch(batch_size * opt.d);
-        std::vector <idx_t> idx_batch(batch_size);
-        std::vector <idx_t> ids_batch(batch_size);
+        std::vector<label_t> ids_batch(batch_size);
 
         for (size_t b = 0; b < nbatches; b++) {
             if (b % 10 == 0) {
                 std::cout << "[" << stopw.getElapsedTimeMicro() / 1000000 << "s] " << (100. * b) / nbatches << "%\n";
             }
-            readXvec<idx_t>(idx_input, idx_batch.data(), batch_size, 1);
-            readXvecFvec<uint8_t>(base_input, batch.data(), opt.d, batch_size);
+            const idx_t *idx_batch = idx_file.view<idx_t>(b, 1)[0];
+            base_file.read_floats<uint8_t>(b * batch_size, batch_size, batch.data());
 
             for (size_t i = 0; i < batch_size; i++)
                 ids_batch[i] = batch_size * b + i;
 
-            index->add_batch(batch_size, batch.data(), ids_batch.data(), idx_batch.data());
+            index->add_batch(batch_size, batch.data(), ids_batch.data(), idx_batch);
         }
 
+        report_arena_stats(std::cout);
+
         // Computing Centroid Norms
         std::cout << "Computing centroid norms"<< std::endl;
         index->compute_centroid_norms();
 
+        if (opt.do_pack_ids)
+            index->pack_ids();
+
         // Save index, pq and norm_pq
         std::cout << "Saving index to " << opt.path_index << std::endl;
         index->write(opt.path_index);
     }
+    // Split the oversized lists, the grown quantizer is saved with the index
+    if (opt.max_list_size > 0 && index->split_lists(opt.max_list_size) > 0) {
+        index->write_quantizer(opt.path_index);
+        std::cout << "Saving index to " << opt.path_index << std::endl;
+        index->write(opt.path_index);
+    }
     // For correct search using OPQ encoding rotate points in the coarse quantizer
     if (opt.do_opq) {
         std::cout << "Rotating centroids"<< std::endl;
@@ -179,8 +226,18 @@ int main(int argc, char **argv)
     //=======================
     index->nprobe = opt.nprobe;
     index->max_codes = opt.max_codes;
+    index->refine_k = opt.refine_k;
     index->quantizer->efSearch = opt.efSearch;
 
+    // Move the lists to the list file, only the hot lists are kept in RAM
+    if (opt.path_lists) {
+        if (!index->list_file_matches(opt.path_lists))
+            index->write_lists(opt.path_lists);
+        index->tier_lists(opt.path_lists, opt.cache_mb << 20, opt.io_threads);
+    }
+
+    hnswlib::reportHugePages(std::cout);
+
     //========
     // Search
     //========
@@ -212,6 +269,8 @@ int main(int argc, char **argv)
     const float time_us_per_query = stopw.getElapsedTimeMicro() / opt.nq;
     std::cout << "Recall@" << opt.k << ": " << 1.0f * correct / opt.nq << std::endl;
     std::cout << "Time per query: " << time_us_per_query << " us" << std::endl;
+    if (index->list_store)
+        index->list_store->report_stats(std::cout, opt.nq);
 
     delete index;
     return 0;
@@ -5,8 +5,10 @@
 #include <limits>
 #include <cmath>
 #include <chrono>
+#include <exception>
 #include <fstream>
 #include <iostream>
+#include <mutex>
 #include <sys/time.h>
 
 #include <faiss/utils/utils.h>
@@ -56,8 +58,8 @@ namespace ivfhnsw {
     }
 
     /// Read std::vector of the arbitrary type
-    template<typename T>
-    void read_vector(std::istream &in, std::vector<T> &vec)
+    template<typename T, typename A>
+    void read_vector(std::istream &in, std::vector<T, A> &vec)
     {
         uint32_t size;
         in.read((char *) &size, sizeof(uint32_t));
@@ -72,8 +74,8 @@ namespace ivfhnsw {
     }
 
     /// Write std::vector in the fvec/ivec/bvec format
-    template<typename T>
-    void write_vector(std::ostream &out, std::vector<T> &vec)
+    template<typename T, typename A>
+    void write_vector(std::ostream &out, std::vector<T, A> &vec)
     {
         const uint32_t size = vec.size();
         out.write((char *) &size, sizeof(uint32_t));
@@ -81,7 +83,7 @@ namespace ivfhnsw {
     }
 
 
-    /// Read fvec/ivec/bvec format vectors
+    /// Read fvec/ivec/bvec format vectors, XvecFile reads large datasets faster
     template<typename T>
     void readXvec(std::ifstream &in, T *data, const size_t d, const size_t n = 1)
     {
@@ -112,7 +114,7 @@ namespace ivfhnsw {
     void readXvecFvec(std::ifstream &in, float *data, const size_t d, const size_t n = 1)
     {
         uint32_t dim = d;
-        T mass[d];
+        std::vector<T> mass(d);
 
         for (size_t i = 0; i < n; i++) {
             in.read((char *) &dim, sizeof(uint32_t));
@@ -120,7 +122,7 @@ namespace ivfhnsw {
                 std::cout << "file error\n";
                 exit(1);
             }
-            in.read((char *) mass, dim * sizeof(T));
+            in.read((char *) mass.data(), dim * sizeof(T));
             for (size_t j = 0; j < d; j++)
                 data[i * dim + j] = 1. * mass[j];
         }
@@ -132,6 +134,30 @@ namespace ivfhnsw {
         return f.good();
     }
 
+    /// Keeps the first exception thrown in the iterations of an OpenMP loop, which can not leave the parallel region
+    class ParallelException {
+        std::exception_ptr first;
+        std::mutex guard;
+    public:
+        /// Run one iteration, its exception is kept if it is the first one
+        template<typename F>
+        void run(F iteration) {
+            try {
+                iteration();
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(guard);
+                if (!first)
+                    first = std::current_exception();
+            }
+        }
+
+        /// Rethrow the kept exception after the loop
+        void rethrow() const {
+            if (first)
+                std::rethrow_exception(first);
+        }
+    };
+
     /// Get a random subset of <sub_nx> elements from a set of <nx> elements
     void random_subset(const float *x, float *x_out, size_t d, size_t nx, size_t sub_nx);
 